@@ -9,27 +9,71 @@
     according to the GNU Public License.
 */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <limits.h>
+#include <linux/major.h>
+#include <poll.h>
+#include <pthread.h>
+#include <scsi/sg.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mtio.h"
+#include "scsi.h"
 #include "version.h"
 
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
 #ifndef DEFTAPE
 #define DEFTAPE "/dev/tape" /* default tape device */
 #endif                      /* DEFTAPE */
 
+#ifndef CATALOG_DIR
+#define CATALOG_DIR "/var/lib/mt-st/catalog" /* default directory of the catalogs */
+#endif                                       /* CATALOG_DIR */
+
+#ifndef MONITOR_DIR
+#define MONITOR_DIR "/var/lib/mt-st/monitor" /* default directory of the monitor rings */
+#endif                                       /* MONITOR_DIR */
+
+#ifndef MTD_SOCKET
+#define MTD_SOCKET "/run/mtd.sock" /* default socket of the daemon */
+#endif                             /* MTD_SOCKET */
+
 typedef struct cmdef_tr cmdef_tr;
 
 typedef int (*cmdfunc)(int, struct cmdef_tr *, int, char **);
@@ -56,6 +100,10 @@ struct cmdef_tr {
 #define DO_BOOLEANS 1002
 #define SET_BOOLEANS 1003
 #define CLEAR_BOOLEANS 1004
+#define STREAM_READ 1005
+#define STREAM_WRITE 1006
+#define STREAM_DUMP 1007
+#define STREAM_RESTORE 1008
 
 #define ET_ONLINE 1
 #define ET_WPROT 2
@@ -69,9 +117,41 @@ static int do_tell(int, cmdef_tr *, int, char **);
 static int do_partseek(int, cmdef_tr *, int, char **);
 static int do_status(int, cmdef_tr *, int, char **);
 static int print_densities(int, cmdef_tr *, int, char **);
-static int do_asf(int, cmdef_tr *, int, char **);
+static int do_space(int, cmdef_tr *, int, char **);
 static int do_show_options(int, cmdef_tr *, int, char **);
+static int do_iostat(int, cmdef_tr *, int, char **);
+static int do_monitor(int, cmdef_tr *, int, char **);
+static int do_stream(int, cmdef_tr *, int, char **);
+static int do_iobench(int, cmdef_tr *, int, char **);
+static int do_bench(int, cmdef_tr *, int, char **);
+static int do_catalog(int, cmdef_tr *, int, char **);
+static int do_extract(int, cmdef_tr *, int, char **);
+static int do_schedule(int, cmdef_tr *, int, char **);
+static int do_rao(int, cmdef_tr *, int, char **);
+static int do_logsense(int, cmdef_tr *, int, char **);
+static int catalog_open(int);
+static void catalog_learn(int, int);
+static long long catalog_lookup(int, int);
+static int catalog_locate(int, int, long long);
+static void catalog_reset(void);
 static void test_error(int, cmdef_tr *);
+static cmdef_tr *find_command(const char *, int *);
+static int open_tape(int, int);
+static int run_command(int, cmdef_tr *, int, char **);
+static int run_on_tape(cmdef_tr *, int, char **, char *, int, int);
+static char **expand_devices(const char *, int *);
+static int run_devices(char **, int, cmdef_tr *, int, char **, char *, int, int);
+static int do_batch(char *, int);
+static int parse_count(const char *, long long, long long *);
+static double elapsed_since(const struct timespec *);
+static int tape_ioctl(int, unsigned long, void *);
+static ssize_t tape_read(int, void *, size_t);
+static ssize_t tape_write(int, const void *, size_t);
+static void print_status(struct mtget *);
+static void print_tell(struct mtpos *);
+static void json_string(const char *);
+static int mtd_main(int, char **);
+static int mtd_client(int, char **);
 
 /* Formatting note: the tables below were formatted using Emacs's
  * extended align regex, using <,\(\s-+\)[A-Za-z0-9"]> as complex align
@@ -82,9 +162,9 @@ static cmdef_tr cmds[] = {
     { "weof",           MTWEOF,         do_standard,     0,                      FD_RDWR,   ONE_ARG,   ET_ONLINE | ET_WPROT },
     { "wset",           MTWSM,          do_standard,     0,                      FD_RDWR,   ONE_ARG,   ET_ONLINE | ET_WPROT },
     { "eof",            MTWEOF,         do_standard,     0,                      FD_RDWR,   ONE_ARG,   ET_ONLINE            },
-    { "fsf",            MTFSF,          do_standard,     0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
+    { "fsf",            MTFSF,          do_space,        0,                      FD_RDONLY, TWO_ARGS,  ET_ONLINE            },
     { "fsfm",           MTFSFM,         do_standard,     0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
-    { "bsf",            MTBSF,          do_standard,     0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
+    { "bsf",            MTBSF,          do_space,        0,                      FD_RDONLY, TWO_ARGS,  ET_ONLINE            },
     { "bsfm",           MTBSFM,         do_standard,     0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
     { "fsr",            MTFSR,          do_standard,     0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
     { "bsr",            MTBSR,          do_standard,     0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
@@ -123,16 +203,36 @@ static cmdef_tr cmds[] = {
     { "setpartition",   MTSETPART,      do_standard,     0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
     { "mkpartition",    MTMKPART,       do_standard,     0,                      FD_RDWR,   ONE_ARG,   ET_ONLINE            },
     { "partseek",       0,              do_partseek,     0,                      FD_RDONLY, TWO_ARGS,  ET_ONLINE            },
-    { "asf",            0,              do_asf,          MTREW,                  FD_RDONLY, ONE_ARG,   ET_ONLINE            },
+    { "asf",            0,              do_space,        0,                      FD_RDONLY, TWO_ARGS,  ET_ONLINE            },
     { "stshowoptions",  0,              do_show_options, 0,                      FD_RDONLY, ONE_ARG,   0                    },
+    { "iostat",         0,              do_iostat,       0,                      NO_FD,     MANY_ARGS, 0                    },
+    { "monitor",        0,              do_monitor,      0,                      NO_FD,     MANY_ARGS, 0                    },
+    { "read",           STREAM_READ,    do_stream,       0,                      FD_RDONLY, MANY_ARGS, ET_ONLINE            },
+    { "write",          STREAM_WRITE,   do_stream,       0,                      FD_RDWR,   MANY_ARGS, ET_ONLINE | ET_WPROT },
+    { "dump",           STREAM_DUMP,    do_stream,       0,                      FD_RDWR,   MANY_ARGS, ET_ONLINE | ET_WPROT },
+    { "restore",        STREAM_RESTORE, do_stream,       0,                      FD_RDONLY, MANY_ARGS, ET_ONLINE            },
+    { "iobench",        0,              do_iobench,      0,                      FD_RDWR,   MANY_ARGS, ET_ONLINE | ET_WPROT },
+    { "bench",          0,              do_bench,        0,                      NO_FD,     MANY_ARGS, 0                    },
+    { "extract",        0,              do_extract,      0,                      FD_RDONLY, MANY_ARGS, ET_ONLINE            },
+    { "schedule",       0,              do_schedule,     0,                      NO_FD,     MANY_ARGS, 0                    },
+    { "rao",            0,              do_rao,          0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
+    { "catalog",        0,              do_catalog,      0,                      FD_RDONLY, ONE_ARG,   ET_ONLINE            },
+    { "logsense",       0,              do_logsense,     0,                      FD_RDONLY, ONE_ARG,   0                    },
     { NULL,             0,              0,               0,                      NO_FD,     NO_ARGS,   0                    },
     /* clang-format on */
 };
 
 
+/* For serpentine media, the number of wraps, the native capacity (GB),
+   the length of the tape (m) and the locate speed (m/s) give the seek
+   times used by schedule; they are zero for the others */
 static struct densities {
     int code;
     char *name;
+    int wraps;
+    long long capacity;
+    double length;
+    double speed;
 } density_tbl[] = {
     /* clang-format off */
     /* Information taken from https://www.t10.org/ftp/x3t9.2/document.93/93-013r0.pdf:
@@ -144,108 +244,130 @@ static struct densities {
      * DDS: DAT Data Storage
      * RLL: Run Length Limited
      */
-    { 0x00, "default"                        },
-    { 0x01, "NRZI (800 bpi) 9 Track Reel"    },
-    { 0x02, "PE (1600 bpi) 9 Track Reel"     },
-    { 0x03, "GCR (6250 bpi) 9 Track Reel"    },
-    { 0x04, "QIC-11"                         },
-    { 0x05, "QIC-45/60 (GCR, 8000 bpi)"      },
-    { 0x06, "PE (3200 bpi) 9 Track Reel"     },
-    { 0x07, "IMFM (6400 bpi)"                },
-    { 0x08, "GCR (8000 bpi)"                 },
-    { 0x09, "3480/3490E, GCR (37871 bpi)"    },
-    { 0x0a, "MFM (6667 bpi)"                 },
-    { 0x0b, "PE (1600 bpi)"                  },
-    { 0x0c, "GCR (12960 bpi)"                },
-    { 0x0d, "GCR (25380 bpi)"                },
-    { 0x0f, "QIC-120 (GCR 10000 bpi)"        },
-    { 0x10, "QIC-150/250 (GCR 10000 bpi)"    },
-    { 0x11, "QIC-320/525 (GCR 16000 bpi)"    },
-    { 0x12, "QIC-1350 (RLL 51667 bpi)"       },
-    { 0x13, "DDS (61000 bpi)"                },
-    { 0x14, "EXB-8200 (RLL 43245 bpi)"       },
-    { 0x15, "EXB-8500 or QIC-1000"           },
-    { 0x16, "MFM 10000 bpi"                  },
-    { 0x17, "MFM 42500 bpi"                  },
-    { 0x18, "TZ86"                           },
-    { 0x19, "DLT 10GB"                       },
-    { 0x1a, "DLT 20GB"                       },
-    { 0x1b, "DLT 35GB"                       },
-    { 0x1c, "QIC-385M"                       },
-    { 0x1d, "QIC-410M"                       },
-    { 0x1e, "QIC-1000C"                      },
-    { 0x1f, "QIC-2100C"                      },
-    { 0x20, "QIC-6GB"                        },
-    { 0x21, "QIC-20GB"                       },
-    { 0x22, "QIC-2GB"                        },
-    { 0x23, "QIC-875"                        },
-    { 0x24, "DDS-2"                          },
-    { 0x25, "DDS-3"                          },
-    { 0x26, "DDS-4 or QIC-4GB"               },
-    { 0x27, "Exabyte Mammoth"                },
-    { 0x28, "Exabyte Mammoth-2"              },
-    { 0x29, "QIC-3080MC, IBM 3590 B"         },
-    { 0x2a, "IBM 3590 E"                     },
-    { 0x30, "AIT-1 or MLR3"                  },
-    { 0x31, "AIT-2"                          },
-    { 0x32, "AIT-3 or SLR7"                  },
-    { 0x33, "SLR6"                           },
-    { 0x34, "SLR100"                         },
-    { 0x40, "DLT1 40 GB, or Ultrium"         },
-    { 0x41, "DLT 40GB, or Ultrium2"          },
-    { 0x42, "LTO-2"                          },
-    { 0x44, "LTO-3"                          },
-    { 0x45, "QIC-3095-MC (TR-4)"             },
-    { 0x46, "LTO-4"                          },
-    { 0x47, "DDS-5 or TR-5"                  },
-    { 0x48, "SDLT220"                        },
-    { 0x49, "SDLT320"                        },
-    { 0x4a, "SDLT600, T10000A"               },
-    { 0x4b, "T10000B"                        },
-    { 0x4c, "T10000C"                        },
-    { 0x4d, "T10000D"                        },
-    { 0x51, "IBM 3592 J1A"                   },
-    { 0x52, "IBM 3592 E05 (TS1120)"          },
-    { 0x53, "IBM 3592 E06 (TS1130)"          },
-    { 0x54, "IBM 3592 E07 (TS1140)"          },
-    { 0x55, "IBM 3592 E08 (TS1150)"          },
-    { 0x56, "IBM 3592 55F (TS1155)"          },
-    { 0x57, "IBM 3592 60F (TS1160)"          },
-    { 0x58, "LTO-5"                          },
-    { 0x59, "IBM 3592 70F (TS1170)"          },
-    { 0x5a, "LTO-6"                          },
-    { 0x5c, "LTO-7"                          },
-    { 0x5d, "LTO-7-M8"                       },
-    { 0x5e, "LTO-8"                          },
-    { 0x60, "LTO-9"                          },
-    { 0x71, "IBM 3592 J1A, encrypted"        },
-    { 0x72, "IBM 3592 E05, encrypted"        },
-    { 0x73, "IBM 3592 E06, encrypted"        },
-    { 0x74, "IBM 3592 E07, encrypted"        },
-    { 0x75, "IBM 3592 E08, encrypted"        },
-    { 0x76, "IBM 3592 55F, encrypted"        },
-    { 0x77, "IBM 3592 60F, encrypted"        },
-    { 0x79, "IBM 3592 70F, encrypted"        },
-    { 0x80, "DLT 15GB uncomp. or Ecrix"      },
-    { 0x81, "DLT 15GB compressed"            },
-    { 0x82, "DLT 20GB uncompressed"          },
-    { 0x83, "DLT 20GB compressed"            },
-    { 0x84, "DLT 35GB uncompressed"          },
-    { 0x85, "DLT 35GB compressed"            },
-    { 0x86, "DLT1 40 GB uncompressed"        },
-    { 0x87, "DLT1 40 GB compressed"          },
-    { 0x88, "DLT 40GB uncompressed"          },
-    { 0x89, "DLT 40GB compressed"            },
-    { 0x8c, "EXB-8505 compressed"            },
-    { 0x90, "SDLT110 uncompr/EXB-8205 compr" },
-    { 0x91, "SDLT110 compressed"             },
-    { 0x92, "SDLT160 uncompressed"           },
-    { 0x93, "SDLT160 compressed"             }
+    { 0x00, "default",                          0,     0,    0,  0.0 },
+    { 0x01, "NRZI (800 bpi) 9 Track Reel",      0,     0,    0,  0.0 },
+    { 0x02, "PE (1600 bpi) 9 Track Reel",       0,     0,    0,  0.0 },
+    { 0x03, "GCR (6250 bpi) 9 Track Reel",      0,     0,    0,  0.0 },
+    { 0x04, "QIC-11",                           0,     0,    0,  0.0 },
+    { 0x05, "QIC-45/60 (GCR, 8000 bpi)",        0,     0,    0,  0.0 },
+    { 0x06, "PE (3200 bpi) 9 Track Reel",       0,     0,    0,  0.0 },
+    { 0x07, "IMFM (6400 bpi)",                  0,     0,    0,  0.0 },
+    { 0x08, "GCR (8000 bpi)",                   0,     0,    0,  0.0 },
+    { 0x09, "3480/3490E, GCR (37871 bpi)",      0,     0,    0,  0.0 },
+    { 0x0a, "MFM (6667 bpi)",                   0,     0,    0,  0.0 },
+    { 0x0b, "PE (1600 bpi)",                    0,     0,    0,  0.0 },
+    { 0x0c, "GCR (12960 bpi)",                  0,     0,    0,  0.0 },
+    { 0x0d, "GCR (25380 bpi)",                  0,     0,    0,  0.0 },
+    { 0x0f, "QIC-120 (GCR 10000 bpi)",          0,     0,    0,  0.0 },
+    { 0x10, "QIC-150/250 (GCR 10000 bpi)",      0,     0,    0,  0.0 },
+    { 0x11, "QIC-320/525 (GCR 16000 bpi)",      0,     0,    0,  0.0 },
+    { 0x12, "QIC-1350 (RLL 51667 bpi)",         0,     0,    0,  0.0 },
+    { 0x13, "DDS (61000 bpi)",                  0,     0,    0,  0.0 },
+    { 0x14, "EXB-8200 (RLL 43245 bpi)",         0,     0,    0,  0.0 },
+    { 0x15, "EXB-8500 or QIC-1000",             0,     0,    0,  0.0 },
+    { 0x16, "MFM 10000 bpi",                    0,     0,    0,  0.0 },
+    { 0x17, "MFM 42500 bpi",                    0,     0,    0,  0.0 },
+    { 0x18, "TZ86",                             0,     0,    0,  0.0 },
+    { 0x19, "DLT 10GB",                         0,     0,    0,  0.0 },
+    { 0x1a, "DLT 20GB",                         0,     0,    0,  0.0 },
+    { 0x1b, "DLT 35GB",                         0,     0,    0,  0.0 },
+    { 0x1c, "QIC-385M",                         0,     0,    0,  0.0 },
+    { 0x1d, "QIC-410M",                         0,     0,    0,  0.0 },
+    { 0x1e, "QIC-1000C",                        0,     0,    0,  0.0 },
+    { 0x1f, "QIC-2100C",                        0,     0,    0,  0.0 },
+    { 0x20, "QIC-6GB",                          0,     0,    0,  0.0 },
+    { 0x21, "QIC-20GB",                         0,     0,    0,  0.0 },
+    { 0x22, "QIC-2GB",                          0,     0,    0,  0.0 },
+    { 0x23, "QIC-875",                          0,     0,    0,  0.0 },
+    { 0x24, "DDS-2",                            0,     0,    0,  0.0 },
+    { 0x25, "DDS-3",                            0,     0,    0,  0.0 },
+    { 0x26, "DDS-4 or QIC-4GB",                 0,     0,    0,  0.0 },
+    { 0x27, "Exabyte Mammoth",                  0,     0,    0,  0.0 },
+    { 0x28, "Exabyte Mammoth-2",                0,     0,    0,  0.0 },
+    { 0x29, "QIC-3080MC, IBM 3590 B",           0,     0,    0,  0.0 },
+    { 0x2a, "IBM 3590 E",                       0,     0,    0,  0.0 },
+    { 0x30, "AIT-1 or MLR3",                    0,     0,    0,  0.0 },
+    { 0x31, "AIT-2",                            0,     0,    0,  0.0 },
+    { 0x32, "AIT-3 or SLR7",                    0,     0,    0,  0.0 },
+    { 0x33, "SLR6",                             0,     0,    0,  0.0 },
+    { 0x34, "SLR100",                           0,     0,    0,  0.0 },
+    { 0x40, "DLT1 40 GB, or Ultrium",           0,     0,    0,  0.0 },
+    { 0x41, "DLT 40GB, or Ultrium2",            0,     0,    0,  0.0 },
+    { 0x42, "LTO-2",                            0,     0,    0,  0.0 },
+    { 0x44, "LTO-3",                           44,   400,  680,  8.0 },
+    { 0x45, "QIC-3095-MC (TR-4)",               0,     0,    0,  0.0 },
+    { 0x46, "LTO-4",                           56,   800,  820,  8.0 },
+    { 0x47, "DDS-5 or TR-5",                    0,     0,    0,  0.0 },
+    { 0x48, "SDLT220",                          0,     0,    0,  0.0 },
+    { 0x49, "SDLT320",                          0,     0,    0,  0.0 },
+    { 0x4a, "SDLT600, T10000A",                 0,     0,    0,  0.0 },
+    { 0x4b, "T10000B",                          0,     0,    0,  0.0 },
+    { 0x4c, "T10000C",                          0,     0,    0,  0.0 },
+    { 0x4d, "T10000D",                          0,     0,    0,  0.0 },
+    { 0x51, "IBM 3592 J1A",                     0,     0,    0,  0.0 },
+    { 0x52, "IBM 3592 E05 (TS1120)",            0,     0,    0,  0.0 },
+    { 0x53, "IBM 3592 E06 (TS1130)",            0,     0,    0,  0.0 },
+    { 0x54, "IBM 3592 E07 (TS1140)",            0,     0,    0,  0.0 },
+    { 0x55, "IBM 3592 E08 (TS1150)",            0,     0,    0,  0.0 },
+    { 0x56, "IBM 3592 55F (TS1155)",            0,     0,    0,  0.0 },
+    { 0x57, "IBM 3592 60F (TS1160)",            0,     0,    0,  0.0 },
+    { 0x58, "LTO-5",                           80,  1500,  846,  8.0 },
+    { 0x59, "IBM 3592 70F (TS1170)",            0,     0,    0,  0.0 },
+    { 0x5a, "LTO-6",                          136,  2500,  846,  8.0 },
+    { 0x5c, "LTO-7",                          112,  6000,  960, 10.0 },
+    { 0x5d, "LTO-7-M8",                       168,  9000,  960, 10.0 },
+    { 0x5e, "LTO-8",                          208, 12000,  960, 10.0 },
+    { 0x60, "LTO-9",                          280, 18000, 1035, 10.0 },
+    { 0x71, "IBM 3592 J1A, encrypted",          0,     0,    0,  0.0 },
+    { 0x72, "IBM 3592 E05, encrypted",          0,     0,    0,  0.0 },
+    { 0x73, "IBM 3592 E06, encrypted",          0,     0,    0,  0.0 },
+    { 0x74, "IBM 3592 E07, encrypted",          0,     0,    0,  0.0 },
+    { 0x75, "IBM 3592 E08, encrypted",          0,     0,    0,  0.0 },
+    { 0x76, "IBM 3592 55F, encrypted",          0,     0,    0,  0.0 },
+    { 0x77, "IBM 3592 60F, encrypted",          0,     0,    0,  0.0 },
+    { 0x79, "IBM 3592 70F, encrypted",          0,     0,    0,  0.0 },
+    { 0x80, "DLT 15GB uncomp. or Ecrix",        0,     0,    0,  0.0 },
+    { 0x81, "DLT 15GB compressed",              0,     0,    0,  0.0 },
+    { 0x82, "DLT 20GB uncompressed",            0,     0,    0,  0.0 },
+    { 0x83, "DLT 20GB compressed",              0,     0,    0,  0.0 },
+    { 0x84, "DLT 35GB uncompressed",            0,     0,    0,  0.0 },
+    { 0x85, "DLT 35GB compressed",              0,     0,    0,  0.0 },
+    { 0x86, "DLT1 40 GB uncompressed",          0,     0,    0,  0.0 },
+    { 0x87, "DLT1 40 GB compressed",            0,     0,    0,  0.0 },
+    { 0x88, "DLT 40GB uncompressed",            0,     0,    0,  0.0 },
+    { 0x89, "DLT 40GB compressed",              0,     0,    0,  0.0 },
+    { 0x8c, "EXB-8505 compressed",              0,     0,    0,  0.0 },
+    { 0x90, "SDLT110 uncompr/EXB-8205 compr",   0,     0,    0,  0.0 },
+    { 0x91, "SDLT110 compressed",               0,     0,    0,  0.0 },
+    { 0x92, "SDLT160 uncompressed",             0,     0,    0,  0.0 },
+    { 0x93, "SDLT160 compressed",               0,     0,    0,  0.0 }
     /* clang-format on */
 };
 
 #define NBR_DENSITIES (sizeof(density_tbl) / sizeof(struct densities))
 
+static struct gstat_bits {
+    char *name;
+    unsigned long bitmask;
+} gstat_tbl[] = {
+    /* clang-format off */
+    { "EOF",       GMT_EOF(~0UL)       },
+    { "BOT",       GMT_BOT(~0UL)       },
+    { "EOT",       GMT_EOT(~0UL)       },
+    { "SM",        GMT_SM(~0UL)        },
+    { "EOD",       GMT_EOD(~0UL)       },
+    { "WR_PROT",   GMT_WR_PROT(~0UL)   },
+    { "ONLINE",    GMT_ONLINE(~0UL)    },
+    { "D_6250",    GMT_D_6250(~0UL)    },
+    { "D_1600",    GMT_D_1600(~0UL)    },
+    { "D_800",     GMT_D_800(~0UL)     },
+    { "DR_OPEN",   GMT_DR_OPEN(~0UL)   },
+    { "IM_REP_EN", GMT_IM_REP_EN(~0UL) },
+    { "CLN",       GMT_CLN(~0UL)       },
+    { NULL,        0                   }
+    /* clang-format on */
+};
+
 static struct booleans {
     char *name;
     unsigned long bitmask;
@@ -276,14 +398,21 @@ static struct booleans {
 };
 
 static char *tape_name; /* The tape name for messages */
+static int output_json; /* the reports are printed as JSON */
 
 
 int main(int argc, char **argv)
 {
-    int mtfd, i, argn, oflags;
-    unsigned int len;
-    char *cmdstr;
-    cmdef_tr *comp, *comp2;
+    int i, argn, ambiguous, keep_going = 0, use_daemon = 0, ndevices;
+    char *cmdstr, *script = NULL, *progname, **names;
+    cmdef_tr *comp;
+
+    if ((progname = strrchr(argv[0], '/')) != NULL)
+        progname++;
+    else
+        progname = argv[0];
+    if (!strcmp(progname, "mtd"))
+        return mtd_main(argc, argv);
 
     for (argn = 1; argn < argc; argn++)
         if (*argv[argn] == '-')
@@ -296,6 +425,30 @@ int main(int argc, char **argv)
                 }
                 tape_name = argv[argn];
                 break;
+            case 'b':
+                argn += 1;
+                if (argn >= argc) {
+                    usage(0, 1);
+                }
+                script = argv[argn];
+                break;
+            case 'k':
+                keep_going = 1;
+                break;
+            case 'o':
+                argn += 1;
+                if (argn >= argc) {
+                    usage(0, 1);
+                }
+                if (!strcmp(argv[argn], "json"))
+                    output_json = 1;
+                else if (!strcmp(argv[argn], "text"))
+                    output_json = 0;
+                else {
+                    fprintf(stderr, "mt: unknown output format '%s'.\n", argv[argn]);
+                    exit(1);
+                }
+                break;
             case 'h':
                 usage(1, 0);
                 break;
@@ -303,6 +456,14 @@ int main(int argc, char **argv)
                 version();
                 break;
             case '-':
+                if (!strcmp(argv[argn], "--daemon")) {
+                    use_daemon = 1;
+                    break;
+                }
+                if (!strcmp(argv[argn], "--json")) {
+                    output_json = 1;
+                    break;
+                }
                 if (*(argv[argn] + 1) == '-' && *(argv[argn] + 2) == 'v') {
                     version();
                 }
@@ -323,61 +484,473 @@ int main(int argc, char **argv)
         }
     }
 
-    if (argn >= argc) {
-        usage(0, 1);
-    }
-    cmdstr = argv[argn++];
+    if (script != NULL) {
+        if (use_daemon) {
+            fprintf(stderr, "mt: -b can't be used with --daemon.\n");
+            exit(1);
+        }
+        if (argn < argc) {
+            fprintf(stderr, "mt: no command arguments allowed with -b.\n");
+            exit(1);
+        }
+        comp = NULL;
+    } else {
+        if (argn >= argc) {
+            usage(0, 1);
+        }
+        cmdstr = argv[argn++];
 
-    len = strlen(cmdstr);
-    for (comp = cmds; comp->cmd_name != NULL; comp++)
-        if (strncmp(cmdstr, comp->cmd_name, len) == 0)
-            break;
-    if (comp->cmd_name == NULL) {
-        fprintf(stderr, "mt: unknown command \"%s\"\n", cmdstr);
-        usage(1, 1);
-    }
-    if (len != strlen(comp->cmd_name)) {
-        for (comp2 = comp + 1; comp2->cmd_name != NULL; comp2++)
-            if (strncmp(cmdstr, comp2->cmd_name, len) == 0)
-                break;
-        if (comp2->cmd_name != NULL) {
-            fprintf(stderr, "mt: ambiguous command \"%s\"\n", cmdstr);
+        if ((comp = find_command(cmdstr, &ambiguous)) == NULL) {
+            fprintf(stderr, "mt: %s command \"%s\"\n",
+                    ambiguous ? "ambiguous" : "unknown", cmdstr);
             usage(1, 1);
         }
+        if (comp->arg_cnt != MANY_ARGS && comp->arg_cnt < argc - argn) {
+            fprintf(stderr, "mt: too many arguments for the command '%s'.\n", comp->cmd_name);
+            exit(1);
+        }
+    }
+
+    if (strpbrk(tape_name, ",*?[") != NULL) {
+        if (script != NULL && !strcmp(script, "-")) {
+            fprintf(stderr, "mt: the script can't be read from stdin for many devices.\n");
+            exit(1);
+        }
+        if ((names = expand_devices(tape_name, &ndevices)) == NULL)
+            exit(1);
+        i = run_devices(names, ndevices, comp, argc - argn + 1, argv + argn - 1, script,
+                        keep_going, use_daemon);
+        for (argn = 0; argn < ndevices; argn++)
+            free(names[argn]);
+        free(names);
+        return i;
     }
-    if (comp->arg_cnt != MANY_ARGS && comp->arg_cnt < argc - argn) {
-        fprintf(stderr, "mt: too many arguments for the command '%s'.\n", comp->cmd_name);
-        exit(1);
+    return run_on_tape(comp, argc - argn + 1, argv + argn - 1, script, keep_going, use_daemon);
+}
+
+
+/* Run the command, whose name is in argv[0], or the script on the
+   device tape_name */
+static int run_on_tape(cmdef_tr *comp, int argc, char **argv, char *script, int keep_going,
+                       int use_daemon)
+{
+    int mtfd, i;
+
+    if (script != NULL)
+        return do_batch(script, keep_going);
+    if (use_daemon) {
+        argv[0] = comp->cmd_name;
+        return mtd_client(argc, argv);
     }
 
     if (comp->cmd_fdtype != NO_FD) {
-        oflags = comp->cmd_fdtype == FD_RDONLY ? O_RDONLY : O_RDWR;
-        if ((comp->error_tests & ET_ONLINE) == 0)
-            oflags |= O_NONBLOCK;
-        if ((mtfd = open(tape_name, oflags)) < 0) {
+        if ((mtfd = open_tape(comp->cmd_fdtype, comp->error_tests & ET_ONLINE)) < 0) {
             perror(tape_name);
-            exit(1);
+            return 1;
         }
     } else
         mtfd = (-1);
 
-    if (comp->cmd_function != NULL) {
-        i = comp->cmd_function(mtfd, comp, argc - argn,
-                               (argc - argn > 0 ? argv + argn : NULL));
-        if (i) {
-            if (errno == ENOSYS)
-                fprintf(stderr, "mt: Command not supported by this kernel.\n");
-            else if (comp->error_tests != 0)
-                test_error(mtfd, comp);
+    i = run_command(mtfd, comp, argc - 1, (argc > 1 ? argv + 1 : NULL));
+
+    if (mtfd >= 0)
+        close(mtfd);
+    return i;
+}
+
+
+/*** Running on many devices ***/
+
+/* The device given with -f (or TAPE) can be a comma separated list of
+   devices and glob patterns. The command is then run on all of them at
+   the same time, each in a child process whose standard output and error
+   are collected. The outputs are printed in the order of the devices,
+   each after a line with the device name (not with JSON output, which
+   gives one object per line), and the exit status is the largest of those
+   of the devices. */
+
+static int cmp_devices(const void *a, const void *b)
+{
+    return strverscmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int add_device(char ***names, int *n, int *max, const char *name)
+{
+    char **p;
+    int i;
+
+    for (i = 0; i < *n; i++)
+        if (!strcmp((*names)[i], name))
+            return 0;
+    if (*n == *max) {
+        *max = *max ? *max * 2 : 16;
+        if ((p = realloc(*names, *max * sizeof(char *))) == NULL)
+            return (-1);
+        *names = p;
+    }
+    if (((*names)[*n] = strdup(name)) == NULL)
+        return (-1);
+    (*n)++;
+    return 0;
+}
+
+/* Expand the list of devices. The matches of a pattern are sorted so
+   that nst2 comes before nst10. */
+static char **expand_devices(const char *spec, int *ndevices)
+{
+    char **names = NULL, *list, *part, *save;
+    glob_t g;
+    size_t i;
+    int n = 0, max = 0, rv, result = 0;
+
+    if ((list = strdup(spec)) == NULL) {
+        perror("mt");
+        return NULL;
+    }
+    for (part = strtok_r(list, ",", &save); part != NULL && result == 0;
+         part = strtok_r(NULL, ",", &save)) {
+        if (strpbrk(part, "*?[") == NULL) {
+            result = add_device(&names, &n, &max, part);
+            continue;
         }
-    } else {
+        if ((rv = glob(part, GLOB_NOSORT, NULL, &g)) != 0) {
+            fprintf(stderr, "mt: %s '%s'.\n",
+                    rv == GLOB_NOMATCH ? "no devices match" : "can't expand", part);
+            result = 1;
+            continue;
+        }
+        qsort(g.gl_pathv, g.gl_pathc, sizeof(char *), cmp_devices);
+        for (i = 0; i < g.gl_pathc && result == 0; i++)
+            result = add_device(&names, &n, &max, g.gl_pathv[i]);
+        globfree(&g);
+    }
+    free(list);
+    if (result < 0)
+        perror("mt");
+    if (result == 0 && n == 0) {
+        fprintf(stderr, "mt: no devices in '%s'.\n", spec);
+        result = 1;
+    }
+    if (result != 0) {
+        for (rv = 0; rv < n; rv++)
+            free(names[rv]);
+        free(names);
+        return NULL;
+    }
+    *ndevices = n;
+    return names;
+}
+
+static void copy_output(FILE *from, FILE *to)
+{
+    char buf[4096];
+    size_t n;
+
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+        if (fwrite(buf, 1, n, to) != n)
+            break;
+    fflush(to);
+}
+
+static int run_devices(char **names, int n, cmdef_tr *comp, int argc, char **argv,
+                       char *script, int keep_going, int use_daemon)
+{
+    struct device_run {
+        pid_t pid;
+        FILE *out, *err;
+        int result;
+    } *runs;
+    int i, status, result = 0;
+
+    if ((runs = calloc(n, sizeof(struct device_run))) == NULL) {
+        perror("mt");
+        return 2;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < n; i++) {
+        runs[i].pid = -1;
+        runs[i].result = 2;
+        if ((runs[i].out = tmpfile()) == NULL || (runs[i].err = tmpfile()) == NULL) {
+            perror("mt");
+            continue;
+        }
+        if ((runs[i].pid = fork()) < 0)
+            perror("mt: fork");
+        else if (runs[i].pid == 0) {
+            if (dup2(fileno(runs[i].out), 1) < 0 || dup2(fileno(runs[i].err), 2) < 0)
+                _exit(2);
+            tape_name = names[i];
+            status = run_on_tape(comp, argc, argv, script, keep_going, use_daemon);
+            scsi_print_stats();
+            fflush(stdout);
+            fflush(stderr);
+            _exit(status);
+        }
+    }
+    for (i = 0; i < n; i++)
+        if (runs[i].pid > 0) {
+            while (waitpid(runs[i].pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            runs[i].result = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+        }
+
+    for (i = 0; i < n; i++) {
+        if (!output_json) /* the objects name their devices */
+            printf("%s%s:\n", i > 0 ? "\n" : "", names[i]);
+        if (runs[i].out != NULL)
+            copy_output(runs[i].out, stdout);
+        else
+            fflush(stdout);
+        if (runs[i].err != NULL)
+            copy_output(runs[i].err, stderr);
+        if (runs[i].result > result)
+            result = runs[i].result;
+        if (runs[i].out != NULL)
+            fclose(runs[i].out);
+        if (runs[i].err != NULL)
+            fclose(runs[i].err);
+    }
+    free(runs);
+    return result;
+}
+
+
+/* Look up a command by its name or an unique abbreviation of it. A full
+   name is never taken as an abbreviation of a longer one. Returns NULL
+   if the name is unknown or ambiguous, and sets *ambiguous
+   accordingly. */
+static cmdef_tr *find_command(const char *cmdstr, int *ambiguous)
+{
+    unsigned int len;
+    cmdef_tr *comp, *comp2;
+
+    *ambiguous = 0;
+    for (comp = cmds; comp->cmd_name != NULL; comp++)
+        if (strcmp(cmdstr, comp->cmd_name) == 0)
+            return comp;
+    len = strlen(cmdstr);
+    for (comp = cmds; comp->cmd_name != NULL; comp++)
+        if (strncmp(cmdstr, comp->cmd_name, len) == 0)
+            break;
+    if (comp->cmd_name == NULL)
+        return NULL;
+    for (comp2 = comp + 1; comp2->cmd_name != NULL; comp2++)
+        if (strncmp(cmdstr, comp2->cmd_name, len) == 0)
+            break;
+    if (comp2->cmd_name != NULL) {
+        *ambiguous = 1;
+        return NULL;
+    }
+    return comp;
+}
+
+
+/* Open the tape device with the access mode needed by a command */
+static int open_tape(int fdtype, int need_online)
+{
+    int oflags;
+
+    oflags = fdtype == FD_RDONLY ? O_RDONLY : O_RDWR;
+    if (!need_online)
+        oflags |= O_NONBLOCK;
+    return open(tape_name, oflags);
+}
+
+
+/* Run one command and try to explain why it failed */
+static int run_command(int mtfd, cmdef_tr *comp, int argc, char **argv)
+{
+    int i;
+
+    if (comp->cmd_function == NULL) {
         fprintf(stderr, "mt: Internal error: command without function.\n");
-        i = 1;
+        return 1;
+    }
+    i = comp->cmd_function(mtfd, comp, argc, argv);
+    if (i) {
+        if (errno == ENOSYS)
+            fprintf(stderr, "mt: Command not supported by this kernel.\n");
+        else if (comp->error_tests != 0)
+            test_error(mtfd, comp);
+    }
+    return i;
+}
+
+
+/*** Batch mode: many commands over one open of the device ***/
+
+typedef struct {
+    int lineno;
+    char *line;
+    cmdef_tr *comp;
+    int argc;
+    char **argv;
+    int result;
+    double elapsed;
+} batch_cmd;
+
+#define BATCH_NOT_RUN (-1)
+
+static void free_batch(batch_cmd *, int);
+
+/* Split a script line into words, dropping comments. The words point
+   into the (modified) line. Returns the number of words. */
+static int split_line(char *line, char ***wordsp)
+{
+    int n = 0;
+    char *cp, **words;
+
+    if ((cp = strchr(line, '#')) != NULL)
+        *cp = '\0';
+    if ((words = malloc((strlen(line) / 2 + 2) * sizeof(char *))) == NULL)
+        return (-1);
+    for (cp = strtok(line, " \t\r\n"); cp != NULL; cp = strtok(NULL, " \t\r\n"))
+        words[n++] = cp;
+    words[n] = NULL;
+    *wordsp = words;
+    return n;
+}
+
+/* Read the whole script and resolve the commands before running any of
+   them, so that a typo late in the script doesn't leave the tape at an
+   unexpected position. */
+static int parse_batch(FILE *f, const char *script, batch_cmd **cmdsp)
+{
+    int n = 0, alloc = 0, lineno = 0, words, ambiguous, errors = 0;
+    char *line = NULL, *copy, **argv;
+    size_t linelen = 0;
+    batch_cmd *bc = NULL, *tmp;
+    cmdef_tr *comp;
+
+    while (getline(&line, &linelen, f) >= 0) {
+        lineno++;
+        if ((copy = strdup(line)) == NULL || (words = split_line(copy, &argv)) < 0) {
+            fprintf(stderr, "mt: out of memory reading '%s'.\n", script);
+            exit(1);
+        }
+        if ((comp = words > 0 ? find_command(argv[0], &ambiguous) : NULL) == NULL) {
+            if (words > 0) {
+                fprintf(stderr, "mt: %s:%d: %s command \"%s\"\n", script, lineno,
+                        ambiguous ? "ambiguous" : "unknown", argv[0]);
+                errors++;
+            }
+            free(argv);
+            free(copy);
+            continue;
+        }
+        if (comp->arg_cnt != MANY_ARGS && comp->arg_cnt < words - 1) {
+            fprintf(stderr, "mt: %s:%d: too many arguments for the command '%s'.\n",
+                    script, lineno, comp->cmd_name);
+            errors++;
+        }
+        if (n == alloc) {
+            alloc = alloc ? alloc * 2 : 16;
+            if ((tmp = realloc(bc, alloc * sizeof(batch_cmd))) == NULL) {
+                fprintf(stderr, "mt: out of memory reading '%s'.\n", script);
+                exit(1);
+            }
+            bc = tmp;
+        }
+        bc[n].lineno = lineno;
+        bc[n].line = copy;
+        bc[n].comp = comp;
+        bc[n].argc = words - 1;
+        bc[n].argv = argv;
+        bc[n].result = BATCH_NOT_RUN;
+        bc[n].elapsed = 0.0;
+        n++;
+    }
+    free(line);
+    *cmdsp = bc;
+    if (errors) {
+        free_batch(bc, n);
+        return (-1);
+    }
+    return n;
+}
+
+static void free_batch(batch_cmd *bc, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        free(bc[i].argv);
+        free(bc[i].line);
+    }
+    free(bc);
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Run the commands from a script (stdin for "-") using a single open of
+   the tape device. Stops at the first failing command unless keep_going
+   is set. Returns the status of the first failed command. */
+static int do_batch(char *script, int keep_going)
+{
+    int i, n, mtfd = -1, fdtype = NO_FD, need_online = 0, retval = 0;
+    FILE *f;
+    batch_cmd *bc;
+    struct timespec start;
+
+    if (!strcmp(script, "-"))
+        f = stdin;
+    else if ((f = fopen(script, "r")) == NULL) {
+        perror(script);
+        return 1;
+    }
+    n = parse_batch(f, script, &bc);
+    if (f != stdin)
+        fclose(f);
+    if (n < 0)
+        return 1;
+
+    for (i = 0; i < n; i++) {
+        if (bc[i].comp->cmd_fdtype > fdtype)
+            fdtype = bc[i].comp->cmd_fdtype;
+        if (bc[i].comp->error_tests & ET_ONLINE)
+            need_online = 1;
+    }
+    if (fdtype != NO_FD && (mtfd = open_tape(fdtype, need_online)) < 0) {
+        perror(tape_name);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bc[i].result = run_command(mtfd, bc[i].comp, bc[i].argc,
+                                   (bc[i].argc > 0 ? bc[i].argv + 1 : NULL));
+        bc[i].elapsed = elapsed_since(&start);
+        if (bc[i].result != 0) {
+            if (retval == 0)
+                retval = bc[i].result;
+            if (!keep_going)
+                break;
+        }
     }
 
     if (mtfd >= 0)
         close(mtfd);
-    return i;
+
+    fflush(stdout);
+    fprintf(stderr, "Batch summary for '%s':\n", tape_name);
+    fprintf(stderr, "  line  command          status  time (s)\n");
+    for (i = 0; i < n; i++) {
+        fprintf(stderr, "  %4d  %-15s  ", bc[i].lineno, bc[i].comp->cmd_name);
+        if (bc[i].result == BATCH_NOT_RUN)
+            fprintf(stderr, "skipped\n");
+        else
+            fprintf(stderr, "%6d  %8.3f\n", bc[i].result, bc[i].elapsed);
+    }
+    free_batch(bc, n);
+    return retval;
 }
 
 
@@ -393,8 +966,10 @@ static void usage(int explain, int exit_code)
     int ind;
     int counter = 0;
 
-    fprintf(stderr, "usage: mt [-v] [--version] [-h] [ -f device ] command [ "
-                    "count ]\n");
+    fprintf(stderr, "usage: mt [-v] [--version] [-h] [ -f device ] [--json | -o json|text] "
+                    "command [ count ]\n");
+    fprintf(stderr, "       mt [ -f device ] [-k] -b script|-\n");
+    fprintf(stderr, "       mt --daemon [ -f device ] command [ count ]\n");
     fprintf(stderr, "default tape device: %s\n", DEFTAPE);
     if (explain) {
         for (ind = 0; cmds[ind].cmd_name != NULL;) {
@@ -420,43 +995,79 @@ static void usage(int explain, int exit_code)
 }
 
 
+/* Parse a count with an optional k, M or G suffix (units of 1024, 1024 *
+   1024 or 1024 * 1024 * 1024). The absolute value of the result must not
+   exceed max. Returns 0 on success, 3 after printing an error message. */
+static int parse_count(const char *arg, long long max, long long *count)
+{
+    long long multiplier = 1;
+    char *endp;
+
+    *count = strtoll(arg, &endp, 0);
+    if (endp == arg)
+        return 0;
+    if (*endp == 'k')
+        multiplier = 1024;
+    else if (*endp == 'M')
+        multiplier = 1024 * 1024;
+    else if (*endp == 'G')
+        multiplier = 1024 * 1024 * 1024;
+    else if (*endp != 0) {
+        fprintf(stderr, "mt: illegal count unit.\n");
+        return 3;
+    }
+    if (llabs(*count) > max / multiplier) {
+        fprintf(stderr, "mt: repeat count too large.\n");
+        return 3;
+    }
+    *count *= multiplier;
+    return 0;
+}
+
+
 /* Do a command that simply feeds an argument to the MTIOCTOP ioctl */
 static int do_standard(int mtfd, cmdef_tr *cmd, int argc, char **argv)
 {
-    int multiplier, max_count;
+    long long count = 1, lba;
     struct mtop mt_com;
-    char *endp;
 
     mt_com.mt_op = cmd->cmd_code;
-    mt_com.mt_count = (argc > 0 ? strtol(*argv, &endp, 0) : 1);
-    if (argc > 0 && endp != *argv) {
-        multiplier = 1;
-        if (*endp == 'k')
-            multiplier = 1024;
-        else if (*endp == 'M')
-            multiplier = 1024 * 1024;
-        else if (*endp == 'G')
-            multiplier = 1024 * 1024 * 1024;
-        else if (*endp != 0) {
-            fprintf(stderr, "mt: illegal count unit.\n");
-            return 3;
-        }
-        max_count = INT_MAX / multiplier;
-        if (abs(mt_com.mt_count) > max_count) {
-            fprintf(stderr, "mt: repeat count too large.\n");
-            return 3;
-        }
-        mt_com.mt_count *= multiplier;
-    }
+    if (argc > 0 && parse_count(*argv, INT_MAX, &count) != 0)
+        return 3;
+    mt_com.mt_count = count;
     mt_com.mt_count |= cmd->cmd_count_bits;
     if (mt_com.mt_op != MTMKPART && mt_com.mt_count < 0) {
         fprintf(stderr, "mt: negative repeat count\n");
         return 1;
     }
-    if (ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+    switch (mt_com.mt_op) {
+    case MTEOM:
+        /* A known end of data is located directly */
+        if ((lba = catalog_lookup(mtfd, -1)) >= 0 && catalog_locate(mtfd, -1, lba) == 0)
+            return 0;
+        break;
+    }
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
         perror(tape_name);
         return 2;
     }
+    /* The cartridge is identified only after a write, so that the tape is
+       not read or moved before it */
+    switch (mt_com.mt_op) {
+    case MTEOM:
+        catalog_learn(mtfd, 0);
+        break;
+    case MTWEOF:
+    case MTWSM:
+    case MTERASE:
+        catalog_learn(mtfd, 1);
+        break;
+    case MTOFFL:
+    case MTLOAD:
+    case MTUNLOAD:
+        catalog_reset();
+        break;
+    }
     return 0;
 }
 
@@ -478,7 +1089,7 @@ static int do_drvbuffer(int mtfd, cmdef_tr *cmd, int argc, char **argv)
     else
         mt_com.mt_count &= 0xfffffff;
     mt_com.mt_count |= cmd->cmd_count_bits;
-    if (ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
         perror(tape_name);
         return 2;
     }
@@ -533,7 +1144,7 @@ static int do_options(int mtfd, cmdef_tr *cmd, int argc, char **argv)
         mt_com.mt_count |= MT_ST_CLEARBOOLEANS;
         break;
     }
-    if (ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
         perror(tape_name);
         return 2;
     }
@@ -549,14 +1160,39 @@ static int do_tell(int mtfd,
 {
     struct mtpos mt_pos;
 
-    if (ioctl(mtfd, MTIOCPOS, (char *)&mt_pos) < 0) {
+    if (tape_ioctl(mtfd, MTIOCPOS, (char *)&mt_pos) < 0) {
         perror(tape_name);
         return 2;
     }
-    printf("At block %ld.\n", mt_pos.mt_blkno);
+    print_tell(&mt_pos);
     return 0;
 }
 
+static void print_tell(struct mtpos *mt_pos)
+{
+    if (output_json) {
+        printf("{\"device\":");
+        json_string(tape_name);
+        printf(",\"block\":%ld}\n", mt_pos->mt_blkno);
+    } else
+        printf("At block %ld.\n", mt_pos->mt_blkno);
+}
+
+
+/* Print a string as a JSON string */
+static void json_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++)
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    putchar('"');
+}
+
 
 /* Position the tape to a specific location within a specified partition */
 static int do_partseek(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc, char **argv)
@@ -565,13 +1201,13 @@ static int do_partseek(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc
 
     mt_com.mt_op = MTSETPART;
     mt_com.mt_count = (argc > 0 ? strtol(*argv, NULL, 0) : 0);
-    if (ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
         perror(tape_name);
         return 2;
     }
     mt_com.mt_op = MTSEEK;
     mt_com.mt_count = (argc > 1 ? strtol(argv[1], NULL, 0) : 0);
-    if (ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
         perror(tape_name);
         return 2;
     }
@@ -579,120 +1215,765 @@ static int do_partseek(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc
 }
 
 
-/* Position to start of file n. This might be implemented more intelligently
-   some day. */
-static int do_asf(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc, char **argv)
+/*** Planning the tape movements ***/
+
+/* fsf, bsf and asf choose the cheapest way to reach the target from the
+   current file and block number. The cost is counted in files passed
+   over. Each command costs PLAN_CMD_COST extra, and rewinding is much
+   faster per file than spacing over filemarks. */
+
+#define PLAN_CMD_COST 2.0
+#define PLAN_REWIND_COST 0.2
+#define PLAN_MAXSTEPS 3
+#define PLAN_MAXCANDS 5
+
+typedef struct {
+    int nsteps;
+    int op[PLAN_MAXSTEPS];
+    int count[PLAN_MAXSTEPS];
+    double cost;
+} tape_plan;
+
+static void plan_add(tape_plan *p, int op, int count)
 {
-    struct mtop mt_com;
+    p->op[p->nsteps] = op;
+    p->count[p->nsteps++] = count;
+    if (op == MTSEEK)
+        p->cost += PLAN_CMD_COST; /* a locate to a block from the catalog */
+    else
+        p->cost += PLAN_CMD_COST + (op == MTREW ? PLAN_REWIND_COST * count : count);
+}
 
-    mt_com.mt_op = MTREW;
-    mt_com.mt_count = 1;
-    if (ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
-        perror(tape_name);
-        return 2;
-    }
-    mt_com.mt_count = (argc > 0 ? strtol(*argv, NULL, 0) : 0);
-    if (mt_com.mt_count > 0) {
-        mt_com.mt_op = MTFSF;
-        if (ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
-            perror(tape_name);
-            return 2;
+/* Make the candidate plans for the operation op (MTFSF, MTBSF or 0 for
+   asf) with count from file fileno. The rewind is given the number of
+   files to pass as its count for the cost; it is issued with count 1. */
+static int plan_candidates(int op, int count, int fileno, int blkno, tape_plan *cands)
+{
+    int n = 0, target;
+
+    memset(cands, 0, PLAN_MAXCANDS * sizeof(tape_plan));
+    if (op == MTFSF && fileno >= 0 && count > 0)
+        return plan_candidates(0, fileno + count, fileno, blkno, cands);
+    if (op == MTBSF) {
+        /* End of file fileno - count: back over the filemarks, or rewind,
+           space to the start of the next file and back over one mark */
+        plan_add(&cands[n++], MTBSF, count);
+        if (fileno >= 0 && (target = fileno - count) >= 0) {
+            plan_add(&cands[n], MTREW, fileno);
+            plan_add(&cands[n], MTFSF, target + 1);
+            plan_add(&cands[n++], MTBSF, 1);
         }
+        return n;
     }
-    return 0;
+    if (op == MTFSF) {
+        plan_add(&cands[n++], MTFSF, count);
+        return n;
+    }
+
+    /* Start of file count */
+    target = count;
+    if (fileno < 0) {
+        plan_add(&cands[n], MTREW, 0);
+        if (target > 0)
+            plan_add(&cands[n], MTFSF, target);
+        return n + 1;
+    }
+    if (target == fileno && blkno == 0)
+        return 1; /* already there, nothing to do */
+    plan_add(&cands[n], MTREW, fileno);
+    if (target > 0)
+        plan_add(&cands[n], MTFSF, target);
+    n++;
+    if (target > fileno)
+        plan_add(&cands[n++], MTFSF, target - fileno);
+    else if (target > 0)
+        plan_add(&cands[n++], MTBSFM, fileno - target + 1);
+    return n;
 }
 
+static const char *plan_opname(int op)
+{
+    switch (op) {
+    case MTREW:
+        return "rewind";
+    case MTFSF:
+        return "fsf";
+    case MTBSF:
+        return "bsf";
+    case MTBSFM:
+        return "bsfm";
+    case MTSEEK:
+        return "seek";
+    }
+    return "?";
+}
 
-/*** Decipher the status ***/
+static void print_plan(tape_plan *p, int chosen)
+{
+    int i;
 
-static int do_status(int mtfd,
-                     cmdef_tr *cmd __attribute__((unused)),
-                     int argc __attribute__((unused)),
-                     char **argv __attribute__((unused)))
+    printf("%c %6.1f ", chosen ? '*' : ' ', p->cost);
+    if (p->nsteps == 0)
+        printf(" (none)");
+    for (i = 0; i < p->nsteps; i++) {
+        if (p->op[i] == MTREW)
+            printf(" rewind");
+        else
+            printf(" %s %d", plan_opname(p->op[i]), p->count[i]);
+    }
+    printf("\n");
+}
+
+static int cheapest_plan(tape_plan *cands, int n)
 {
-    struct mtget status;
-    int dens;
-    unsigned int i;
-    char *type, *density;
+    int i, best = 0;
 
-    if (ioctl(mtfd, MTIOCGET, (char *)&status) < 0) {
-        perror(tape_name);
-        return 2;
+    for (i = 1; i < n; i++)
+        if (cands[i].cost < cands[best].cost)
+            best = i;
+    return best;
+}
+
+static int run_plan(int mtfd, tape_plan *p)
+{
+    struct mtop mt_com;
+    int i;
+
+    for (i = 0; i < p->nsteps; i++) {
+        mt_com.mt_op = p->op[i];
+        mt_com.mt_count = mt_com.mt_op == MTREW ? 1 : p->count[i];
+        if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0)
+            return (-1);
     }
+    return 0;
+}
 
-    if (status.mt_type == MT_ISSCSI1)
-        type = "SCSI 1";
-    else if (status.mt_type == MT_ISSCSI2)
-        type = "SCSI 2";
-    else if (status.mt_type == MT_ISONSTREAM_SC)
+/* fsf, bsf and asf. With --plan, the candidates are printed and the tape
+   is not moved. */
+static int do_space(int mtfd, cmdef_tr *cmd, int argc, char **argv)
+{
+    int an, i, n, best, show_plan = 0, fileno = -1, blkno = -1;
+    long long count = cmd->cmd_code == 0 ? 0 : 1, lba;
+    char *count_arg = NULL;
+    struct mtget status;
+    tape_plan cands[PLAN_MAXCANDS];
+
+    for (an = 0; an < argc; an++) {
+        if (!strcmp(argv[an], "--plan"))
+            show_plan = 1;
+        else if (count_arg == NULL)
+            count_arg = argv[an];
+        else {
+            fprintf(stderr, "mt: too many arguments for the command '%s'.\n", cmd->cmd_name);
+            return 1;
+        }
+    }
+    if (count_arg != NULL && parse_count(count_arg, INT_MAX, &count) != 0)
+        return 3;
+    if (count < 0) {
+        fprintf(stderr, "mt: negative repeat count\n");
+        return 1;
+    }
+
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0) {
+        fileno = status.mt_fileno;
+        blkno = status.mt_blkno;
+    }
+    /* The planner works with the file number reached */
+    if (cmd->cmd_code == MTFSF && fileno > 0 && count > INT_MAX - fileno) {
+        fprintf(stderr, "mt: the count %lld from file %d is too large.\n", count, fileno);
+        return 1;
+    }
+    n = plan_candidates(cmd->cmd_code, count, fileno, blkno, cands);
+    if (cmd->cmd_code == 0 && (lba = catalog_lookup(mtfd, count)) >= 0 && lba <= INT_MAX)
+        plan_add(&cands[n++], MTSEEK, lba);
+    best = cheapest_plan(cands, n);
+
+    if (show_plan) {
+        printf("At file %d, block %d.\n", fileno, blkno);
+        for (i = 0; i < n; i++)
+            print_plan(&cands[i], i == best);
+        return 0;
+    }
+    /* A locate that the tape does not confirm is replaced by spacing */
+    if (cands[best].nsteps > 0 && cands[best].op[0] == MTSEEK) {
+        if (catalog_locate(mtfd, count, cands[best].count[0]) == 0)
+            cands[best].nsteps = 0;
+        else {
+            fileno = blkno = -1;
+            if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0) {
+                fileno = status.mt_fileno;
+                blkno = status.mt_blkno;
+            }
+            n = plan_candidates(0, count, fileno, blkno, cands);
+            best = cheapest_plan(cands, n);
+        }
+    }
+    if (run_plan(mtfd, &cands[best]) < 0) {
+        perror(tape_name);
+        return 2;
+    }
+    catalog_learn(mtfd, 0);
+    return 0;
+}
+
+
+/*** Filemark catalog ***/
+
+/* The catalog of a cartridge records the logical block address (from
+   MTIOCPOS) of the start of each file and of the end of data, so that
+   asf and eod can locate directly. The cartridge is identified by the
+   medium serial number in its MAM, or by the volume serial of a VOL1
+   label in its first block (read only when the tape is at BOT). The
+   catalogs are kept as text files, one per volume, in the directory
+   given by MT_CATALOG in the environment or CATALOG_DIR. Nothing is
+   done unless the directory exists; "mt catalog scan" creates it. */
+
+#define CATALOG_MAXPART 4
+#define CATALOG_MAXID 64
+#define LABEL_READLEN (256 * 1024)
+#define MAM_SERIAL 0x0401
+
+typedef struct {
+    int part, fileno;
+    long long lba;
+} cat_entry;
+
+static struct {
+    char volume[CATALOG_MAXID]; /* empty if not known */
+    int checked;                /* identification tried */
+    int loaded, dirty;
+    cat_entry *entries;
+    int nentries, maxentries;
+    long long eod[CATALOG_MAXPART];
+} catalog;
+
+/* Read the medium serial number from the MAM with READ ATTRIBUTE */
+static int read_mam_serial(int mtfd, char *id, size_t size)
+{
+    unsigned char cdb[16] = { 0x8c, 0, 0, 0, 0, 0, 0, 0, MAM_SERIAL >> 8, MAM_SERIAL & 0xff,
+                              0, 0, 1, 0, 0, 0 };
+    unsigned char buf[256];
+    size_t len, got, i;
+
+    if (scsi_cmd(mtfd, cdb, sizeof(cdb), SG_DXFER_FROM_DEV, buf, sizeof(buf), &got,
+                 SCSI_TIMEOUT) != 0)
+        return (-1);
+    if (got < 9 || ((buf[4] << 8) | buf[5]) != MAM_SERIAL)
+        return (-1);
+    len = (buf[7] << 8) | buf[8];
+    if (len > sizeof(buf) - 9)
+        len = sizeof(buf) - 9;
+    if (len > size - 1)
+        len = size - 1;
+    for (i = 0; i < len && buf[9 + i] != 0; i++)
+        id[i] = buf[9 + i];
+    while (i > 0 && id[i - 1] == ' ')
+        i--;
+    id[i] = '\0';
+    return i > 0 ? 0 : (-1);
+}
+
+/* Read the volume serial from a VOL1 label if the tape is at BOT */
+static int read_label(int mtfd, char *id, size_t size)
+{
+    struct mtget status;
+    struct mtop mt_com;
+    char *buf;
+    ssize_t n;
+    size_t i;
+
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) < 0 || !GMT_BOT(status.mt_gstat))
+        return (-1);
+    if ((buf = malloc(LABEL_READLEN)) == NULL)
+        return (-1);
+    n = tape_read(mtfd, buf, LABEL_READLEN);
+    mt_com.mt_op = MTREW;
+    mt_com.mt_count = 1;
+    tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com);
+    if (n < 10 || memcmp(buf, "VOL1", 4)) {
+        free(buf);
+        return (-1);
+    }
+    for (i = 0; i < 6 && i < size - 1 && buf[4 + i] != ' '; i++)
+        id[i] = buf[4 + i];
+    id[i] = '\0';
+    free(buf);
+    return i > 0 ? 0 : (-1);
+}
+
+static char *catalog_dir(void)
+{
+    char *dir;
+
+    if ((dir = getenv("MT_CATALOG")) == NULL)
+        dir = CATALOG_DIR;
+    return dir;
+}
+
+static char *catalog_path(void)
+{
+    static char path[PATH_MAX];
+    char *dir = catalog_dir(), *cp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, catalog.volume);
+    /* The volume id is used as a file name */
+    for (cp = path + strlen(dir) + 1; *cp; cp++)
+        if (!isalnum((unsigned char)*cp) && *cp != '-' && *cp != '.')
+            *cp = '_';
+    return path;
+}
+
+static void catalog_set(int part, int fileno, long long lba)
+{
+    int i;
+    cat_entry *p;
+
+    for (i = 0; i < catalog.nentries; i++)
+        if (catalog.entries[i].part == part && catalog.entries[i].fileno == fileno) {
+            if (catalog.entries[i].lba != lba) {
+                catalog.entries[i].lba = lba;
+                catalog.dirty = 1;
+            }
+            return;
+        }
+    if (catalog.nentries == catalog.maxentries) {
+        i = catalog.maxentries ? catalog.maxentries * 2 : 64;
+        if ((p = realloc(catalog.entries, i * sizeof(cat_entry))) == NULL)
+            return;
+        catalog.entries = p;
+        catalog.maxentries = i;
+    }
+    p = &catalog.entries[catalog.nentries++];
+    p->part = part;
+    p->fileno = fileno;
+    p->lba = lba;
+    catalog.dirty = 1;
+}
+
+static long long catalog_get(int part, int fileno)
+{
+    int i;
+
+    for (i = 0; i < catalog.nentries; i++)
+        if (catalog.entries[i].part == part && catalog.entries[i].fileno == fileno)
+            return catalog.entries[i].lba;
+    return (-1);
+}
+
+/* Forget the files after fileno and the end of data in a partition */
+static void catalog_truncate(int part, int fileno)
+{
+    int i, j;
+
+    for (i = j = 0; i < catalog.nentries; i++)
+        if (catalog.entries[i].part != part || catalog.entries[i].fileno <= fileno)
+            catalog.entries[j++] = catalog.entries[i];
+    if (j != catalog.nentries || catalog.eod[part] >= 0)
+        catalog.dirty = 1;
+    catalog.nentries = j;
+    catalog.eod[part] = -1;
+}
+
+static void catalog_clear(void)
+{
+    int i;
+
+    catalog.nentries = 0;
+    for (i = 0; i < CATALOG_MAXPART; i++)
+        catalog.eod[i] = -1;
+}
+
+/* Start again after the cartridge may have been changed */
+static void catalog_reset(void)
+{
+    free(catalog.entries);
+    memset(&catalog, 0, sizeof(catalog));
+}
+
+/* Identify the cartridge and load its catalog. Returns 0 if the catalog
+   can be used. */
+static int catalog_open(int mtfd)
+{
+    FILE *f;
+    char line[128];
+    int part, fileno;
+    long long lba;
+    struct stat st;
+
+    if (stat(catalog_dir(), &st) < 0 || !S_ISDIR(st.st_mode))
+        return (-1);
+    if (!catalog.checked) {
+        catalog.checked = 1;
+        catalog_clear();
+        if (read_mam_serial(mtfd, catalog.volume, sizeof(catalog.volume)) < 0 &&
+            read_label(mtfd, catalog.volume, sizeof(catalog.volume)) < 0)
+            catalog.volume[0] = '\0';
+    }
+    if (catalog.volume[0] == '\0')
+        return (-1);
+    if (catalog.loaded)
+        return 0;
+    catalog.loaded = 1;
+    if ((f = fopen(catalog_path(), "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "file %d %d %lld", &part, &fileno, &lba) == 3 && part >= 0 &&
+            part < CATALOG_MAXPART && fileno >= 0 && lba >= 0)
+            catalog_set(part, fileno, lba);
+        else if (sscanf(line, "eod %d %lld", &part, &lba) == 2 && part >= 0 &&
+                 part < CATALOG_MAXPART && lba >= 0)
+            catalog.eod[part] = lba;
+    }
+    fclose(f);
+    catalog.dirty = 0;
+    return 0;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+    const cat_entry *x = a, *y = b;
+
+    if (x->part != y->part)
+        return x->part - y->part;
+    return x->fileno - y->fileno;
+}
+
+/* Write the catalog through a temporary file so that it is never seen
+   half written */
+static int catalog_save(void)
+{
+    FILE *f;
+    char *path, tmp[PATH_MAX + 8];
+    int i, failed;
+
+    if (!catalog.dirty || catalog.volume[0] == '\0')
+        return 0;
+    catalog.dirty = 0;
+    path = catalog_path();
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if ((f = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "mt: can't write the catalog '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    qsort(catalog.entries, catalog.nentries, sizeof(cat_entry), cmp_entries);
+    fprintf(f, "# mt-st catalog\nvolume %s\n", catalog.volume);
+    for (i = 0; i < catalog.nentries; i++)
+        fprintf(f, "file %d %d %lld\n", catalog.entries[i].part, catalog.entries[i].fileno,
+                catalog.entries[i].lba);
+    for (i = 0; i < CATALOG_MAXPART; i++)
+        if (catalog.eod[i] >= 0)
+            fprintf(f, "eod %d %lld\n", i, catalog.eod[i]);
+    failed = ferror(f);
+    if (fclose(f) != 0 || failed || rename(tmp, path) < 0) {
+        fprintf(stderr, "mt: can't write the catalog '%s': %s\n", path, strerror(errno));
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/* Record the current position after a command. If the command wrote to
+   the tape, everything after the current file is forgotten. */
+static void catalog_learn(int mtfd, int wrote)
+{
+    struct mtget status;
+    struct mtpos pos;
+    int part;
+
+    if (catalog_open(mtfd) < 0 || tape_ioctl(mtfd, MTIOCGET, (char *)&status) < 0 ||
+        tape_ioctl(mtfd, MTIOCPOS, (char *)&pos) < 0)
+        return;
+    part = status.mt_resid & 0xff;
+    if (part >= CATALOG_MAXPART || status.mt_fileno < 0)
+        return;
+    if (wrote) {
+        catalog_truncate(part, status.mt_fileno);
+        /* Filemarks were written last, so this is also the end of data */
+        if (status.mt_blkno == 0)
+            catalog.eod[part] = pos.mt_blkno;
+        catalog.dirty = 1;
+    } else if (GMT_EOD(status.mt_gstat) && catalog.eod[part] != (long long)pos.mt_blkno) {
+        catalog.eod[part] = pos.mt_blkno;
+        catalog.dirty = 1;
+    }
+    if (status.mt_blkno == 0)
+        catalog_set(part, status.mt_fileno, pos.mt_blkno);
+    catalog_save();
+}
+
+/* The block address of the start of file fileno (or of the end of data
+   if fileno < 0) in the current partition, or -1 if not known */
+static long long catalog_lookup(int mtfd, int fileno)
+{
+    struct mtget status;
+    int part = 0;
+
+    if (catalog_open(mtfd) < 0)
+        return (-1);
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0)
+        part = status.mt_resid & 0xff;
+    if (part >= CATALOG_MAXPART)
+        return (-1);
+    return fileno < 0 ? catalog.eod[part] : catalog_get(part, fileno);
+}
+
+static int catalog_op(int mtfd, int op, int count)
+{
+    struct mtop mt_com;
+
+    mt_com.mt_op = op;
+    mt_com.mt_count = count;
+    return tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com);
+}
+
+/* Locate to the start of file fileno (or to the end of data if fileno <
+   0) at the block address lba found in the catalog, and check that the
+   tape agrees, since other programs may have written to it: the block
+   before a file must be a filemark, and nothing can be read at the end
+   of data. If the tape does not agree, the entry and the ones after it
+   are forgotten and -1 is returned. */
+static int catalog_locate(int mtfd, int fileno, long long lba)
+{
+    struct mtget status;
+    char *buf;
+    ssize_t n;
+    int part = 0, ok = 0;
+
+    if (lba > INT_MAX)
+        return (-1);
+    if (fileno == 0 || lba == 0)
+        return catalog_op(mtfd, MTSEEK, lba);
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0)
+        part = status.mt_resid & 0xff;
+    if ((buf = malloc(LABEL_READLEN)) == NULL)
+        return (-1);
+    if (catalog_op(mtfd, MTSEEK, fileno < 0 ? lba : lba - 1) == 0) {
+        n = tape_read(mtfd, buf, LABEL_READLEN);
+        if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0)
+            ok = fileno < 0 ? n <= 0 && GMT_EOD(status.mt_gstat)
+                            : n == 0 && !GMT_EOD(status.mt_gstat);
+    }
+    free(buf);
+    if (ok)
+        return 0;
+    if (part < CATALOG_MAXPART) {
+        if (fileno < 0)
+            catalog.eod[part] = -1;
+        else
+            catalog_truncate(part, fileno - 1);
+        catalog.dirty = 1;
+        catalog_save();
+    }
+    return (-1);
+}
+
+/* catalog [show|scan|forget] */
+static int do_catalog(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc, char **argv)
+{
+    struct mtget status;
+    int i;
+    char *action = argc > 0 ? argv[0] : "show";
+
+    if (!strcmp(action, "scan") && mkdir(catalog_dir(), 0755) < 0 && errno != EEXIST) {
+        perror(catalog_dir());
+        return 2;
+    }
+    if (catalog_open(mtfd) < 0) {
+        if (access(catalog_dir(), F_OK) < 0)
+            fprintf(stderr, "mt: the catalog directory '%s' does not exist.\n", catalog_dir());
+        else
+            fprintf(stderr, "mt: can't identify the cartridge (no MAM serial number, and no "
+                            "VOL1 label or not at BOT).\n");
+        return 2;
+    }
+    if (!strcmp(action, "scan")) {
+        /* One pass over the tape, recording the start of each file */
+        catalog_clear();
+        catalog.dirty = 1;
+        if (catalog_op(mtfd, MTREW, 1) < 0) {
+            perror(tape_name);
+            return 2;
+        }
+        catalog_learn(mtfd, 0);
+        while (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0 && !GMT_EOD(status.mt_gstat) &&
+               catalog_op(mtfd, MTFSF, 1) == 0)
+            catalog_learn(mtfd, 0);
+        if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) < 0 || !GMT_EOD(status.mt_gstat)) {
+            /* The drive did not report the end of data when spacing */
+            if (catalog_op(mtfd, MTEOM, 1) < 0) {
+                perror(tape_name);
+                return 2;
+            }
+            catalog_learn(mtfd, 0);
+        }
+        action = "show";
+    }
+    if (!strcmp(action, "forget")) {
+        if (unlink(catalog_path()) < 0 && errno != ENOENT) {
+            perror(catalog_path());
+            return 2;
+        }
+        catalog_clear();
+        catalog.dirty = 0;
+        return 0;
+    }
+    if (strcmp(action, "show")) {
+        fprintf(stderr, "mt: unknown catalog action '%s'.\n", action);
+        return 1;
+    }
+
+    printf("Catalog of volume %s (%s):\n", catalog.volume, catalog_path());
+    qsort(catalog.entries, catalog.nentries, sizeof(cat_entry), cmp_entries);
+    for (i = 0; i < catalog.nentries; i++)
+        printf("partition %d file %d at block %lld\n", catalog.entries[i].part,
+               catalog.entries[i].fileno, catalog.entries[i].lba);
+    for (i = 0; i < CATALOG_MAXPART; i++)
+        if (catalog.eod[i] >= 0)
+            printf("partition %d end of data at block %lld\n", i, catalog.eod[i]);
+    return 0;
+}
+
+
+/*** Decipher the status ***/
+
+static int do_status(int mtfd,
+                     cmdef_tr *cmd __attribute__((unused)),
+                     int argc __attribute__((unused)),
+                     char **argv __attribute__((unused)))
+{
+    struct mtget status;
+
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) < 0) {
+        perror(tape_name);
+        return 2;
+    }
+    print_status(&status);
+    return 0;
+}
+
+static const char *density_name(int code)
+{
+    unsigned int i;
+
+    for (i = 0; i < NBR_DENSITIES; i++)
+        if (density_tbl[i].code == code)
+            return density_tbl[i].name;
+    return NULL;
+}
+
+/* The status as one JSON object. The fields that the drive type does not
+   have are null. */
+static void print_status_json(struct mtget *status)
+{
+    int i, n, scsi, dens;
+    const char *type, *density;
+
+    switch (status->mt_type) {
+    case MT_ISSCSI1:
+        type = "SCSI 1";
+        break;
+    case MT_ISSCSI2:
+        type = "SCSI 2";
+        break;
+    case MT_ISONSTREAM_SC:
+        type = "OnStream SC-, DI-, DP-, or USB";
+        break;
+    case 0:
+        type = "IDE-Tape";
+        break;
+    default:
+        type = status->mt_type & 0x800000 ? "qic-117" : "unknown";
+    }
+    scsi = status->mt_type == MT_ISSCSI1 || status->mt_type == MT_ISSCSI2 ||
+           status->mt_type == MT_ISONSTREAM_SC;
+
+    printf("{\"device\":");
+    json_string(tape_name);
+    printf(",\"type\":");
+    json_string(type);
+    printf(",\"type_code\":%ld,\"file\":%d,\"block\":%d", status->mt_type,
+           status->mt_fileno, status->mt_blkno);
+    if (status->mt_type == MT_ISSCSI2)
+        printf(",\"partition\":%ld", status->mt_resid & 0xff);
+    else
+        printf(",\"partition\":null");
+    if (scsi) {
+        dens = (status->mt_dsreg & MT_ST_DENSITY_MASK) >> MT_ST_DENSITY_SHIFT;
+        printf(",\"block_size\":%ld,\"density_code\":%d,\"density\":",
+               (status->mt_dsreg & MT_ST_BLKSIZE_MASK) >> MT_ST_BLKSIZE_SHIFT, dens);
+        if ((density = density_name(dens)) != NULL)
+            json_string(density);
+        else
+            printf("null");
+        printf(",\"soft_errors\":%ld",
+               (status->mt_erreg & MT_ST_SOFTERR_MASK) >> MT_ST_SOFTERR_SHIFT);
+    } else
+        printf(",\"block_size\":null,\"density_code\":null,\"density\":null,"
+               "\"soft_errors\":null");
+    printf(",\"resid\":%ld,\"erreg\":%ld,\"dsreg\":%ld,\"gstat\":%ld,\"status\":[",
+           status->mt_resid, status->mt_erreg, status->mt_dsreg, status->mt_gstat);
+    for (i = n = 0; gstat_tbl[i].name != NULL; i++)
+        if (status->mt_gstat & gstat_tbl[i].bitmask)
+            printf("%s\"%s\"", n++ ? "," : "", gstat_tbl[i].name);
+    printf("]}\n");
+}
+
+static void print_status(struct mtget *status)
+{
+    int i, dens;
+    char *type;
+    const char *density;
+
+    if (output_json) {
+        print_status_json(status);
+        return;
+    }
+    if (status->mt_type == MT_ISSCSI1)
+        type = "SCSI 1";
+    else if (status->mt_type == MT_ISSCSI2)
+        type = "SCSI 2";
+    else if (status->mt_type == MT_ISONSTREAM_SC)
         type = "OnStream SC-, DI-, DP-, or USB";
     else
         type = NULL;
     if (type == NULL) {
-        if (status.mt_type & 0x800000)
-            printf("qic-117 drive type = 0x%05lx\n", status.mt_type & 0x1ffff);
-        else if (status.mt_type == 0)
+        if (status->mt_type & 0x800000)
+            printf("qic-117 drive type = 0x%05lx\n", status->mt_type & 0x1ffff);
+        else if (status->mt_type == 0)
             printf("IDE-Tape (type code 0) ?\n");
         else
-            printf("Unknown tape drive type (type code %ld)\n", status.mt_type);
-        printf("File number=%d, block number=%d.\n", status.mt_fileno, status.mt_blkno);
-        printf("mt_resid: %ld, mt_erreg: 0x%lx\n", status.mt_resid, status.mt_erreg);
-        printf("mt_dsreg: 0x%lx, mt_gstat: 0x%lx\n", status.mt_dsreg, status.mt_gstat);
+            printf("Unknown tape drive type (type code %ld)\n", status->mt_type);
+        printf("File number=%d, block number=%d.\n", status->mt_fileno, status->mt_blkno);
+        printf("mt_resid: %ld, mt_erreg: 0x%lx\n", status->mt_resid, status->mt_erreg);
+        printf("mt_dsreg: 0x%lx, mt_gstat: 0x%lx\n", status->mt_dsreg, status->mt_gstat);
     } else {
         printf("%s tape drive:\n", type);
-        if (status.mt_type == MT_ISSCSI2)
+        if (status->mt_type == MT_ISSCSI2)
             printf("File number=%d, block number=%d, partition=%ld.\n",
-                   status.mt_fileno, status.mt_blkno, (status.mt_resid & 0xff));
+                   status->mt_fileno, status->mt_blkno, (status->mt_resid & 0xff));
         else
-            printf("File number=%d, block number=%d.\n", status.mt_fileno,
-                   status.mt_blkno);
-        if (status.mt_type == MT_ISSCSI1 || status.mt_type == MT_ISSCSI2 ||
-            status.mt_type == MT_ISONSTREAM_SC) {
-            dens = (status.mt_dsreg & MT_ST_DENSITY_MASK) >> MT_ST_DENSITY_SHIFT;
-            density = "no translation";
-            for (i = 0; i < NBR_DENSITIES; i++)
-                if (density_tbl[i].code == dens) {
-                    density = density_tbl[i].name;
-                    break;
-                }
+            printf("File number=%d, block number=%d.\n", status->mt_fileno,
+                   status->mt_blkno);
+        if (status->mt_type == MT_ISSCSI1 || status->mt_type == MT_ISSCSI2 ||
+            status->mt_type == MT_ISONSTREAM_SC) {
+            dens = (status->mt_dsreg & MT_ST_DENSITY_MASK) >> MT_ST_DENSITY_SHIFT;
+            if ((density = density_name(dens)) == NULL)
+                density = "no translation";
             printf("Tape block size %ld bytes. Density code 0x%x (%s).\n",
-                   ((status.mt_dsreg & MT_ST_BLKSIZE_MASK) >> MT_ST_BLKSIZE_SHIFT),
+                   ((status->mt_dsreg & MT_ST_BLKSIZE_MASK) >> MT_ST_BLKSIZE_SHIFT),
                    dens, density);
 
             printf("Soft error count since last status=%ld\n",
-                   (status.mt_erreg & MT_ST_SOFTERR_MASK) >> MT_ST_SOFTERR_SHIFT);
-        }
-    }
-
-    printf("General status bits on (%lx):\n", status.mt_gstat);
-    if (GMT_EOF(status.mt_gstat))
-        printf(" EOF");
-    if (GMT_BOT(status.mt_gstat))
-        printf(" BOT");
-    if (GMT_EOT(status.mt_gstat))
-        printf(" EOT");
-    if (GMT_SM(status.mt_gstat))
-        printf(" SM");
-    if (GMT_EOD(status.mt_gstat))
-        printf(" EOD");
-    if (GMT_WR_PROT(status.mt_gstat))
-        printf(" WR_PROT");
-    if (GMT_ONLINE(status.mt_gstat))
-        printf(" ONLINE");
-    if (GMT_D_6250(status.mt_gstat))
-        printf(" D_6250");
-    if (GMT_D_1600(status.mt_gstat))
-        printf(" D_1600");
-    if (GMT_D_800(status.mt_gstat))
-        printf(" D_800");
-    if (GMT_DR_OPEN(status.mt_gstat))
-        printf(" DR_OPEN");
-    if (GMT_IM_REP_EN(status.mt_gstat))
-        printf(" IM_REP_EN");
-    if (GMT_CLN(status.mt_gstat))
-        printf(" CLN");
+                   (status->mt_erreg & MT_ST_SOFTERR_MASK) >> MT_ST_SOFTERR_SHIFT);
+        }
+    }
+
+    printf("General status bits on (%lx):\n", status->mt_gstat);
+    for (i = 0; gstat_tbl[i].name != NULL; i++)
+        if (status->mt_gstat & gstat_tbl[i].bitmask)
+            printf(" %s", gstat_tbl[i].name);
     printf("\n");
-    return 0;
 }
 
 
@@ -708,15 +1989,37 @@ static int do_status(int mtfd,
 static const char *st_formats[] = { "",  "r", "k", "s", "l", "t", "o", "u",
                                     "m", "v", "p", "x", "a", "y", "q", "z" };
 
+/* The root of sysfs, which can be changed with MT_SYSFS for testing */
+static const char *sysfs_root(void)
+{
+    const char *root;
+
+    if ((root = getenv("MT_SYSFS")) == NULL || *root == '\0')
+        root = "/sys";
+    return root;
+}
+
+/* The sysfs class directory of the tape device rdev, for its mode */
+static void tape_class_dir(dev_t rdev, char *buf, size_t size)
+{
+    int tapeminor, tapemode;
+
+    tapeminor = minor(rdev);
+    tapemode = TAPE_MODE(tapeminor);
+    tapemode <<= 4 - ST_NBR_MODE_BITS; /* from st.c */
+    snprintf(buf, size, "%s/class/scsi_tape/st%d%s", sysfs_root(), TAPE_NR(tapeminor),
+             st_formats[tapemode]);
+}
+
 /* Show the options if visible in sysfs */
 static int do_show_options(int mtfd,
                            cmdef_tr *cmd __attribute__((unused)),
                            int argc __attribute__((unused)),
                            char **argv __attribute__((unused)))
 {
-    int i, fd, options, tapeminor, tapeno, tapemode;
+    int i, n, fd, options;
     struct stat stat;
-    char fname[100], buf[20];
+    char fname[PATH_MAX], buf[20];
 
     if (fstat(mtfd, &stat) < 0) {
         perror(tape_name);
@@ -728,12 +2031,8 @@ static int do_show_options(int mtfd,
         return 1;
     }
 
-    tapeminor = minor(stat.st_rdev);
-    tapeno = TAPE_NR(tapeminor);
-    tapemode = TAPE_MODE(tapeminor);
-    tapemode <<= 4 - ST_NBR_MODE_BITS; /* from st.c */
-    sprintf(fname, "/sys/class/scsi_tape/st%d%s/options", tapeno, st_formats[tapemode]);
-    /* printf("Trying file '%s' (st_rdev 0x%lx).\n", fname, stat.st_rdev); */
+    tape_class_dir(stat.st_rdev, fname, sizeof(fname) - 8);
+    strcat(fname, "/options");
 
     if ((fd = open(fname, O_RDONLY)) < 0 || read(fd, buf, 20) < 0) {
         fprintf(stderr, "Can't read the sysfs file '%s'.\n", fname);
@@ -745,6 +2044,19 @@ static int do_show_options(int mtfd,
 
     options = strtol(buf, NULL, 0);
 
+    if (output_json) {
+        printf("{\"device\":");
+        json_string(tape_name);
+        printf(",\"mode\":%d,\"options\":%d,\"set\":[", TAPE_MODE(minor(stat.st_rdev)) + 1,
+               options);
+        for (i = n = 0; boolean_tbl[i].name != NULL; i++)
+            if (options & boolean_tbl[i].bitmask) {
+                printf("%s", n++ ? "," : "");
+                json_string(boolean_tbl[i].name);
+            }
+        printf("]}\n");
+        return 0;
+    }
     printf("The options set:");
     for (i = 0; boolean_tbl[i].name != NULL; i++)
         if (options & boolean_tbl[i].bitmask)
@@ -755,43 +2067,4261 @@ static int do_show_options(int mtfd,
 }
 
 
-/* Print a list of possible density codes */
-static int print_densities(int fd __attribute__((unused)),
-                           cmdef_tr *cmd __attribute__((unused)),
-                           int argc __attribute__((unused)),
-                           char **argv __attribute__((unused)))
+/*** I/O statistics from sysfs ***/
+
+/* The counters the st driver keeps in the stats directory of each drive */
+static const char *iostat_names[] = { "read_byte_cnt", "write_byte_cnt", "read_cnt",
+                                      "write_cnt",     "read_ns",        "write_ns",
+                                      "other_cnt",     "io_ns",          "in_flight" };
+#define IOS_RBYTES 0
+#define IOS_WBYTES 1
+#define IOS_READS 2
+#define IOS_WRITES 3
+#define IOS_RNS 4
+#define IOS_WNS 5
+#define IOS_OTHERS 6
+#define IOS_IONS 7
+#define IOS_INFLIGHT 8
+#define NBR_IOSTATS (sizeof(iostat_names) / sizeof(char *))
+
+typedef struct {
+    int tapeno;
+    unsigned long long prev[NBR_IOSTATS];
+} iostat_drive;
+
+static int cmp_ints(const void *a, const void *b)
 {
-    unsigned int i, offset;
+    return *(const int *)a - *(const int *)b;
+}
 
-    printf("Some SCSI tape density codes:\ncode   explanation                  "
-           " code   explanation\n");
-    offset = (NBR_DENSITIES + 1) / 2;
-    for (i = 0; i < offset; i++) {
-        printf("0x%02x   %-28s", density_tbl[i].code, density_tbl[i].name);
-        if (i + offset < NBR_DENSITIES)
-            printf("  0x%02x   %s\n", density_tbl[i + offset].code,
-                   density_tbl[i + offset].name);
-        else
-            printf("\n");
+/* Read the counters of a drive. Returns -1 if the stats are missing. */
+static int read_iostats(int tapeno, unsigned long long *vals)
+{
+    unsigned int i;
+    char fname[PATH_MAX], buf[32];
+    FILE *f;
+
+    for (i = 0; i < NBR_IOSTATS; i++) {
+        snprintf(fname, sizeof(fname), "%s/class/scsi_tape/st%d/stats/%s", sysfs_root(), tapeno,
+                 iostat_names[i]);
+        if ((f = fopen(fname, "r")) == NULL)
+            return (-1);
+        if (fgets(buf, sizeof(buf), f) == NULL) {
+            fclose(f);
+            return (-1);
+        }
+        fclose(f);
+        vals[i] = strtoull(buf, NULL, 0);
     }
     return 0;
 }
 
+/* The numbers of all drives in sysfs, sorted */
+static int list_tapes(int **tapenos)
+{
+    int n = 0, max = 0, tapeno, *p;
+    char dname[PATH_MAX], c;
+    DIR *dir;
+    struct dirent *de;
 
-/* Try to find out why the command failed */
-static void test_error(int mtfd, cmdef_tr *cmd)
+    *tapenos = NULL;
+    snprintf(dname, sizeof(dname), "%s/class/scsi_tape", sysfs_root());
+    if ((dir = opendir(dname)) == NULL)
+        return 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (sscanf(de->d_name, "st%d%c", &tapeno, &c) != 1)
+            continue;
+        if (n == max) {
+            max = max ? 2 * max : 16;
+            if ((p = realloc(*tapenos, max * sizeof(int))) == NULL)
+                break;
+            *tapenos = p;
+        }
+        (*tapenos)[n++] = tapeno;
+    }
+    closedir(dir);
+    qsort(*tapenos, n, sizeof(int), cmp_ints);
+    return n;
+}
+
+/* Print the rates since the previous counters, and keep the new ones */
+static void print_iostats(iostat_drive *d, unsigned long long *now, double secs)
 {
-    struct mtget status;
+    unsigned long long delta[NBR_IOSTATS];
+    unsigned int i;
+    double rmbs, wmbs, rps, wps, rlat, wlat, util;
 
-    if (ioctl(mtfd, MTIOCGET, (char *)&status) < 0)
-        return;
+    for (i = 0; i < NBR_IOSTATS; i++)
+        delta[i] = now[i] - d->prev[i];
+    rmbs = delta[IOS_RBYTES] / secs / 1e6;
+    wmbs = delta[IOS_WBYTES] / secs / 1e6;
+    rps = delta[IOS_READS] / secs;
+    wps = delta[IOS_WRITES] / secs;
+    rlat = delta[IOS_READS] ? delta[IOS_RNS] / 1e6 / delta[IOS_READS] : 0.0;
+    wlat = delta[IOS_WRITES] ? delta[IOS_WNS] / 1e6 / delta[IOS_WRITES] : 0.0;
+    util = delta[IOS_IONS] / 1e9 / secs; /* the mean number of requests in progress */
+    if (output_json)
+        printf("{\"device\":\"st%d\",\"seconds\":%.3f,\"read_mbs\":%.3f,\"write_mbs\":%.3f,"
+               "\"reads\":%.1f,\"writes\":%.1f,\"read_ms\":%.3f,\"write_ms\":%.3f,"
+               "\"queue\":%.2f,\"in_flight\":%llu}\n",
+               d->tapeno, secs, rmbs, wmbs, rps, wps, rlat, wlat, util, now[IOS_INFLIGHT]);
+    else
+        printf("st%-6d %8.2f %8.2f %8.1f %8.1f %9.3f %9.3f %6.2f %5llu\n", d->tapeno, rmbs, wmbs,
+               rps, wps, rlat, wlat, util, now[IOS_INFLIGHT]);
+    memcpy(d->prev, now, sizeof(d->prev));
+}
 
-    if (status.mt_type != MT_ISSCSI1 && status.mt_type != MT_ISSCSI2)
-        return;
+/* Print the throughput, requests per second, mean latency and queue depth
+   of the drive, or of all drives, for each interval. Without an interval,
+   one report is printed for the time since boot. The tape device is not
+   opened, so that a running job is not disturbed. */
+static int do_iostat(int mtfd __attribute__((unused)), cmdef_tr *cmd __attribute__((unused)),
+                     int argc, char **argv)
+{
+    int i, n, n0, all = 0, *tapenos = NULL, result = 0, first = 1;
+    long long count = -1;
+    double interval = 0.0, secs = 1.0;
+    char *end;
+    unsigned long long now[NBR_IOSTATS];
+    struct stat st;
+    struct timespec last, next;
+    iostat_drive *drives;
 
-    if ((cmd->error_tests & ET_ONLINE) && !GMT_ONLINE(status.mt_gstat))
-        fprintf(stderr,
-                "mt: The device is offline (not powered on, no tape ?).\n");
-    if ((cmd->error_tests & ET_WPROT) && GMT_WR_PROT(status.mt_gstat))
-        fprintf(stderr, "mt: The tape is write-protected.\n");
+    if (argc > 0 && !strcmp(argv[0], "all")) {
+        all = 1;
+        argc--;
+        argv++;
+    }
+    if (argc > 2) {
+        fprintf(stderr, "mt: usage: iostat [all] [interval [count]]\n");
+        return 1;
+    }
+    if (argc > 0 && ((interval = strtod(argv[0], &end)) <= 0 || *end != '\0')) {
+        fprintf(stderr, "mt: bad interval '%s'.\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1) {
+        if (parse_count(argv[1], INT_MAX, &count))
+            return 1;
+        if (count <= 0) {
+            fprintf(stderr, "mt: bad count '%s'.\n", argv[1]);
+            return 1;
+        }
+    }
+
+    if (all) {
+        if ((n = list_tapes(&tapenos)) == 0) {
+            fprintf(stderr, "mt: no tape drives found in sysfs.\n");
+            free(tapenos);
+            return 2;
+        }
+    } else {
+        if (stat(tape_name, &st) < 0) {
+            perror(tape_name);
+            return 1;
+        }
+        if (!S_ISCHR(st.st_mode) || major(st.st_rdev) != SCSI_TAPE_MAJOR) {
+            fprintf(stderr, "mt: '%s' is not a SCSI tape device.\n", tape_name);
+            return 1;
+        }
+        if ((tapenos = malloc(sizeof(int))) == NULL) {
+            perror("mt");
+            return 2;
+        }
+        tapenos[0] = TAPE_NR(minor(st.st_rdev));
+        n = 1;
+    }
+    if ((drives = calloc(n, sizeof(iostat_drive))) == NULL) {
+        perror("mt");
+        free(tapenos);
+        return 2;
+    }
+    /* With all, the drives without statistics are left out */
+    for (i = 0, n0 = n, n = 0; i < n0; i++) {
+        drives[n].tapeno = tapenos[i];
+        if (read_iostats(tapenos[i], drives[n].prev) == 0)
+            n++;
+        else if (!all)
+            fprintf(stderr, "mt: no I/O statistics in sysfs for st%d.\n", tapenos[i]);
+    }
+    free(tapenos);
+    if (n == 0) {
+        if (all)
+            fprintf(stderr, "mt: no I/O statistics in sysfs.\n");
+        result = 2;
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    next = last;
+    if (interval == 0.0) {
+        /* The counters start at zero when the driver is loaded */
+        for (i = 0; i < n; i++)
+            memset(drives[i].prev, 0, sizeof(drives[i].prev));
+        clock_gettime(CLOCK_BOOTTIME, &next);
+        secs = next.tv_sec + next.tv_nsec / 1e9;
+        count = 1;
+    }
+    for (; count != 0; count--) {
+        if (interval > 0) {
+            next.tv_sec += (time_t)interval;
+            next.tv_nsec += (interval - (time_t)interval) * 1e9;
+            if (next.tv_nsec >= 1000000000L) {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000L;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+                ;
+            secs = elapsed_since(&last);
+            clock_gettime(CLOCK_MONOTONIC, &last);
+        }
+        if (!output_json)
+            printf("%sdevice      rMB/s    wMB/s      r/s      w/s   r_await   w_await  queue"
+                   " in_fl\n",
+                   first ? "" : "\n");
+        first = 0;
+        for (i = 0; i < n; i++) {
+            if (read_iostats(drives[i].tapeno, now) < 0) {
+                fprintf(stderr, "mt: no I/O statistics in sysfs for st%d.\n", drives[i].tapeno);
+                result = 2;
+                continue;
+            }
+            print_iostats(&drives[i], now, secs);
+        }
+        fflush(stdout);
+    }
+out:
+    free(drives);
+    return result;
+}
+
+
+/*** The fleet monitor ***/
+
+/* "mt monitor" polls all the drives in one process: the sysfs I/O
+   counters and the MTIOCGET state of each drive are sampled on a timerfd
+   driven epoll loop. Each sample is appended to a fixed size ring file
+   per drive, mapped into memory, and a metrics text file (in the
+   Prometheus text format) is rewritten after each poll. A drive that is
+   in use by another program (EBUSY) is sampled from sysfs only. */
+
+#define MON_MAGIC "MTRING1"
+#define MON_INTERVAL 60 /* default seconds between the polls */
+#define MON_SLOTS 10080 /* default samples in a ring, a week at 60 s */
+
+#define MON_STATS 1  /* the sysfs counters are valid */
+#define MON_STATUS 2 /* the MTIOCGET state is valid */
+#define MON_BUSY 4   /* the device was in use */
+#define MON_POLLED 8 /* the device was opened for MTIOCGET */
+
+typedef struct {
+    char magic[8];
+    uint32_t sample_size;
+    uint32_t nslots;
+    uint64_t count; /* the samples written; the next is at count % nslots */
+    int64_t interval_ms;
+} mon_header;
+
+typedef struct {
+    int64_t time; /* ms since the epoch */
+    uint64_t stats[NBR_IOSTATS];
+    uint32_t flags;
+    uint32_t gstat;
+    int32_t fileno, blkno;
+    uint32_t softerr;
+    uint32_t reserved;
+} mon_sample;
+
+typedef struct {
+    int tapeno;
+    mon_header *ring;
+    size_t ringsize;
+    mon_sample last;
+    struct timespec when; /* the monotonic time of last */
+    int have_last, busy;
+    unsigned long long softerrs;
+    double rbps, wbps;
+} mon_drive;
+
+typedef struct {
+    double interval;
+    long long slots, count;
+    char *dir, *metrics, *devdir;
+    int status; /* open the devices for MTIOCGET */
+} mon_opts;
+
+static mon_sample *mon_samples(mon_header *h)
+{
+    return (mon_sample *)(h + 1);
+}
+
+/* Map the ring file of a drive, creating it or starting it again if it
+   does not match the current sample layout */
+static mon_header *mon_map(const char *name, uint32_t nslots, int64_t interval_ms,
+                           size_t *size, int writing)
+{
+    int fd;
+    struct stat st;
+    mon_header *h;
+
+    if ((fd = open(name, writing ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0 ||
+        fstat(fd, &st) < 0) {
+        perror(name);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if (!writing) {
+        nslots = st.st_size >= (off_t)sizeof(mon_header)
+                     ? (st.st_size - sizeof(mon_header)) / sizeof(mon_sample)
+                     : 0;
+        if (nslots == 0) {
+            fprintf(stderr, "mt: '%s' is not a monitor ring.\n", name);
+            close(fd);
+            return NULL;
+        }
+    }
+    *size = sizeof(mon_header) + (size_t)nslots * sizeof(mon_sample);
+    if (writing && st.st_size != (off_t)*size && ftruncate(fd, *size) < 0) {
+        perror(name);
+        close(fd);
+        return NULL;
+    }
+    h = mmap(NULL, *size, writing ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        perror(name);
+        return NULL;
+    }
+    if (memcmp(h->magic, MON_MAGIC, sizeof(h->magic)) || h->sample_size != sizeof(mon_sample) ||
+        h->nslots != nslots) {
+        if (!writing) {
+            fprintf(stderr, "mt: '%s' is not a monitor ring.\n", name);
+            munmap(h, *size);
+            return NULL;
+        }
+        memset(h, 0, sizeof(mon_header));
+        memcpy(h->magic, MON_MAGIC, sizeof(h->magic));
+        h->sample_size = sizeof(mon_sample);
+        h->nslots = nslots;
+    }
+    if (writing)
+        h->interval_ms = interval_ms;
+    return h;
+}
+
+/* Append a sample. The count is stored after the sample, so that a
+   reader never sees a slot that is being written as valid. */
+static void mon_append(mon_header *h, mon_sample *s)
+{
+    uint64_t count = h->count;
+
+    mon_samples(h)[count % h->nslots] = *s;
+    __atomic_store_n(&h->count, count + 1, __ATOMIC_RELEASE);
+}
+
+static void mon_poll_drive(mon_drive *d, mon_opts *opts)
+{
+    int fd;
+    char name[PATH_MAX];
+    double secs;
+    struct mtget status;
+    struct timespec now;
+    mon_sample s;
+
+    memset(&s, 0, sizeof(s));
+    clock_gettime(CLOCK_REALTIME, &now);
+    s.time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    if (read_iostats(d->tapeno, (unsigned long long *)s.stats) == 0)
+        s.flags |= MON_STATS;
+
+    /* Without O_NONBLOCK, the open would wait for a tape to be loaded.
+       The device can be opened only once, so while it is open here
+       another program opening it gets EBUSY. */
+    snprintf(name, sizeof(name), "%s/nst%d", opts->devdir, d->tapeno);
+    if (!opts->status)
+        ;
+    else if ((fd = open(name, O_RDONLY | O_NONBLOCK)) < 0) {
+        s.flags |= MON_POLLED;
+        if (errno == EBUSY)
+            s.flags |= MON_BUSY;
+    } else {
+        s.flags |= MON_POLLED;
+        if (tape_ioctl(fd, MTIOCGET, &status) == 0) {
+            s.flags |= MON_STATUS;
+            s.gstat = status.mt_gstat;
+            s.fileno = status.mt_fileno;
+            s.blkno = status.mt_blkno;
+            s.softerr = (status.mt_erreg & MT_ST_SOFTERR_MASK) >> MT_ST_SOFTERR_SHIFT;
+            d->softerrs += s.softerr;
+        }
+        close(fd);
+    }
+    if ((s.flags & MON_BUSY) && !d->busy)
+        fprintf(stderr, "mt: monitor: %s is in use, sampled from sysfs only.\n", name);
+    d->busy = (s.flags & MON_BUSY) != 0;
+
+    d->rbps = d->wbps = 0.0;
+    if (d->have_last && (s.flags & d->last.flags & MON_STATS) &&
+        (secs = elapsed_since(&d->when)) > 0) {
+        d->rbps = (s.stats[IOS_RBYTES] - d->last.stats[IOS_RBYTES]) / secs;
+        d->wbps = (s.stats[IOS_WBYTES] - d->last.stats[IOS_WBYTES]) / secs;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &d->when);
+    d->last = s;
+    d->have_last = 1;
+    if (d->ring != NULL)
+        mon_append(d->ring, &s);
+}
+
+/* The metrics that are not sysfs counters */
+#define MET_ONLINE 100
+#define MET_CLEANING 101
+#define MET_SOFTERRS 102
+#define MET_RBPS 103
+#define MET_WBPS 104
+#define MET_BUSY 105
+#define MET_STATUS 106
+
+static struct mon_metric {
+    char *name;
+    char *type;
+    char *help;
+    int what; /* an IOS_ counter or a MET_ value */
+} mon_metrics[] = {
+    /* clang-format off */
+    { "mt_read_bytes_total",       "counter", "Bytes read from the tape.",                    IOS_RBYTES   },
+    { "mt_write_bytes_total",      "counter", "Bytes written to the tape.",                   IOS_WBYTES   },
+    { "mt_reads_total",            "counter", "Read requests.",                               IOS_READS    },
+    { "mt_writes_total",           "counter", "Write requests.",                              IOS_WRITES   },
+    { "mt_read_bytes_per_second",  "gauge",   "Read throughput during the last interval.",    MET_RBPS     },
+    { "mt_write_bytes_per_second", "gauge",   "Write throughput during the last interval.",   MET_WBPS     },
+    { "mt_soft_errors_total",      "counter", "Soft errors reported while monitored.",        MET_SOFTERRS },
+    { "mt_cleaning_requested",     "gauge",   "The drive requests cleaning (GMT_CLN).",       MET_CLEANING },
+    { "mt_online",                 "gauge",   "A tape is loaded (GMT_ONLINE).",               MET_ONLINE   },
+    { "mt_busy",                   "gauge",   "The device was in use by another program.",    MET_BUSY     },
+    { "mt_status_available",       "gauge",   "The drive state could be read with MTIOCGET.", MET_STATUS   },
+    { NULL,                        NULL,      NULL,                                           0            }
+    /* clang-format on */
+};
+
+/* Format the value of a metric for a drive. Returns -1 if it has none. */
+static int mon_value(mon_drive *d, int what, char *buf, size_t size)
+{
+    mon_sample *s = &d->last;
+
+    if (what < (int)NBR_IOSTATS) {
+        if (!(s->flags & MON_STATS))
+            return (-1);
+        return snprintf(buf, size, "%llu", (unsigned long long)s->stats[what]);
+    }
+    if ((what == MET_ONLINE || what == MET_CLEANING || what == MET_SOFTERRS) &&
+        !(s->flags & MON_STATUS))
+        return (-1);
+    if ((what == MET_RBPS || what == MET_WBPS) && !(s->flags & MON_STATS))
+        return (-1);
+    if ((what == MET_BUSY || what == MET_STATUS) && !(s->flags & MON_POLLED))
+        return (-1);
+    switch (what) {
+    case MET_ONLINE:
+        return snprintf(buf, size, "%d", GMT_ONLINE(s->gstat) ? 1 : 0);
+    case MET_CLEANING:
+        return snprintf(buf, size, "%d", GMT_CLN(s->gstat) ? 1 : 0);
+    case MET_SOFTERRS:
+        return snprintf(buf, size, "%llu", d->softerrs);
+    case MET_RBPS:
+        return snprintf(buf, size, "%.1f", d->rbps);
+    case MET_WBPS:
+        return snprintf(buf, size, "%.1f", d->wbps);
+    case MET_BUSY:
+        return snprintf(buf, size, "%d", s->flags & MON_BUSY ? 1 : 0);
+    default:
+        return snprintf(buf, size, "%d", s->flags & MON_STATUS ? 1 : 0);
+    }
+}
+
+/* Write the metrics to a new file and rename it over the old one, so that
+   a collector never reads a partial file */
+static int mon_write_metrics(const char *name, mon_drive *drives, int n)
+{
+    int i, m;
+    char tmp[PATH_MAX], value[32];
+    FILE *f;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", name) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "mt: the name '%s' is too long.\n", name);
+        return (-1);
+    }
+    if ((f = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+        return (-1);
+    }
+    for (m = 0; mon_metrics[m].name != NULL; m++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", mon_metrics[m].name, mon_metrics[m].help,
+                mon_metrics[m].name, mon_metrics[m].type);
+        for (i = 0; i < n; i++)
+            if (mon_value(&drives[i], mon_metrics[m].what, value, sizeof(value)) >= 0)
+                fprintf(f, "%s{drive=\"st%d\"} %s\n", mon_metrics[m].name, drives[i].tapeno,
+                        value);
+    }
+    if (fclose(f) != 0 || rename(tmp, name) < 0) {
+        perror(name);
+        unlink(tmp);
+        return (-1);
+    }
+    return 0;
+}
+
+/* Add the drives that have appeared in sysfs since the previous poll */
+static int mon_add_drives(mon_drive **drives, int *n, mon_opts *opts)
+{
+    int i, j, ntapes, *tapenos;
+    char name[PATH_MAX];
+    mon_drive *p, *d;
+
+    ntapes = list_tapes(&tapenos);
+    for (i = 0; i < ntapes; i++) {
+        for (j = 0; j < *n && (*drives)[j].tapeno != tapenos[i]; j++)
+            ;
+        if (j < *n)
+            continue;
+        if ((p = realloc(*drives, (*n + 1) * sizeof(mon_drive))) == NULL) {
+            perror("mt");
+            free(tapenos);
+            return (-1);
+        }
+        *drives = p;
+        d = &p[(*n)++];
+        memset(d, 0, sizeof(mon_drive));
+        d->tapeno = tapenos[i];
+        snprintf(name, sizeof(name), "%s/st%d.ring", opts->dir, d->tapeno);
+        d->ring = mon_map(name, opts->slots, opts->interval * 1000, &d->ringsize, 1);
+    }
+    free(tapenos);
+    return 0;
+}
+
+static void mon_print_sample(mon_sample *s, mon_sample *prev)
+{
+    int i, n;
+    double secs, rmbs = 0.0, wmbs = 0.0;
+    char when[32];
+    time_t t;
+
+    if (prev != NULL && (s->flags & prev->flags & MON_STATS) &&
+        (secs = (s->time - prev->time) / 1000.0) > 0) {
+        rmbs = (s->stats[IOS_RBYTES] - prev->stats[IOS_RBYTES]) / secs / 1e6;
+        wmbs = (s->stats[IOS_WBYTES] - prev->stats[IOS_WBYTES]) / secs / 1e6;
+    }
+    if (output_json) {
+        printf("{\"time\":%lld,\"file\":%d,\"block\":%d,\"read_mbs\":%.3f,"
+               "\"write_mbs\":%.3f,\"soft_errors\":%u,\"busy\":%s,\"status\":",
+               (long long)s->time, s->fileno, s->blkno, rmbs, wmbs, s->softerr,
+               s->flags & MON_BUSY ? "true" : "false");
+        if (s->flags & MON_STATUS) {
+            printf("[");
+            for (i = n = 0; gstat_tbl[i].name != NULL; i++)
+                if (s->gstat & gstat_tbl[i].bitmask)
+                    printf("%s\"%s\"", n++ ? "," : "", gstat_tbl[i].name);
+            printf("]}\n");
+        } else
+            printf("null}\n");
+        return;
+    }
+    t = s->time / 1000;
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+    printf("%-20s %4d %7d %8.2f %8.2f %5u ", when, s->fileno, s->blkno, rmbs, wmbs, s->softerr);
+    if (s->flags & MON_BUSY)
+        printf(" busy");
+    else if (!(s->flags & MON_STATUS))
+        printf(" unknown");
+    else
+        for (i = 0; gstat_tbl[i].name != NULL; i++)
+            if (s->gstat & gstat_tbl[i].bitmask)
+                printf(" %s", gstat_tbl[i].name);
+    printf("\n");
+}
+
+/* Print the last samples of a ring (all if last is 0), oldest first,
+   with the rates since the sample before each */
+static int mon_show(const char *name, long long last)
+{
+    uint64_t count, oldest, i;
+    size_t size;
+    mon_header *h;
+    mon_sample *prev = NULL;
+
+    if ((h = mon_map(name, 0, 0, &size, 0)) == NULL)
+        return 2;
+    count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    oldest = count > h->nslots ? count - h->nslots : 0;
+    i = last > 0 && count - oldest > (uint64_t)last ? count - last : oldest;
+    if (i > oldest)
+        prev = &mon_samples(h)[(i - 1) % h->nslots];
+    if (!output_json)
+        printf("time                 file   block    rMB/s    wMB/s  soft  status\n");
+    for (; i < count; i++) {
+        mon_print_sample(&mon_samples(h)[i % h->nslots], prev);
+        prev = &mon_samples(h)[i % h->nslots];
+    }
+    munmap(h, size);
+    return 0;
+}
+
+static int do_monitor(int mtfd __attribute__((unused)), cmdef_tr *cmd __attribute__((unused)),
+                      int argc, char **argv)
+{
+    int i, n = 0, an, efd = -1, tfd = -1, sfd = -1, result = 0;
+    long long value;
+    uint64_t ticks;
+    char *cp, name[PATH_MAX];
+    mon_opts opts = { MON_INTERVAL, MON_SLOTS, -1, MONITOR_DIR, NULL, "/dev", 0 };
+    mon_drive *drives = NULL;
+    struct itimerspec its;
+    struct epoll_event ev;
+    struct signalfd_siginfo si;
+    sigset_t mask;
+
+    if (argc > 0 && !strcmp(argv[0], "show")) {
+        if (argc < 2 || argc > 3) {
+            fprintf(stderr, "mt: usage: monitor show ringfile [count]\n");
+            return 1;
+        }
+        value = 0;
+        if (argc > 2 && parse_count(argv[2], INT_MAX, &value))
+            return 1;
+        return mon_show(argv[1], value);
+    }
+    for (an = 0; an < argc; an++) {
+        if (!strcmp(argv[an], "status")) {
+            opts.status = 1;
+            continue;
+        }
+        if ((cp = strchr(argv[an], '=')) == NULL) {
+            fprintf(stderr, "mt: illegal monitor option '%s'.\n", argv[an]);
+            return 1;
+        }
+        cp++;
+        if (!strncmp(argv[an], "dir=", 4))
+            opts.dir = cp;
+        else if (!strncmp(argv[an], "metrics=", 8))
+            opts.metrics = cp;
+        else if (!strncmp(argv[an], "dev=", 4))
+            opts.devdir = cp;
+        else if (!strncmp(argv[an], "interval=", 9)) {
+            if ((opts.interval = strtod(cp, &cp)) <= 0 || *cp != '\0') {
+                fprintf(stderr, "mt: bad interval '%s'.\n", argv[an] + 9);
+                return 1;
+            }
+        } else if (!strncmp(argv[an], "slots=", 6) || !strncmp(argv[an], "count=", 6)) {
+            if (parse_count(cp, INT_MAX, &value))
+                return 1;
+            if (value <= 0) {
+                fprintf(stderr, "mt: bad monitor option '%s'.\n", argv[an]);
+                return 1;
+            }
+            if (*argv[an] == 's')
+                opts.slots = value;
+            else
+                opts.count = value;
+        } else {
+            fprintf(stderr, "mt: illegal monitor option '%s'.\n", argv[an]);
+            return 1;
+        }
+    }
+    if (opts.metrics == NULL) {
+        snprintf(name, sizeof(name), "%s/metrics.prom", opts.dir);
+        opts.metrics = name;
+    }
+    if (mkdir(opts.dir, 0755) < 0 && errno != EEXIST) {
+        perror(opts.dir);
+        return 2;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    its.it_value.tv_sec = 0;
+    its.it_value.tv_nsec = 1; /* the first poll at once */
+    its.it_interval.tv_sec = (time_t)opts.interval;
+    its.it_interval.tv_nsec = (opts.interval - (time_t)opts.interval) * 1e9;
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 || (sfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0 ||
+        (tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0 ||
+        timerfd_settime(tfd, 0, &its, NULL) < 0 || (efd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("mt: monitor");
+        result = 2;
+        goto out;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = tfd;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev) < 0) {
+        perror("mt: epoll");
+        result = 2;
+        goto out;
+    }
+    ev.data.fd = sfd;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+        perror("mt: epoll");
+        result = 2;
+        goto out;
+    }
+
+    while (opts.count != 0) {
+        if (epoll_wait(efd, &ev, 1, -1) <= 0) {
+            if (errno == EINTR)
+                continue;
+            perror("mt: epoll");
+            result = 2;
+            break;
+        }
+        if (ev.data.fd == sfd) {
+            if (read(sfd, &si, sizeof(si)) == sizeof(si))
+                break;
+            continue;
+        }
+        if (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+            continue;
+        if (mon_add_drives(&drives, &n, &opts) < 0) {
+            result = 2;
+            break;
+        }
+        for (i = 0; i < n; i++)
+            mon_poll_drive(&drives[i], &opts);
+        mon_write_metrics(opts.metrics, drives, n);
+        if (opts.count > 0)
+            opts.count--;
+    }
+
+out:
+    for (i = 0; i < n; i++)
+        if (drives[i].ring != NULL)
+            munmap(drives[i].ring, drives[i].ringsize);
+    free(drives);
+    if (efd >= 0)
+        close(efd);
+    if (tfd >= 0)
+        close(tfd);
+    if (sfd >= 0)
+        close(sfd);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    return result;
+}
+
+
+/* Print a list of possible density codes */
+static int print_densities(int fd __attribute__((unused)),
+                           cmdef_tr *cmd __attribute__((unused)),
+                           int argc __attribute__((unused)),
+                           char **argv __attribute__((unused)))
+{
+    unsigned int i, offset;
+
+    if (output_json) {
+        printf("{\"densities\":[");
+        for (i = 0; i < NBR_DENSITIES; i++) {
+            printf("%s{\"code\":%d,\"name\":", i > 0 ? "," : "", density_tbl[i].code);
+            json_string(density_tbl[i].name);
+            printf("}");
+        }
+        printf("]}\n");
+        return 0;
+    }
+    printf("Some SCSI tape density codes:\ncode   explanation                  "
+           " code   explanation\n");
+    offset = (NBR_DENSITIES + 1) / 2;
+    for (i = 0; i < offset; i++) {
+        printf("0x%02x   %-28s", density_tbl[i].code, density_tbl[i].name);
+        if (i + offset < NBR_DENSITIES)
+            printf("  0x%02x   %s\n", density_tbl[i + offset].code,
+                   density_tbl[i + offset].name);
+        else
+            printf("\n");
+    }
+    return 0;
+}
+
+
+/* Try to find out why the command failed */
+static void test_error(int mtfd, cmdef_tr *cmd)
+{
+    struct mtget status;
+
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) < 0)
+        return;
+
+    if (status.mt_type != MT_ISSCSI1 && status.mt_type != MT_ISSCSI2)
+        return;
+
+    if ((cmd->error_tests & ET_ONLINE) && !GMT_ONLINE(status.mt_gstat))
+        fprintf(stderr,
+                "mt: The device is offline (not powered on, no tape ?).\n");
+    if ((cmd->error_tests & ET_WPROT) && GMT_WR_PROT(status.mt_gstat))
+        fprintf(stderr, "mt: The tape is write-protected.\n");
+}
+
+
+/*** Streaming data to and from the tape ***/
+
+/* The data goes through a ring buffer of blocks between two threads, one
+   reading the input and one writing the output. To keep the drive
+   streaming, the tape side starts only when the buffer has been filled
+   (when writing) or drained (when reading) to the high watermark, and it
+   stops when the buffer reaches the low watermark. */
+
+#define STREAM_BLKSIZE (256 * 1024)
+#define STREAM_BUFSIZE (64 * 1024 * 1024)
+#define STREAM_HIGH 75
+#define STREAM_LOW 0
+#define STREAM_QDEPTH 4
+#define STREAM_MAXQDEPTH 256
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+#define IO_DEFAULT 0
+#define IO_SYNC 1
+#define IO_URING 2
+
+typedef struct uring uring;
+typedef struct tar_index tar_index;
+
+typedef struct {
+    long long blksize;
+    long long bufsize;
+    int high, low;
+    int hugepages;
+    int backend;
+    int qdepth;
+    long long limit; /* stop after this many bytes, if not zero */
+    char *index;     /* where to store the tar index */
+    tar_index *tar;
+} stream_opts;
+
+typedef struct {
+    char *mem;
+    size_t memsize;
+    size_t blksize;
+    size_t padto; /* the fixed block size of the drive, or zero */
+    int nslots;
+    size_t *len;
+    int head, tail, fill;
+    int eof, error;
+    int tape_writes; /* the tape is the consumer */
+    int high, low;   /* watermarks in slots */
+    int paused, started;
+    long stops;
+    long long fill_sum;
+    long samples;
+    int tapefd, otherfd; /* otherfd < 0: generate the data */
+    int direct;          /* otherfd is open with O_DIRECT */
+    long long limit, produced;
+    long long bytes, blocks;
+    double secs, cpu;
+    uring *uring;
+    int qdepth;
+    tar_index *tar;
+    unsigned char (*imghdr)[12]; /* record lengths for tape images */
+    int *parts;                  /* io_uring requests pending per slot */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} stream_ring;
+
+static int uring_setup(stream_ring *, int);
+static void tar_scan(tar_index *, const char *, size_t);
+static tar_index *tar_index_new(void);
+static void tar_index_free(tar_index *);
+static int tar_index_store(int, tar_index *, const char *, long long, size_t, size_t);
+static void uring_teardown(stream_ring *);
+static void *stream_consumer_uring(void *);
+static int is_tape_image(int);
+
+static void init_stream_opts(stream_opts *opts)
+{
+    opts->blksize = 0;
+    opts->bufsize = STREAM_BUFSIZE;
+    opts->high = STREAM_HIGH;
+    opts->low = STREAM_LOW;
+    opts->hugepages = 0;
+    opts->backend = IO_DEFAULT;
+    opts->qdepth = STREAM_QDEPTH;
+    opts->limit = 0;
+    opts->index = NULL;
+    opts->tar = NULL;
+}
+
+static int parse_stream_args(int argc, char **argv, stream_opts *opts)
+{
+    int an;
+    long long value;
+    char *cp;
+
+    for (an = 0; an < argc; an++) {
+        if (!strcmp(argv[an], "hugepages")) {
+            opts->hugepages = 1;
+            continue;
+        }
+        if (!strcmp(argv[an], "io=sync")) {
+            opts->backend = IO_SYNC;
+            continue;
+        }
+        if (!strcmp(argv[an], "io=uring")) {
+            opts->backend = IO_URING;
+            continue;
+        }
+        if ((cp = strchr(argv[an], '=')) == NULL) {
+            fprintf(stderr, "mt: illegal stream option '%s'.\n", argv[an]);
+            return 1;
+        }
+        if (!strncmp(argv[an], "index=", 6)) {
+            opts->index = cp + 1;
+            continue;
+        }
+        if (!strncmp(argv[an], "size=", 5)) {
+            if (parse_count(cp + 1, LLONG_MAX, &opts->limit) != 0)
+                return 1;
+            continue;
+        }
+        if (parse_count(cp + 1, INT_MAX, &value) != 0)
+            return 1;
+        if (!strncmp(argv[an], "bs=", 3))
+            opts->blksize = value;
+        else if (!strncmp(argv[an], "buffer=", 7))
+            opts->bufsize = value;
+        else if (!strncmp(argv[an], "high=", 5))
+            opts->high = value;
+        else if (!strncmp(argv[an], "low=", 4))
+            opts->low = value;
+        else if (!strncmp(argv[an], "qd=", 3))
+            opts->qdepth = value;
+        else {
+            fprintf(stderr, "mt: illegal stream option '%s'.\n", argv[an]);
+            return 1;
+        }
+    }
+    if (opts->blksize < 0 || opts->bufsize <= 0 || opts->low < 0 || opts->high > 100 ||
+        opts->low >= opts->high || opts->qdepth < 1 || opts->qdepth > STREAM_MAXQDEPTH ||
+        opts->limit < 0) {
+        fprintf(stderr, "mt: illegal stream parameters.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Get an anonymous buffer, locked in memory if allowed */
+static char *alloc_buffer(size_t *size, int hugepages)
+{
+    void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (hugepages) {
+        *size = (*size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED)
+            fprintf(stderr, "mt: can't get huge pages (%s), using normal pages.\n",
+                    strerror(errno));
+    }
+#endif
+    if (p == MAP_FAILED)
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (mlock(p, *size) < 0)
+        fprintf(stderr, "mt: can't lock the buffer in memory: %s\n", strerror(errno));
+    return p;
+}
+
+/* Wait for a free slot. Returns its index, or -1 after an error. */
+static int ring_get_free(stream_ring *r)
+{
+    int slot = -1, free;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->error) {
+        free = r->nslots - r->fill;
+        if (!r->tape_writes) {
+            if (!r->paused && free <= r->low) {
+                r->paused = 1;
+                r->stops++;
+            }
+            if (r->paused && free >= r->high)
+                r->paused = 0;
+            if (!r->paused && free > 0) {
+                slot = r->head;
+                break;
+            }
+        } else if (free > 0) {
+            slot = r->head;
+            break;
+        }
+        pthread_cond_wait(&r->not_full, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return slot;
+}
+
+/* Get the filled slot ahead places after the oldest one, which the
+   caller still owns. Returns the slot index, -1 at the end of data or
+   after an error, or -2 if the slot is not ready and wait is not set.
+   The tape is stopped only when nothing is in flight (ahead is zero). */
+static int ring_get_full(stream_ring *r, int ahead, int wait)
+{
+    int slot = -1;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->error) {
+        if (r->tape_writes && ahead == 0) {
+            if (!r->paused && r->fill <= r->low && !r->eof) {
+                r->paused = 1;
+                if (r->started)
+                    r->stops++;
+            }
+            if (r->paused && (r->fill >= r->high || r->eof)) {
+                r->paused = 0;
+                r->started = 1;
+            }
+        }
+        if (!(r->tape_writes && r->paused) && r->fill > ahead) {
+            slot = (r->tail + ahead) % r->nslots;
+            break;
+        }
+        if (r->fill <= ahead && r->eof)
+            break;
+        if (!wait) {
+            slot = (-2);
+            break;
+        }
+        pthread_cond_wait(&r->not_empty, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return slot;
+}
+
+static void ring_put(stream_ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->head = (r->head + 1) % r->nslots;
+    r->fill++;
+    r->fill_sum += r->fill;
+    r->samples++;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_release(stream_ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->tail = (r->tail + 1) % r->nslots;
+    r->fill--;
+    pthread_cond_signal(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_finish(stream_ring *r, int failed)
+{
+    pthread_mutex_lock(&r->lock);
+    if (failed)
+        r->error = 1;
+    else
+        r->eof = 1;
+    pthread_cond_broadcast(&r->not_empty);
+    pthread_cond_broadcast(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Fill a block from the input. Pipes may return less than asked, so read
+   until the block is full or the input ends. */
+static ssize_t fill_block(stream_ring *r, char *p)
+{
+    size_t want = r->blksize, len;
+    ssize_t n = 0;
+
+    if (r->limit && r->limit - r->produced < (long long)want)
+        want = r->limit - r->produced;
+    if (want == 0)
+        return 0;
+    if (r->otherfd < 0)
+        len = want;
+    else if (r->direct) {
+        /* Direct reads must be whole aligned blocks, and only the last
+           one of a file is short */
+        if ((n = read(r->otherfd, p, r->blksize)) > 0)
+            len = (size_t)n < want ? (size_t)n : want;
+        else
+            len = 0;
+    } else
+        for (len = 0; len < want; len += n)
+            if ((n = read(r->otherfd, p + len, want - len)) <= 0)
+                break;
+    if (n < 0)
+        return (-1);
+    r->produced += len;
+    return len;
+}
+
+static void set_direct(stream_ring *, int);
+
+static void *stream_producer(void *arg)
+{
+    int slot, failed = 0;
+    ssize_t n;
+    size_t len;
+    char *p;
+    stream_ring *r = arg;
+
+    while ((slot = ring_get_free(r)) >= 0) {
+        p = r->mem + slot * r->blksize;
+        if (r->tape_writes) {
+            if ((n = fill_block(r, p)) < 0) {
+                perror("mt: read");
+                failed = 1;
+                break;
+            }
+            if (n == 0)
+                break;
+            if (r->tar != NULL)
+                tar_scan(r->tar, p, n);
+            len = n;
+            if (r->padto && len % r->padto) {
+                memset(p + len, 0, r->padto - len % r->padto);
+                len += r->padto - len % r->padto;
+            }
+        } else {
+            if (r->limit && r->bytes >= r->limit)
+                break;
+            if ((n = tape_read(r->tapefd, p, r->blksize)) < 0) {
+                perror(tape_name);
+                failed = 1;
+                break;
+            }
+            if (n == 0)
+                break;
+            if (r->limit && r->limit - r->bytes < n)
+                n = r->limit - r->bytes;
+            len = n;
+            r->bytes += n;
+            r->blocks++;
+        }
+        r->len[slot] = len;
+        ring_put(r);
+    }
+    ring_finish(r, failed);
+    return NULL;
+}
+
+static void *stream_consumer(void *arg)
+{
+    int slot;
+    ssize_t n = 0;
+    size_t len, done;
+    char *p;
+    stream_ring *r = arg;
+
+    while ((slot = ring_get_full(r, 0, 1)) >= 0) {
+        p = r->mem + slot * r->blksize;
+        len = r->len[slot];
+        if (r->tape_writes) {
+            if ((n = tape_write(r->tapefd, p, len)) != (ssize_t)len) {
+                if (n < 0)
+                    perror(tape_name);
+                else
+                    fprintf(stderr, "mt: short write to the tape (%zd of %zu bytes).\n", n, len);
+                ring_finish(r, 1);
+                break;
+            }
+            r->bytes += len;
+            r->blocks++;
+        } else {
+            if (r->direct && len % DIRECT_ALIGN)
+                set_direct(r, 0);
+            for (done = 0; done < len; done += n)
+                if ((n = write(r->otherfd, p + done, len - done)) < 0)
+                    break;
+            if (n < 0) {
+                perror("mt: write");
+                ring_finish(r, 1);
+                break;
+            }
+        }
+        ring_release(r);
+    }
+    return NULL;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec +
+           ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Generated data is random so that drive compression does not inflate
+   the throughput. It is written once and the slots are reused as such. */
+static void fill_random(char *mem, size_t size)
+{
+    unsigned long long x = 0x9e3779b97f4a7c15ULL, *p = (unsigned long long *)mem;
+    size_t i;
+
+    for (i = 0; i < size / sizeof(x); i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        p[i] = x;
+    }
+}
+
+/* Turn O_DIRECT off for the rest of the file, for a block that is not
+   aligned */
+static void set_direct(stream_ring *r, int on)
+{
+    int flags = fcntl(r->otherfd, F_GETFL);
+
+    if (flags >= 0)
+        fcntl(r->otherfd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT);
+    r->direct = on;
+}
+
+/* Move the data between the tape and otherfd. The statistics are left
+   in r. Returns 0 on success, 1 for bad parameters and 2 for I/O errors. */
+static int stream_run(int mtfd, stream_opts *opts, int tape_writes, int otherfd, stream_ring *r)
+{
+    int fixed = 0;
+    long long blksize = opts->blksize;
+    struct mtget status;
+    struct timespec start;
+    pthread_t producer, consumer;
+
+    memset(r, 0, sizeof(stream_ring));
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0)
+        fixed = (status.mt_dsreg & MT_ST_BLKSIZE_MASK) >> MT_ST_BLKSIZE_SHIFT;
+    if (blksize == 0)
+        blksize = fixed ? fixed : STREAM_BLKSIZE;
+    if (fixed && blksize % fixed) {
+        fprintf(stderr, "mt: the block size must be a multiple of %d bytes.\n", fixed);
+        return 1;
+    }
+
+    r->tape_writes = tape_writes;
+    r->tapefd = mtfd;
+    r->otherfd = otherfd;
+    if (otherfd >= 0 && (fcntl(otherfd, F_GETFL) & O_DIRECT))
+        set_direct(r, blksize % DIRECT_ALIGN == 0);
+    r->limit = opts->limit;
+    r->tar = opts->tar;
+    r->blksize = blksize;
+    r->padto = fixed;
+    r->memsize = opts->bufsize;
+    if ((r->mem = alloc_buffer(&r->memsize, opts->hugepages)) == NULL) {
+        perror("mt: can't allocate the buffer");
+        return 1;
+    }
+    if ((r->nslots = r->memsize / r->blksize) < 2) {
+        fprintf(stderr, "mt: the buffer must hold at least two blocks.\n");
+        munmap(r->mem, r->memsize);
+        return 1;
+    }
+    if ((r->len = calloc(r->nslots, sizeof(size_t))) == NULL) {
+        perror("mt");
+        munmap(r->mem, r->memsize);
+        return 1;
+    }
+    r->high = r->nslots * opts->high / 100;
+    if (r->high < 1)
+        r->high = 1;
+    r->low = r->nslots * opts->low / 100;
+    r->paused = r->tape_writes;
+    if (otherfd < 0)
+        fill_random(r->mem, r->memsize);
+    /* A drive gets the writes one at a time anyway, so by default
+       io_uring is used only for tape images, where they overlap */
+    if (r->tape_writes && (opts->backend == IO_URING ||
+                           (opts->backend == IO_DEFAULT && is_tape_image(mtfd))))
+        uring_setup(r, opts->qdepth);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+
+    r->cpu = cpu_seconds();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_create(&producer, NULL, stream_producer, r) != 0) {
+        perror("mt: can't start the threads");
+        r->error = 1;
+    } else {
+        if (pthread_create(&consumer, NULL,
+                           r->uring != NULL ? stream_consumer_uring : stream_consumer, r) != 0) {
+            perror("mt: can't start the threads");
+            ring_finish(r, 1);
+        } else
+            pthread_join(consumer, NULL);
+        pthread_join(producer, NULL);
+    }
+    r->secs = elapsed_since(&start);
+    r->cpu = cpu_seconds() - r->cpu;
+
+    uring_teardown(r);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+    free(r->len);
+    munmap(r->mem, r->memsize);
+    return r->error ? 2 : 0;
+}
+
+/* Open the file of dump or restore, with O_DIRECT if the file system
+   allows it */
+static int open_direct(const char *name, int writing)
+{
+    int fd, flags = writing ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+
+    if ((fd = open(name, flags | O_DIRECT, 0666)) < 0 && errno == EINVAL)
+        fd = open(name, flags, 0666);
+    if (fd < 0)
+        fprintf(stderr, "mt: can't open '%s': %s\n", name, strerror(errno));
+    return fd;
+}
+
+/* Copy stdin or a file to the tape, or the current tape file to stdout
+   or a file */
+static int do_stream(int mtfd, cmdef_tr *cmd, int argc, char **argv)
+{
+    int result, fd, tape_writes, direct;
+    stream_opts opts;
+    stream_ring r;
+    struct mtpos pos;
+
+    tape_writes = cmd->cmd_code == STREAM_WRITE || cmd->cmd_code == STREAM_DUMP;
+    fd = tape_writes ? 0 : 1;
+    if (cmd->cmd_code == STREAM_DUMP || cmd->cmd_code == STREAM_RESTORE) {
+        if (argc < 1) {
+            fprintf(stderr, "mt: missing file name.\n");
+            return 1;
+        }
+        if ((fd = open_direct(argv[0], !tape_writes)) < 0)
+            return 1;
+        argc--;
+        argv++;
+    }
+    direct = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+
+    init_stream_opts(&opts);
+    if (parse_stream_args(argc, argv, &opts) != 0)
+        result = 1;
+    else {
+        if (!tape_writes && opts.backend == IO_URING)
+            fprintf(stderr, "mt: io_uring is used only for writing.\n");
+        if (opts.index != NULL && tape_writes) {
+            if (tape_ioctl(mtfd, MTIOCPOS, (char *)&pos) < 0)
+                pos.mt_blkno = 0;
+            opts.tar = tar_index_new();
+        }
+        result = stream_run(mtfd, &opts, tape_writes, fd, &r);
+        if (opts.tar != NULL) {
+            if (result == 0)
+                result = tar_index_store(mtfd, opts.tar, opts.index, pos.mt_blkno, r.blksize,
+                                         r.padto);
+            tar_index_free(opts.tar);
+        }
+        if (tape_writes && result != 1)
+            catalog_learn(mtfd, 1);
+    }
+    if (fd > 1 && close(fd) < 0 && result == 0) {
+        fprintf(stderr, "mt: can't close '%s': %s\n", argv[-1], strerror(errno));
+        result = 2;
+    }
+    if (result == 1)
+        return 1;
+    direct = direct && r.blksize % DIRECT_ALIGN == 0;
+
+    fprintf(stderr, "mt: %s %lld bytes in %lld blocks, %.3f s, %.2f MB/s\n",
+            r.tape_writes ? "wrote" : "read", r.bytes, r.blocks, r.secs,
+            r.secs > 0 ? r.bytes / r.secs / 1e6 : 0.0);
+    fprintf(stderr, "mt: buffer %d blocks of %zu bytes, average fill %.0f%%, drive stops %ld",
+            r.nslots, r.blksize, r.samples ? 100.0 * r.fill_sum / r.samples / r.nslots : 0.0,
+            r.stops);
+    if (r.qdepth && is_tape_image(mtfd))
+        fprintf(stderr, ", io_uring depth %d", r.qdepth);
+    else if (r.qdepth)
+        fprintf(stderr, ", io_uring batches of %d, one write at a time", r.qdepth);
+    if (direct)
+        fprintf(stderr, ", direct I/O");
+    fprintf(stderr, "\n");
+    return result;
+}
+
+/* Write the same amount of generated data with both data paths and
+   compare the throughput. The tape is rewound before each pass. */
+static int do_iobench(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc, char **argv)
+{
+    int i, result = 0;
+    stream_opts opts;
+    stream_ring r;
+    struct mtop mt_com;
+    static const int backends[] = { IO_SYNC, IO_URING };
+
+    init_stream_opts(&opts);
+    opts.limit = 64 * 1024 * 1024;
+    if (parse_stream_args(argc, argv, &opts) != 0)
+        return 1;
+    if (opts.limit == 0) {
+        fprintf(stderr, "mt: illegal stream parameters.\n");
+        return 1;
+    }
+
+    printf("backend     depth  blocks      MB/s   seconds\n");
+    for (i = 0; i < 2; i++) {
+        mt_com.mt_op = MTREW;
+        mt_com.mt_count = 1;
+        if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+            perror(tape_name);
+            return 2;
+        }
+        opts.backend = backends[i];
+        if ((result = stream_run(mtfd, &opts, 1, -1, &r)) != 0)
+            break;
+        if (backends[i] == IO_URING && r.qdepth == 0) {
+            printf("io_uring    (not available)\n");
+            continue;
+        }
+        /* The writes in progress at once: a drive gets them one at a time */
+        printf("%-10s  %5d  %6lld  %8.2f  %8.3f\n", r.qdepth ? "io_uring" : "read/write",
+               r.qdepth && is_tape_image(mtfd) ? r.qdepth : 1, r.blocks,
+               r.secs > 0 ? r.bytes / r.secs / 1e6 : 0.0, r.secs);
+    }
+    return result;
+}
+
+
+/*** Tape images ***/
+
+/* If MT_TAPE_IMAGE is set, a regular file given as the tape device is
+   handled as a tape image in the SIMH format: each record is stored as
+   its length (32 bits, little endian), the data padded to an even length
+   and the length again. A zero length is a filemark. The only state is
+   the file offset, so the position is shared between processes just like
+   with a real drive, but it is lost when the device is closed (like with
+   a rewinding device). Without MT_TAPE_IMAGE, the ioctls on a file fail
+   as they always did, so that a mistyped device name is not written to;
+   the target of bench is an image anyway. */
+
+#define IMG_EOM 0xffffffffUL
+#define IMG_LEN_MASK 0x00ffffffUL
+#define IMG_GSTAT_ALL 0xffffffffL
+#define IMG_RECSIZE(len) ((len) == 0 ? 4 : 8 + (((len) + 1) & ~1UL))
+
+static int tape_images = -1;
+
+static int is_tape_image(int fd)
+{
+    struct stat st;
+    char *cp;
+
+    if (tape_images < 0)
+        tape_images = (cp = getenv("MT_TAPE_IMAGE")) != NULL && *cp != '\0';
+    return tape_images && fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Read the length word at off. Returns 1 if a record (or filemark) is
+   found, 0 at the end of data, and -1 on error. */
+static int img_length(int fd, off_t off, unsigned long *len)
+{
+    unsigned char b[4];
+    ssize_t n;
+
+    if ((n = pread(fd, b, 4, off)) < 0)
+        return (-1);
+    if (n < 4)
+        return 0;
+    *len = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned long)b[3] << 24);
+    if (*len == IMG_EOM)
+        return 0;
+    *len &= IMG_LEN_MASK;
+    return 1;
+}
+
+/* Move over one record forwards. Returns as img_length(). */
+static int img_forward(int fd, off_t *off, int *is_mark)
+{
+    int i;
+    unsigned long len;
+
+    if ((i = img_length(fd, *off, &len)) <= 0)
+        return i;
+    *is_mark = len == 0;
+    *off += IMG_RECSIZE(len);
+    return 1;
+}
+
+/* Move over one record backwards. Returns 0 at the beginning of tape. */
+static int img_backward(int fd, off_t *off, int *is_mark)
+{
+    int i;
+    unsigned long len;
+
+    if (*off < 4)
+        return 0;
+    if ((i = img_length(fd, *off - 4, &len)) <= 0)
+        return i < 0 ? i : (errno = EIO, -1);
+    *is_mark = len == 0;
+    *off -= IMG_RECSIZE(len);
+    return 1;
+}
+
+/* Space over count records or filemarks; stops early at a filemark when
+   spacing records. */
+static int img_space(int fd, off_t *off, int count, int marks, int forward)
+{
+    int i, is_mark = 0;
+
+    while (count > 0) {
+        i = forward ? img_forward(fd, off, &is_mark) : img_backward(fd, off, &is_mark);
+        if (i <= 0) {
+            if (i == 0)
+                errno = EIO;
+            return (-1);
+        }
+        if (is_mark && !marks) {
+            errno = EIO;
+            return (-1);
+        }
+        if (is_mark || !marks)
+            count--;
+    }
+    return 0;
+}
+
+static int img_write_marks(int fd, off_t *off, int count)
+{
+    static const unsigned char mark[4] = { 0, 0, 0, 0 };
+
+    if ((fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+        errno = EACCES;
+        return (-1);
+    }
+    for (; count > 0; count--, *off += 4)
+        if (pwrite(fd, mark, 4, *off) != 4)
+            return (-1);
+    return ftruncate(fd, *off);
+}
+
+static int img_op(int fd, struct mtop *op)
+{
+    int i, is_mark, result = 0;
+    off_t off;
+
+    if ((off = lseek(fd, 0, SEEK_CUR)) < 0)
+        return (-1);
+    switch (op->mt_op) {
+    case MTFSF:
+        result = img_space(fd, &off, op->mt_count, 1, 1);
+        break;
+    case MTBSF:
+        result = img_space(fd, &off, op->mt_count, 1, 0);
+        break;
+    case MTFSFM:
+        if ((result = img_space(fd, &off, op->mt_count, 1, 1)) == 0)
+            result = img_space(fd, &off, 1, 1, 0);
+        break;
+    case MTBSFM:
+        if ((result = img_space(fd, &off, op->mt_count, 1, 0)) == 0)
+            result = img_space(fd, &off, 1, 1, 1);
+        break;
+    case MTFSR:
+        result = img_space(fd, &off, op->mt_count, 0, 1);
+        break;
+    case MTBSR:
+        result = img_space(fd, &off, op->mt_count, 0, 0);
+        break;
+    case MTWEOF:
+    case MTWEOFI:
+        result = img_write_marks(fd, &off, op->mt_count);
+        break;
+    case MTREW:
+    case MTOFFL:
+    case MTRETEN:
+    case MTLOAD:
+    case MTUNLOAD:
+        off = 0;
+        break;
+    case MTEOM:
+        while ((i = img_forward(fd, &off, &is_mark)) > 0)
+            ;
+        result = i;
+        break;
+    case MTERASE:
+        if ((fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+            errno = EACCES;
+            result = (-1);
+        } else
+            result = ftruncate(fd, off);
+        break;
+    case MTSEEK:
+        off = 0;
+        for (i = 0; i < op->mt_count; i++)
+            if (img_forward(fd, &off, &is_mark) <= 0) {
+                errno = EIO;
+                result = (-1);
+                break;
+            }
+        break;
+    case MTSETPART:
+        if (op->mt_count != 0) {
+            errno = EINVAL;
+            result = (-1);
+        }
+        break;
+    case MTNOP:
+    case MTLOCK:
+    case MTUNLOCK:
+    case MTSETBLK:
+    case MTSETDENSITY:
+    case MTSETDRVBUFFER:
+    case MTCOMPRESSION:
+        break;
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+    if (lseek(fd, off, SEEK_SET) < 0)
+        return (-1);
+    return result;
+}
+
+/* Find the file and block numbers of the current position */
+static int img_get(int fd, struct mtget *status)
+{
+    int i, is_mark = 0;
+    unsigned long len;
+    off_t off, pos = 0;
+    struct stat st;
+
+    if ((off = lseek(fd, 0, SEEK_CUR)) < 0)
+        return (-1);
+    memset(status, 0, sizeof(struct mtget));
+    status->mt_type = MT_ISSCSI2;
+    while (pos < off && (i = img_forward(fd, &pos, &is_mark)) > 0) {
+        if (is_mark) {
+            status->mt_fileno++;
+            status->mt_blkno = 0;
+        } else
+            status->mt_blkno++;
+    }
+    status->mt_gstat = GMT_ONLINE(IMG_GSTAT_ALL);
+    if (off == 0)
+        status->mt_gstat |= GMT_BOT(IMG_GSTAT_ALL);
+    else if (is_mark && status->mt_blkno == 0)
+        status->mt_gstat |= GMT_EOF(IMG_GSTAT_ALL);
+    if (img_length(fd, off, &len) == 0)
+        status->mt_gstat |= GMT_EOD(IMG_GSTAT_ALL);
+    if (fstat(fd, &st) == 0 && (st.st_mode & 0222) == 0)
+        status->mt_gstat |= GMT_WR_PROT(IMG_GSTAT_ALL);
+    return 0;
+}
+
+/* The logical block address counts both the records and the filemarks */
+static int img_pos(int fd, struct mtpos *pos)
+{
+    int is_mark;
+    off_t off, p = 0;
+
+    if ((off = lseek(fd, 0, SEEK_CUR)) < 0)
+        return (-1);
+    for (pos->mt_blkno = 0; p < off && img_forward(fd, &p, &is_mark) > 0;)
+        pos->mt_blkno++;
+    return 0;
+}
+
+/* Read one record; a filemark reads as zero bytes and is passed over */
+static ssize_t img_read(int fd, void *buf, size_t count)
+{
+    int i;
+    unsigned long len;
+    off_t off;
+
+    if ((off = lseek(fd, 0, SEEK_CUR)) < 0 || (i = img_length(fd, off, &len)) < 0)
+        return (-1);
+    if (i == 0)
+        return 0;
+    if (lseek(fd, off + IMG_RECSIZE(len), SEEK_SET) < 0)
+        return (-1);
+    if (len > count) {
+        errno = ENOMEM;
+        return (-1);
+    }
+    if (len > 0 && pread(fd, buf, len, off + 4) != (ssize_t)len) {
+        errno = EIO;
+        return (-1);
+    }
+    return len;
+}
+
+/* Write one record; everything after it is lost, as on a real tape */
+static ssize_t img_write(int fd, const void *buf, size_t count)
+{
+    unsigned char hdr[4] = { count & 0xff, (count >> 8) & 0xff, (count >> 16) & 0xff, 0 };
+    off_t off;
+
+    if (count == 0)
+        return 0;
+    if (count > IMG_LEN_MASK) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if ((off = lseek(fd, 0, SEEK_CUR)) < 0)
+        return (-1);
+    if (pwrite(fd, hdr, 4, off) != 4 || pwrite(fd, buf, count, off + 4) != (ssize_t)count ||
+        ((count & 1) && pwrite(fd, "", 1, off + 4 + count) != 1) ||
+        pwrite(fd, hdr, 4, off + IMG_RECSIZE(count) - 4) != 4 ||
+        ftruncate(fd, off + IMG_RECSIZE(count)) < 0 ||
+        lseek(fd, off + IMG_RECSIZE(count), SEEK_SET) < 0)
+        return (-1);
+    return count;
+}
+
+static ssize_t tape_read(int fd, void *buf, size_t count)
+{
+    if (is_tape_image(fd))
+        return img_read(fd, buf, count);
+    return read(fd, buf, count);
+}
+
+static ssize_t tape_write(int fd, const void *buf, size_t count)
+{
+    if (is_tape_image(fd))
+        return img_write(fd, buf, count);
+    return write(fd, buf, count);
+}
+
+/* All tape ioctls go through here so that tape images can be used */
+static int tape_ioctl(int fd, unsigned long request, void *arg)
+{
+    if (!is_tape_image(fd))
+        return ioctl(fd, request, arg);
+    if (request == MTIOCTOP)
+        return img_op(fd, arg);
+    if (request == MTIOCGET)
+        return img_get(fd, arg);
+    if (request == MTIOCPOS)
+        return img_pos(fd, arg);
+    errno = ENOTTY;
+    return (-1);
+}
+
+/* The settings tried by bench, unless given on the command line */
+#define BENCH_MAXVALS 16
+#define BENCH_SIZE (256 * 1024 * 1024)
+
+static const char bench_blocks[] = "64k,128k,256k,512k,1M,2M,variable";
+static const char bench_buffers[] = "16M,64M";
+static const char bench_comps[] = "0,1";
+
+/* Parse a comma separated list of counts. "variable" is zero. */
+static int parse_list(const char *arg, long long max, long long *vals, int *nvals)
+{
+    char *copy, *cp, *save;
+    int result = 0;
+
+    if ((copy = strdup(arg)) == NULL) {
+        perror("mt");
+        return 1;
+    }
+    *nvals = 0;
+    for (cp = strtok_r(copy, ",", &save); cp != NULL && result == 0;
+         cp = strtok_r(NULL, ",", &save)) {
+        if (*nvals >= BENCH_MAXVALS) {
+            fprintf(stderr, "mt: too many values in '%s'.\n", arg);
+            result = 1;
+        } else if (!strcmp(cp, "variable"))
+            vals[(*nvals)++] = 0;
+        else
+            result = parse_count(cp, max, &vals[(*nvals)++]);
+    }
+    if (result == 0 && *nvals == 0) {
+        fprintf(stderr, "mt: illegal stream parameters.\n");
+        result = 1;
+    }
+    free(copy);
+    return result;
+}
+
+static int bench_op(int mtfd, int op, int count)
+{
+    struct mtop mt_com;
+
+    mt_com.mt_op = op;
+    mt_com.mt_count = count;
+    return tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com);
+}
+
+/* The drive settings changed by bench, put back when it ends or is
+   killed. comp is -1 if the compression could not be read. */
+static struct {
+    int fd, blksize, comp;
+} bench_saved = { -1, 0, -1 };
+
+/* Read the DCE bit of the data compression mode page */
+static int bench_compression(int mtfd)
+{
+    unsigned char cdb[6] = { 0x1a, 0x08, 0x0f, 0, 64, 0 };
+    unsigned char buf[64], *page;
+    size_t got;
+
+    if (scsi_cmd(mtfd, cdb, sizeof(cdb), SG_DXFER_FROM_DEV, buf, sizeof(buf), &got,
+                 SCSI_TIMEOUT) != 0 || got < 4)
+        return (-1);
+    page = buf + 4 + buf[3];
+    if (page + 3 > buf + got || (page[0] & 0x3f) != 0x0f)
+        return (-1);
+    return (page[2] & 0x80) != 0;
+}
+
+/* Only ioctls are used so that this can run in the signal handler */
+static void bench_restore(void)
+{
+    if (bench_saved.fd < 0)
+        return;
+    if (bench_saved.comp >= 0)
+        bench_op(bench_saved.fd, MTCOMPRESSION, bench_saved.comp);
+    bench_op(bench_saved.fd, MTSETBLK, bench_saved.blksize);
+    bench_saved.fd = -1;
+}
+
+static void bench_signal(int sig)
+{
+    bench_restore();
+    _exit(128 + sig);
+}
+
+/* Write and read back the start of the tape with each combination of
+   block size, buffer size and compression, and print the best one as a
+   mode line for stinit.def */
+static int do_bench(int mtfd __attribute__((unused)), cmdef_tr *cmd __attribute__((unused)),
+                    int argc, char **argv)
+{
+    int an, ib, ibuf, ic, nblocks, nbufs, ncomps, fd, devnull, result = 0, found = 0;
+    int best_block = 0, best_buf = 0, best_comp = 0, use_comp = 1, force = 0;
+    long long blocks[BENCH_MAXVALS], bufs[BENCH_MAXVALS], comps[BENCH_MAXVALS];
+    long long size = BENCH_SIZE;
+    double wr_mbs, rd_mbs, best = -1.0, best_wr = 0, best_rd = 0;
+    char *target = NULL, label[16];
+    stream_opts opts;
+    stream_ring w, r;
+    struct mtget status;
+    struct sigaction sa, oldint, oldterm;
+
+    if (parse_list(bench_blocks, INT_MAX, blocks, &nblocks) != 0 ||
+        parse_list(bench_buffers, INT_MAX, bufs, &nbufs) != 0 ||
+        parse_list(bench_comps, 1, comps, &ncomps) != 0)
+        return 1;
+    for (an = 0; an < argc; an++) {
+        if (!strcmp(argv[an], "--target")) {
+            if (++an >= argc) {
+                fprintf(stderr, "mt: missing file name.\n");
+                return 1;
+            }
+            target = argv[an];
+        } else if (!strcmp(argv[an], "--force")) {
+            force = 1;
+        } else if (!strncmp(argv[an], "bs=", 3)) {
+            if (parse_list(argv[an] + 3, INT_MAX, blocks, &nblocks) != 0)
+                return 1;
+        } else if (!strncmp(argv[an], "buffer=", 7)) {
+            if (parse_list(argv[an] + 7, INT_MAX, bufs, &nbufs) != 0)
+                return 1;
+        } else if (!strncmp(argv[an], "compression=", 12)) {
+            if (parse_list(argv[an] + 12, 1, comps, &ncomps) != 0)
+                return 1;
+        } else if (!strncmp(argv[an], "size=", 5)) {
+            if (parse_count(argv[an] + 5, LLONG_MAX, &size) != 0)
+                return 1;
+        } else {
+            fprintf(stderr, "mt: illegal bench option '%s'.\n", argv[an]);
+            return 1;
+        }
+    }
+    if (size <= 0) {
+        fprintf(stderr, "mt: illegal stream parameters.\n");
+        return 1;
+    }
+
+    /* The sweep overwrites the cartridge, so the drive is used only when
+       asked for */
+    if (target == NULL) {
+        if (!force) {
+            fprintf(stderr, "mt: bench overwrites the tape in %s; use --force to run it on the "
+                            "drive or --target to give a file.\n", tape_name);
+            return 1;
+        }
+        target = tape_name;
+    }
+
+    /* A target that does not exist yet is created as a tape image */
+    tape_images = 1;
+    if ((fd = open(target, O_RDWR | (target != tape_name ? O_CREAT : 0), 0666)) < 0) {
+        perror(target);
+        return 1;
+    }
+    if ((devnull = open("/dev/null", O_WRONLY)) < 0) {
+        perror("/dev/null");
+        close(fd);
+        return 1;
+    }
+    if (tape_ioctl(fd, MTIOCGET, (char *)&status) == 0)
+        bench_saved.blksize = (status.mt_dsreg & MT_ST_BLKSIZE_MASK) >> MT_ST_BLKSIZE_SHIFT;
+    bench_saved.comp = is_tape_image(fd) ? -1 : bench_compression(fd);
+    bench_saved.fd = fd;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = bench_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &oldint);
+    sigaction(SIGTERM, &sa, &oldterm);
+
+    printf("Writing and reading %lld bytes on %s for each setting.\n", size, target);
+    printf("   block   buffer  comp  write MB/s  read MB/s  CPU s/GB  stops\n");
+    for (ic = 0; ic < ncomps && result == 0; ic++) {
+        if (bench_op(fd, MTCOMPRESSION, comps[ic]) < 0) {
+            if (ncomps > 1)
+                printf("Compression %lld: not supported (%s)\n", comps[ic], strerror(errno));
+            use_comp = 0;
+            continue;
+        }
+        for (ib = 0; ib < nblocks && result == 0; ib++) {
+            if (blocks[ib])
+                snprintf(label, sizeof(label), "%lld", blocks[ib]);
+            else
+                strcpy(label, "variable");
+            if (bench_op(fd, MTSETBLK, blocks[ib]) < 0) {
+                printf("%8s  block size not supported (%s)\n", label, strerror(errno));
+                continue;
+            }
+            for (ibuf = 0; ibuf < nbufs && result == 0; ibuf++) {
+                init_stream_opts(&opts);
+                opts.blksize = blocks[ib] ? blocks[ib] : STREAM_BLKSIZE;
+                opts.bufsize = bufs[ibuf];
+                opts.limit = size;
+                if (bench_op(fd, MTREW, 1) < 0 || (result = stream_run(fd, &opts, 1, -1, &w)) != 0 ||
+                    bench_op(fd, MTREW, 1) < 0 || (result = stream_run(fd, &opts, 0, devnull, &r)) != 0) {
+                    if (result == 0) {
+                        perror(target);
+                        result = 2;
+                    }
+                    break;
+                }
+                if (r.bytes != w.bytes) {
+                    fprintf(stderr, "mt: wrote %lld bytes but read back %lld.\n", w.bytes, r.bytes);
+                    result = 2;
+                    break;
+                }
+                wr_mbs = w.secs > 0 ? w.bytes / w.secs / 1e6 : 0.0;
+                rd_mbs = r.secs > 0 ? r.bytes / r.secs / 1e6 : 0.0;
+                printf("%8s  %6lldM  %4lld  %10.2f  %9.2f  %8.3f  %5ld\n", label,
+                       bufs[ibuf] >> 20, comps[ic], wr_mbs, rd_mbs,
+                       (w.cpu + r.cpu) * 1e9 / (w.bytes + r.bytes), w.stops + r.stops);
+                /* The slower direction decides */
+                if ((rd_mbs < wr_mbs ? rd_mbs : wr_mbs) > best) {
+                    best = rd_mbs < wr_mbs ? rd_mbs : wr_mbs;
+                    best_wr = wr_mbs;
+                    best_rd = rd_mbs;
+                    best_block = blocks[ib];
+                    best_buf = bufs[ibuf];
+                    best_comp = comps[ic];
+                    found = 1;
+                }
+            }
+        }
+    }
+
+    bench_op(fd, MTREW, 1);
+    bench_restore();
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGTERM, &oldterm, NULL);
+    close(devnull);
+    close(fd);
+    if (result != 0)
+        return result;
+    if (!found) {
+        fprintf(stderr, "mt: no setting could be measured.\n");
+        return 2;
+    }
+    printf("\nBest setting (write %.2f MB/s, read %.2f MB/s, mt write buffer=%dM):\n", best_wr,
+           best_rd, best_buf >> 20);
+    printf("mode1 blocksize=%d", best_block);
+    if (use_comp)
+        printf(" compression=%d", best_comp);
+    printf("\n");
+    return 0;
+}
+
+
+/*** Tar member index ***/
+
+/* While a tar stream is written, the headers are picked out of the data
+   going through the buffer. For each member the index records the block
+   address of the block holding its first header, the offset of the
+   header in that block and the length of the member with its headers
+   and padding. The index is sorted by name and written as text, either
+   to a file or to the tape as the next file. */
+
+#define TAR_BLOCK 512
+#define TAR_MAXNAME 65536
+#define INDEX_MAGIC "# mt-st tar index v1"
+
+typedef struct {
+    char *name;
+    long long offset; /* in the stream, of the first header */
+    long long length;
+} tar_member;
+
+struct tar_index {
+    long long pos;       /* bytes seen */
+    long long next;      /* offset of the next header */
+    long long chain;     /* offset of the first header of the member, or -1 */
+    unsigned char hdr[TAR_BLOCK];
+    int hdrfill;
+    int capture;         /* the data is a long name ('L') or pax header ('x') */
+    char *extra;         /* the captured data */
+    long long extrafill, extralen;
+    char *longname;      /* name for the next member */
+    int done;
+    tar_member *members;
+    int nmembers, maxmembers;
+};
+
+static long long tar_octal(const unsigned char *p, int len)
+{
+    long long v = 0;
+
+    while (len > 0 && (*p == ' ' || *p == 0)) {
+        p++;
+        len--;
+    }
+    for (; len > 0 && *p >= '0' && *p <= '7'; p++, len--)
+        v = v * 8 + (*p - '0');
+    return v;
+}
+
+static int tar_checksum_ok(const unsigned char *h)
+{
+    long long sum = 0;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return sum == tar_octal(h + 148, 8);
+}
+
+static void tar_add_member(tar_index *t, char *name, long long offset, long long length)
+{
+    tar_member *p;
+    int n;
+
+    if (t->nmembers == t->maxmembers) {
+        n = t->maxmembers ? t->maxmembers * 2 : 256;
+        if ((p = realloc(t->members, n * sizeof(tar_member))) == NULL) {
+            free(name);
+            return;
+        }
+        t->members = p;
+        t->maxmembers = n;
+    }
+    t->members[t->nmembers].name = name;
+    t->members[t->nmembers].offset = offset;
+    t->members[t->nmembers++].length = length;
+}
+
+/* Take the path out of pax extended header records "len path=value\n" */
+static char *pax_path(const char *data, long long len)
+{
+    const char *p = data, *eq;
+    long long reclen;
+    char *end, *name;
+
+    while (p < data + len) {
+        reclen = strtoll(p, &end, 10);
+        if (reclen <= 0 || end == p || p + reclen > data + len)
+            break;
+        if ((eq = memchr(end, '=', p + reclen - end)) != NULL && eq - end == 5 &&
+            !memcmp(end, " path", 5)) {
+            if ((name = malloc(p + reclen - eq - 1)) == NULL)
+                return NULL;
+            memcpy(name, eq + 1, p + reclen - eq - 2);
+            name[p + reclen - eq - 2] = '\0';
+            return name;
+        }
+        p += reclen;
+    }
+    return NULL;
+}
+
+static void tar_header(tar_index *t)
+{
+    const unsigned char *h = t->hdr;
+    long long size, offset = t->next;
+    char *name;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK && h[i] == 0; i++)
+        ;
+    if (i == TAR_BLOCK || !tar_checksum_ok(h)) {
+        if (i != TAR_BLOCK)
+            fprintf(stderr, "mt: not a tar header at offset %lld, index stops there.\n", offset);
+        t->done = 1;
+        return;
+    }
+    size = tar_octal(h + 124, 12);
+    if (t->chain < 0)
+        t->chain = offset;
+    t->next = offset + TAR_BLOCK + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+    if (h[156] == 'L' || h[156] == 'x') {
+        /* The name of the next member is in the data */
+        t->capture = h[156];
+        t->extralen = size < TAR_MAXNAME ? size : TAR_MAXNAME;
+        t->extrafill = 0;
+        free(t->extra);
+        if ((t->extra = malloc(t->extralen + 1)) == NULL)
+            t->capture = 0;
+        return;
+    }
+    if (h[156] == 'g' || h[156] == 'K')
+        return;
+
+    if (t->longname != NULL) {
+        name = t->longname;
+        t->longname = NULL;
+    } else if ((name = malloc(257)) != NULL) {
+        if (!memcmp(h + 257, "ustar", 5) && h[345])
+            snprintf(name, 257, "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+        else
+            snprintf(name, 257, "%.100s", (const char *)h);
+    }
+    if (name != NULL)
+        tar_add_member(t, name, t->chain, t->next - t->chain);
+    t->chain = -1;
+}
+
+/* Look at the next len bytes of the stream */
+static void tar_scan(tar_index *t, const char *p, size_t len)
+{
+    size_t n;
+
+    while (len > 0 && !t->done) {
+        if (t->pos < t->next) {
+            n = t->next - t->pos < (long long)len ? (size_t)(t->next - t->pos) : len;
+            if (t->capture && t->extrafill < t->extralen) {
+                size_t c = t->extralen - t->extrafill;
+
+                if (c > n)
+                    c = n;
+                memcpy(t->extra + t->extrafill, p, c);
+                t->extrafill += c;
+            }
+        } else {
+            if (t->capture) {
+                t->extra[t->extrafill] = '\0';
+                free(t->longname);
+                t->longname = t->capture == 'L' ? strdup(t->extra) : pax_path(t->extra, t->extrafill);
+                t->capture = 0;
+            }
+            n = TAR_BLOCK - t->hdrfill < (int)len ? (size_t)(TAR_BLOCK - t->hdrfill) : len;
+            memcpy(t->hdr + t->hdrfill, p, n);
+            if ((t->hdrfill += n) == TAR_BLOCK) {
+                t->hdrfill = 0;
+                tar_header(t);
+            }
+        }
+        t->pos += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static tar_index *tar_index_new(void)
+{
+    tar_index *t = calloc(1, sizeof(tar_index));
+
+    if (t != NULL)
+        t->chain = -1;
+    return t;
+}
+
+static void tar_index_free(tar_index *t)
+{
+    int i;
+
+    for (i = 0; i < t->nmembers; i++)
+        free(t->members[i].name);
+    free(t->members);
+    free(t->extra);
+    free(t->longname);
+    free(t);
+}
+
+static int cmp_members(const void *a, const void *b)
+{
+    const tar_member *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+
+    if (c)
+        return c;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Names are written with backslash escapes for tab, newline and
+   backslash */
+static void put_name(FILE *f, const char *name)
+{
+    for (; *name; name++)
+        if (*name == '\\')
+            fputs("\\\\", f);
+        else if (*name == '\n')
+            fputs("\\n", f);
+        else if (*name == '\t')
+            fputs("\\t", f);
+        else
+            putc(*name, f);
+}
+
+static void get_name(char *name)
+{
+    char *p = name;
+
+    for (; *name; name++, p++)
+        if (*name == '\\' && name[1]) {
+            name++;
+            *p = *name == 'n' ? '\n' : *name == 't' ? '\t' : *name;
+        } else
+            *p = *name;
+    *p = '\0';
+}
+
+/* Write the index, with the block addresses counted from base */
+static void tar_index_write(tar_index *t, FILE *f, long long base, size_t blksize)
+{
+    int i;
+    tar_member *m;
+
+    qsort(t->members, t->nmembers, sizeof(tar_member), cmp_members);
+    fprintf(f, "%s blksize %zu members %d\n", INDEX_MAGIC, blksize, t->nmembers);
+    for (i = 0; i < t->nmembers; i++) {
+        m = &t->members[i];
+        fprintf(f, "%lld\t%lld\t%lld\t", base + m->offset / (long long)blksize,
+                m->offset % (long long)blksize, m->length);
+        put_name(f, m->name);
+        putc('\n', f);
+    }
+}
+
+/* Store the index after the data was written. With "tape", a filemark
+   ends the archive and the index is the next tape file. */
+static int tar_index_store(int mtfd, tar_index *t, const char *where, long long base,
+                           size_t blksize, size_t padto)
+{
+    FILE *f;
+    char *text = NULL;
+    size_t size = 0, done, len;
+    struct mtop mt_com;
+    int result = 0;
+
+    fprintf(stderr, "mt: indexed %d tar members.\n", t->nmembers);
+    if (strcmp(where, "tape")) {
+        if ((f = fopen(where, "w")) == NULL) {
+            fprintf(stderr, "mt: can't write the index '%s': %s\n", where, strerror(errno));
+            return 2;
+        }
+        tar_index_write(t, f, base, blksize);
+        if (fclose(f) != 0) {
+            fprintf(stderr, "mt: can't write the index '%s': %s\n", where, strerror(errno));
+            return 2;
+        }
+        return 0;
+    }
+
+    if ((f = open_memstream(&text, &size)) == NULL) {
+        perror("mt");
+        return 2;
+    }
+    tar_index_write(t, f, base, blksize);
+    fclose(f);
+    mt_com.mt_op = MTWEOF;
+    mt_com.mt_count = 1;
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+        perror(tape_name);
+        free(text);
+        return 2;
+    }
+    if (padto && size % padto) {
+        /* Fixed blocks: fill the last one with zero bytes */
+        if ((text = realloc(text, size + padto - size % padto)) == NULL) {
+            perror("mt");
+            return 2;
+        }
+        memset(text + size, 0, padto - size % padto);
+        size += padto - size % padto;
+    }
+    for (done = 0; done < size && result == 0; done += len) {
+        len = size - done < blksize ? size - done : blksize;
+        if (tape_write(mtfd, text + done, len) != (ssize_t)len) {
+            perror(tape_name);
+            result = 2;
+        }
+    }
+    free(text);
+    return result;
+}
+
+/* Read the index from a file, or from the next tape file */
+static char *tar_index_load(int mtfd, const char *where, size_t blksize)
+{
+    FILE *f;
+    char *text = NULL, *buf;
+    size_t size = 0;
+    ssize_t n;
+    struct mtop mt_com;
+
+    if (strcmp(where, "tape")) {
+        if ((f = fopen(where, "r")) == NULL) {
+            fprintf(stderr, "mt: can't read the index '%s': %s\n", where, strerror(errno));
+            return NULL;
+        }
+        buf = malloc(blksize);
+        if ((text = malloc(1)) != NULL)
+            *text = '\0';
+        while (buf != NULL && text != NULL && (n = fread(buf, 1, blksize, f)) > 0) {
+            if ((text = realloc(text, size + n + 1)) != NULL) {
+                memcpy(text + size, buf, n);
+                size += n;
+                text[size] = '\0';
+            }
+        }
+        fclose(f);
+        free(buf);
+        return text;
+    }
+
+    mt_com.mt_op = MTFSF;
+    mt_com.mt_count = 1;
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+        perror(tape_name);
+        return NULL;
+    }
+    if ((buf = malloc(blksize)) == NULL || (text = malloc(1)) == NULL) {
+        free(buf);
+        return NULL;
+    }
+    while ((n = tape_read(mtfd, buf, blksize)) > 0) {
+        if ((text = realloc(text, size + n + 1)) == NULL)
+            break;
+        memcpy(text + size, buf, n);
+        size += n;
+    }
+    if (n < 0)
+        perror(tape_name);
+    if (text != NULL)
+        text[size] = '\0';
+    free(buf);
+    if (n < 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/* extract member [index=file|tape] [bs=size]: copy one member of a tar
+   archive to stdout as a tar stream of its own. Without a file, the
+   index is taken from the tape file after the archive, which must be
+   the current tape file. */
+static int do_extract(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc, char **argv)
+{
+    char *text, *line, *next, *name, *where = "tape", *buf;
+    long long lba = -1, skip = 0, length = 0, l, s, len, bs = STREAM_BLKSIZE;
+    int an, tabs, found = 0, result = 0;
+    size_t blksize = 0;
+    ssize_t n;
+    struct mtop mt_com;
+    static const char zeros[2 * TAR_BLOCK];
+
+    if (argc < 1) {
+        fprintf(stderr, "mt: missing member name.\n");
+        return 1;
+    }
+    for (an = 1; an < argc; an++) {
+        if (!strncmp(argv[an], "index=", 6))
+            where = argv[an] + 6;
+        else if (!strncmp(argv[an], "bs=", 3)) {
+            if (parse_count(argv[an] + 3, INT_MAX, &bs) != 0)
+                return 1;
+        } else {
+            fprintf(stderr, "mt: illegal extract option '%s'.\n", argv[an]);
+            return 1;
+        }
+    }
+    if (bs <= 0) {
+        fprintf(stderr, "mt: illegal stream parameters.\n");
+        return 1;
+    }
+
+    if ((text = tar_index_load(mtfd, where, bs)) == NULL)
+        return 2;
+    if (sscanf(text, INDEX_MAGIC " blksize %zu", &blksize) != 1 || blksize == 0) {
+        fprintf(stderr, "mt: '%s' is not a tar index.\n", where);
+        free(text);
+        return 2;
+    }
+    /* The members are sorted, and the last copy of a name wins */
+    for (line = strchr(text, '\n'); line != NULL && *++line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next = '\0';
+        for (name = line, tabs = 0; *name && tabs < 3; name++)
+            tabs += *name == '\t';
+        if (tabs == 3 && sscanf(line, "%lld %lld %lld", &l, &s, &len) == 3) {
+            get_name(name);
+            if (!strcmp(name, argv[0])) {
+                lba = l;
+                skip = s;
+                length = len;
+                found = 1;
+            }
+        }
+        if (next == NULL)
+            break;
+    }
+    free(text);
+    if (!found) {
+        fprintf(stderr, "mt: member '%s' not found in the index.\n", argv[0]);
+        return 2;
+    }
+
+    mt_com.mt_op = MTSEEK;
+    mt_com.mt_count = lba;
+    if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0) {
+        perror(tape_name);
+        return 2;
+    }
+    if ((buf = malloc(blksize)) == NULL) {
+        perror("mt");
+        return 2;
+    }
+    while (length > 0) {
+        if ((n = tape_read(mtfd, buf, blksize)) <= 0) {
+            if (n < 0)
+                perror(tape_name);
+            else
+                fprintf(stderr, "mt: the member ends early.\n");
+            result = 2;
+            break;
+        }
+        if (n <= skip) {
+            skip -= n;
+            continue;
+        }
+        len = n - skip < length ? n - skip : length;
+        if (write(1, buf + skip, len) != len) {
+            perror("mt: write");
+            result = 2;
+            break;
+        }
+        length -= len;
+        skip = 0;
+    }
+    free(buf);
+    /* The end of archive */
+    if (result == 0 && write(1, zeros, sizeof(zeros)) != sizeof(zeros)) {
+        perror("mt: write");
+        result = 2;
+    }
+    return result;
+}
+
+
+/*** Restore scheduling ***/
+
+/* A list of block ranges is read in an order that follows the layout of
+   the tape. On serpentine tapes (LTO, 3592, T10000) the data runs forward
+   on even wraps and backward on odd ones, so the physical position of a
+   block depends on its wrap. The seek cost is estimated from the wraps and
+   length of the medium, given in density_tbl for its density code, and the
+   current position from READ POSITION (MTIOCPOS). Ranges given as
+   file/block are placed using the catalog if possible; the others are read
+   after them in file order, spacing from the current file. */
+
+#define SEEK_FIXED_SECS 1.0 /* to start a locate */
+#define SEEK_WRAP_SECS 2.0  /* to change the wrap */
+#define SCHED_MAXLINE 4096
+
+/* The media without a geometry in density_tbl: one pass */
+static struct densities one_pass = { 0, "unknown", 1, 0, 1000, 4.0 };
+
+typedef struct {
+    int lineno;
+    long long lba;     /* -1 if not known */
+    long long filelba; /* of the file, if placed with the catalog; else -1 */
+    int fileno, blkno;
+    long long count;
+    char *out;
+} sched_range;
+
+typedef struct {
+    struct densities *model;
+    long long per_wrap; /* blocks in one wrap */
+} seek_params;
+
+static int rao_order(int, sched_range **, int);
+
+static struct densities *find_seek_model(int density)
+{
+    unsigned int i;
+
+    for (i = 0; i < NBR_DENSITIES; i++)
+        if (density_tbl[i].code == density && density_tbl[i].wraps > 0)
+            return &density_tbl[i];
+    return &one_pass;
+}
+
+/* The wrap and longitudinal position (m) of a block */
+static int block_place(seek_params *sp, long long lba, double *x)
+{
+    long long wrap = lba / sp->per_wrap;
+    double frac = (double)(lba % sp->per_wrap) / sp->per_wrap;
+
+    if (wrap >= sp->model->wraps)
+        wrap = sp->model->wraps - 1;
+    *x = (wrap % 2 == 0 ? frac : 1.0 - frac) * sp->model->length;
+    return wrap;
+}
+
+static double seek_time(seek_params *sp, long long from, long long to)
+{
+    double x1, x2, t = SEEK_FIXED_SECS;
+
+    if (from == to)
+        return 0.0;
+    if (block_place(sp, from, &x1) != block_place(sp, to, &x2))
+        t += SEEK_WRAP_SECS;
+    return t + (x2 > x1 ? x2 - x1 : x1 - x2) / sp->model->speed;
+}
+
+/* The estimated seek time for reading the ranges in the order given */
+static double schedule_cost(seek_params *sp, sched_range **order, int n, long long start)
+{
+    double t = 0.0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (order[i]->lba >= 0) {
+            t += seek_time(sp, start, order[i]->lba);
+            start = order[i]->lba + order[i]->count;
+        }
+    return t;
+}
+
+static int cmp_ranges(const void *a, const void *b)
+{
+    const sched_range *x = *(sched_range *const *)a, *y = *(sched_range *const *)b;
+
+    /* The ranges without a block address go last, in file order */
+    if ((x->lba < 0) != (y->lba < 0))
+        return x->lba < 0 ? 1 : -1;
+    if (x->lba != y->lba)
+        return x->lba < y->lba ? -1 : 1;
+    if (x->fileno != y->fileno)
+        return x->fileno - y->fileno;
+    if (x->blkno != y->blkno)
+        return x->blkno - y->blkno;
+    return x->lineno - y->lineno;
+}
+
+/* Order the ranges by block address, which is one forward pass per
+   wrap. The pass starts either from the beginning of the tape or from
+   the current position, going back for the rest at the end, whichever
+   the model says is faster. */
+static double schedule(seek_params *sp, sched_range **order, int n, long long start)
+{
+    sched_range **rotated;
+    double from_bot, from_here;
+    int i, k, known;
+
+    qsort(order, n, sizeof(sched_range *), cmp_ranges);
+    for (known = 0; known < n && order[known]->lba >= 0; known++)
+        ;
+    for (k = 0; k < known && order[k]->lba < start; k++)
+        ;
+    from_bot = schedule_cost(sp, order, n, start);
+    if (k == 0 || k == known || (rotated = malloc(n * sizeof(sched_range *))) == NULL)
+        return from_bot;
+    for (i = 0; i < known; i++)
+        rotated[i] = order[(k + i) % known];
+    for (; i < n; i++)
+        rotated[i] = order[i];
+    from_here = schedule_cost(sp, rotated, n, start);
+    if (from_here < from_bot) {
+        memcpy(order, rotated, n * sizeof(sched_range *));
+        from_bot = from_here;
+    }
+    free(rotated);
+    return from_bot;
+}
+
+static void free_ranges(sched_range *ranges, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        free(ranges[i].out);
+    free(ranges);
+}
+
+/* Read the list: "lba count [file]" or "fileno/blkno count [file]" */
+static sched_range *read_ranges(const char *name, int *nranges)
+{
+    FILE *f;
+    char line[SCHED_MAXLINE], pos[64], out[SCHED_MAXLINE];
+    sched_range *ranges = NULL, *p, *r;
+    int n = 0, max = 0, lineno = 0, fields;
+    long long count;
+
+    if (!strcmp(name, "-"))
+        f = stdin;
+    else if ((f = fopen(name, "r")) == NULL) {
+        perror(name);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        count = 1;
+        out[0] = '\0';
+        if ((fields = sscanf(line, "%63s %lld %4095s", pos, &count, out)) < 1 || pos[0] == '#')
+            continue;
+        if (n == max) {
+            max = max ? max * 2 : 64;
+            if ((p = realloc(ranges, max * sizeof(sched_range))) == NULL) {
+                perror("mt");
+                break;
+            }
+            ranges = p;
+        }
+        r = &ranges[n];
+        memset(r, 0, sizeof(sched_range));
+        r->lineno = lineno;
+        r->count = count;
+        r->lba = r->filelba = -1;
+        if (strchr(pos, '/') != NULL ? sscanf(pos, "%d/%d", &r->fileno, &r->blkno) != 2 ||
+                                           r->fileno < 0 || r->blkno < 0
+                                     : sscanf(pos, "%lld", &r->lba) != 1 || r->lba < 0) {
+            fprintf(stderr, "mt: %s:%d: illegal position '%s'.\n", name, lineno, pos);
+            free_ranges(ranges, n);
+            ranges = NULL;
+            break;
+        }
+        if (count < 1) {
+            fprintf(stderr, "mt: %s:%d: illegal block count.\n", name, lineno);
+            free_ranges(ranges, n);
+            ranges = NULL;
+            break;
+        }
+        if (fields == 3 && (r->out = strdup(out)) == NULL) {
+            perror("mt");
+            free_ranges(ranges, n + 1);
+            ranges = NULL;
+            break;
+        }
+        n++;
+    }
+    if (f != stdin)
+        fclose(f);
+    if (ranges != NULL && n == 0) {
+        fprintf(stderr, "mt: no ranges in '%s'.\n", name);
+        free(ranges);
+        ranges = NULL;
+    }
+    *nranges = n;
+    return ranges;
+}
+
+/* Place the file/block ranges with the catalog. With check, the entry of
+   each file is checked on the tape first (once for all its ranges), and
+   the ranges of a file whose entry is wrong are left unplaced. */
+static void place_ranges(int mtfd, sched_range *ranges, int n, int check)
+{
+    int i, j;
+    long long lba;
+
+    for (i = 0; i < n; i++) {
+        if (ranges[i].lba >= 0)
+            continue;
+        for (j = 0; j < i; j++)
+            if (ranges[j].filelba >= 0 && ranges[j].fileno == ranges[i].fileno)
+                break;
+        if (j < i)
+            lba = ranges[j].filelba;
+        else if ((lba = catalog_lookup(mtfd, ranges[i].fileno)) < 0 ||
+                 (check && catalog_locate(mtfd, ranges[i].fileno, lba) < 0))
+            continue;
+        ranges[i].filelba = lba;
+        ranges[i].lba = lba + ranges[i].blkno;
+    }
+}
+
+/* Position to a range and copy its blocks. A file/block range is
+   reached from the current file as asf would, or by spacing forward
+   within the current file. One placed with the catalog is located if
+   the tape confirms the catalog entry. */
+static int read_range(int mtfd, sched_range *r, char *buf, size_t bufsize)
+{
+    struct mtop mt_com;
+    struct mtget status;
+    tape_plan cands[PLAN_MAXCANDS];
+    long long i;
+    ssize_t n;
+    int fd = 1, result = 0, ncands, fileno = -1, blkno = -1;
+
+    if (r->filelba >= 0 && catalog_locate(mtfd, r->fileno, r->filelba) == 0) {
+        mt_com.mt_op = MTFSR;
+        mt_com.mt_count = r->blkno;
+        if (r->blkno > 0 && tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0)
+            result = 2;
+    } else if (r->lba >= 0 && r->filelba < 0) {
+        mt_com.mt_op = MTSEEK;
+        mt_com.mt_count = r->lba;
+        if (tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0)
+            result = 2;
+    } else {
+        if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0) {
+            fileno = status.mt_fileno;
+            blkno = status.mt_blkno;
+        }
+        if (fileno != r->fileno || blkno < 0 || blkno > r->blkno) {
+            ncands = plan_candidates(0, r->fileno, fileno, blkno, cands);
+            if (run_plan(mtfd, &cands[cheapest_plan(cands, ncands)]) < 0)
+                result = 2;
+            blkno = 0;
+        }
+        mt_com.mt_op = MTFSR;
+        mt_com.mt_count = r->blkno - blkno;
+        if (result == 0 && mt_com.mt_count > 0 && tape_ioctl(mtfd, MTIOCTOP, (char *)&mt_com) < 0)
+            result = 2;
+    }
+    if (result) {
+        perror(tape_name);
+        return result;
+    }
+    if (r->out != NULL && (fd = open(r->out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        fprintf(stderr, "mt: can't open '%s': %s\n", r->out, strerror(errno));
+        return 2;
+    }
+    for (i = 0; i < r->count && result == 0; i++) {
+        if ((n = tape_read(mtfd, buf, bufsize)) < 0) {
+            perror(tape_name);
+            result = 2;
+        } else if (n == 0)
+            break; /* a filemark ends the range */
+        else if (write(fd, buf, n) != n) {
+            perror("mt: write");
+            result = 2;
+        }
+    }
+    if (fd != 1 && close(fd) < 0 && result == 0) {
+        perror(r->out);
+        result = 2;
+    }
+    return result;
+}
+
+/* schedule list [--simulate] [--rao] [density=code] [start=lba] [bs=size] */
+static int do_schedule(int mtfd __attribute__((unused)), cmdef_tr *cmd __attribute__((unused)),
+                       int argc, char **argv)
+{
+    int an, i, n, known, fd = -1, simulate = 0, rao = 0, density = -1, result = 0;
+    long long start = -1, bs = STREAM_BLKSIZE, value, maxlba = 0, lba;
+    char *list = NULL, *buf = NULL;
+    double fifo, planned;
+    sched_range *ranges, **order, **given;
+    seek_params sp;
+    struct mtget status;
+    struct mtpos pos;
+
+    for (an = 0; an < argc; an++) {
+        if (!strcmp(argv[an], "--simulate"))
+            simulate = 1;
+        else if (!strcmp(argv[an], "--rao"))
+            rao = 1;
+        else if (!strncmp(argv[an], "density=", 8) || !strncmp(argv[an], "start=", 6) ||
+                 !strncmp(argv[an], "bs=", 3)) {
+            if (parse_count(strchr(argv[an], '=') + 1, LLONG_MAX, &value) != 0)
+                return 1;
+            if (argv[an][0] == 'd')
+                density = value;
+            else if (argv[an][0] == 's')
+                start = value;
+            else
+                bs = value;
+        } else if (list == NULL)
+            list = argv[an];
+        else {
+            fprintf(stderr, "mt: illegal schedule option '%s'.\n", argv[an]);
+            return 1;
+        }
+    }
+    if (list == NULL) {
+        fprintf(stderr, "mt: missing file name.\n");
+        return 1;
+    }
+    if (bs <= 0 || bs > INT_MAX) {
+        fprintf(stderr, "mt: illegal stream parameters.\n");
+        return 1;
+    }
+    if (simulate && rao) {
+        fprintf(stderr, "mt: --rao needs the drive.\n");
+        return 1;
+    }
+    if ((ranges = read_ranges(list, &n)) == NULL)
+        return 1;
+
+    if (!simulate) {
+        if ((fd = open_tape(FD_RDONLY, 1)) < 0) {
+            perror(tape_name);
+            free_ranges(ranges, n);
+            return 1;
+        }
+        if (density < 0 && tape_ioctl(fd, MTIOCGET, (char *)&status) == 0)
+            density = (status.mt_dsreg & MT_ST_DENSITY_MASK) >> MT_ST_DENSITY_SHIFT;
+        if (start < 0 && tape_ioctl(fd, MTIOCPOS, (char *)&pos) == 0)
+            start = pos.mt_blkno;
+        /* Placed from the catalog, checked when read */
+        place_ranges(fd, ranges, n, 0);
+    }
+    if (start < 0)
+        start = 0;
+    sp.model = find_seek_model(density);
+    for (i = 0; i < n; i++)
+        if (ranges[i].lba + ranges[i].count > maxlba)
+            maxlba = ranges[i].lba + ranges[i].count;
+    if (sp.model->capacity)
+        sp.per_wrap = sp.model->capacity * 1000000000LL / bs / sp.model->wraps;
+    else
+        sp.per_wrap = maxlba > start ? maxlba + 1 : start + 1;
+    if (sp.per_wrap < 1)
+        sp.per_wrap = 1;
+
+    if ((order = malloc(n * sizeof(sched_range *))) == NULL ||
+        (given = malloc(n * sizeof(sched_range *))) == NULL) {
+        perror("mt");
+        free(order);
+        free_ranges(ranges, n);
+        if (fd >= 0)
+            close(fd);
+        return 2;
+    }
+    for (i = 0; i < n; i++)
+        order[i] = given[i] = &ranges[i];
+    fifo = schedule_cost(&sp, given, n, start);
+    planned = schedule(&sp, order, n, start);
+    if (rao) {
+        for (known = 0; known < n && order[known]->lba >= 0; known++)
+            ;
+        if (known > 0 && rao_order(fd, order, known) == 0)
+            planned = schedule_cost(&sp, order, n, start);
+    }
+
+    if (simulate) {
+        printf("  line  position          count  wrap  seek (s)\n");
+        for (i = 0, lba = start; i < n; i++) {
+            double x, t = order[i]->lba >= 0 ? seek_time(&sp, lba, order[i]->lba) : 0.0;
+
+            if (order[i]->lba >= 0) {
+                printf("%6d  %-16lld %6lld  %4d  %8.1f\n", order[i]->lineno, order[i]->lba,
+                       order[i]->count, block_place(&sp, order[i]->lba, &x), t);
+                lba = order[i]->lba + order[i]->count;
+            } else
+                printf("%6d  %d/%-14d %6lld     ?         ?\n", order[i]->lineno,
+                       order[i]->fileno, order[i]->blkno, order[i]->count);
+        }
+    }
+    fprintf(simulate ? stdout : stderr,
+            "%s%d ranges, estimated seek time %.1f s scheduled, %.1f s in the given order.\n",
+            simulate ? "" : "mt: ", n, planned, fifo);
+
+    if (!simulate) {
+        if ((buf = malloc(bs)) == NULL) {
+            perror("mt");
+            result = 2;
+        }
+        for (i = 0; i < n && result == 0; i++)
+            result = read_range(fd, order[i], buf, bs);
+        free(buf);
+        close(fd);
+    }
+    free(order);
+    free(given);
+    free_ranges(ranges, n);
+    return result;
+}
+
+
+/*** Recommended access order ***/
+
+/* Drives that support it (TS1140 and later, LTO-9) compute the order in
+   which to read a set of extents: the extents are sent with GENERATE
+   RECOMMENDED ACCESS ORDER and the order is returned by RECEIVE
+   RECOMMENDED ACCESS ORDER (SSC-5). Each extent is a basic user data
+   segment (UDS) descriptor named by its index in the list. If the drive
+   does not accept the commands, the extents are read in increasing
+   block address order. */
+
+#define RAO_MAXUDS 2000
+#define RAO_UDS_LEN 32
+#define RAO_HEADER 8
+#define RAO_TIMEOUT (10 * 60 * 1000)
+
+static void put_be(unsigned char *p, unsigned long long value, int n)
+{
+    while (n-- > 0) {
+        p[n] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static unsigned long long get_be(const unsigned char *p, int n)
+{
+    unsigned long long value = 0;
+
+    while (n-- > 0)
+        value = (value << 8) | *p++;
+    return value;
+}
+
+/* Ask the drive to order the first n ranges, which all have a block
+   address. Returns 0 if they were reordered, 1 if the order is left
+   unchanged. */
+static int rao_order(int mtfd, sched_range **order, int n)
+{
+    unsigned char cdb[12], *buf, *d;
+    char name[12], why[64];
+    sched_range **drive = NULL;
+    struct mtget status;
+    size_t len = RAO_HEADER + (size_t)n * RAO_UDS_LEN, got, off, dlen;
+    int i, k, part = 0, result;
+
+    if (n > RAO_MAXUDS) {
+        fprintf(stderr, "mt: more than %d ranges, using ascending order.\n", RAO_MAXUDS);
+        return 1;
+    }
+    if (tape_ioctl(mtfd, MTIOCGET, (char *)&status) == 0)
+        part = status.mt_resid & 0xff;
+    if ((buf = calloc(len, 1)) == NULL || (drive = calloc(n, sizeof(sched_range *))) == NULL) {
+        perror("mt");
+        free(buf);
+        return 1;
+    }
+
+    put_be(buf + 4, len - RAO_HEADER, 4);
+    for (i = 0; i < n; i++) {
+        d = buf + RAO_HEADER + i * RAO_UDS_LEN;
+        put_be(d, RAO_UDS_LEN - 2, 2);
+        snprintf(name, sizeof(name), "%010d", i);
+        memcpy(d + 3, name, 10);
+        d[13] = part;
+        put_be(d + 14, order[i]->lba, 8);
+        put_be(d + 22, order[i]->lba + order[i]->count - 1, 8);
+    }
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0xa4; /* MAINTENANCE OUT */
+    cdb[1] = 0x1d; /* GENERATE RECOMMENDED ACCESS ORDER */
+    put_be(cdb + 6, len, 4);
+    result = scsi_cmd(mtfd, cdb, sizeof(cdb), SG_DXFER_TO_DEV, buf, len, &got, RAO_TIMEOUT);
+    if (result == 0) {
+        memset(buf, 0, len);
+        cdb[0] = 0xa3; /* MAINTENANCE IN */
+        result = scsi_cmd(mtfd, cdb, sizeof(cdb), SG_DXFER_FROM_DEV, buf, len, &got,
+                          SCSI_TIMEOUT);
+    }
+    if (result < 0)
+        snprintf(why, sizeof(why), "%s", strerror(errno));
+    else if (result > 0)
+        scsi_sense_string(why, sizeof(why));
+    else {
+        /* The descriptors, in the recommended order */
+        if (got > RAO_HEADER + get_be(buf + 4, 4))
+            got = RAO_HEADER + get_be(buf + 4, 4);
+        for (k = 0, off = RAO_HEADER; off + 14 <= got && k < n; off += dlen) {
+            dlen = get_be(buf + off, 2) + 2;
+            memcpy(name, buf + off + 3, 10);
+            name[10] = '\0';
+            if (dlen < 14 || off + dlen > got || sscanf(name, "%d", &i) != 1 || i < 0 ||
+                i >= n || order[i] == NULL)
+                break;
+            drive[k++] = order[i];
+            order[i] = NULL;
+        }
+        if (k == n) {
+            memcpy(order, drive, n * sizeof(sched_range *));
+            free(drive);
+            free(buf);
+            return 0;
+        }
+        /* Put back the ones taken */
+        for (i = 0; i < k; i++)
+            for (off = 0; off < (size_t)n; off++)
+                if (order[off] == NULL) {
+                    order[off] = drive[i];
+                    break;
+                }
+        qsort(order, n, sizeof(sched_range *), cmp_ranges);
+        snprintf(why, sizeof(why), "incomplete order returned");
+    }
+    fprintf(stderr, "mt: recommended access order not available (%s), using ascending order.\n",
+            why);
+    free(drive);
+    free(buf);
+    return 1;
+}
+
+/* rao list: print the ranges in the order recommended by the drive */
+static int do_rao(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc, char **argv)
+{
+    sched_range *ranges, **order;
+    int i, n, known;
+
+    if (argc != 1) {
+        fprintf(stderr, "mt: the rao command needs a file name.\n");
+        return 1;
+    }
+    if ((ranges = read_ranges(argv[0], &n)) == NULL)
+        return 1;
+    if ((order = malloc(n * sizeof(sched_range *))) == NULL) {
+        perror("mt");
+        free_ranges(ranges, n);
+        return 2;
+    }
+    /* The block addresses are given to the drive and printed, so the
+       catalog entries are checked first */
+    place_ranges(mtfd, ranges, n, 1);
+    for (i = 0; i < n; i++)
+        order[i] = &ranges[i];
+    qsort(order, n, sizeof(sched_range *), cmp_ranges);
+    for (known = 0; known < n && order[known]->lba >= 0; known++)
+        ;
+    if (known > 0)
+        rao_order(mtfd, order, known);
+
+    for (i = 0; i < n; i++) {
+        if (order[i]->lba >= 0)
+            printf("%lld %lld", order[i]->lba, order[i]->count);
+        else
+            printf("%d/%d %lld", order[i]->fileno, order[i]->blkno, order[i]->count);
+        printf(order[i]->out != NULL ? " %s\n" : "\n", order[i]->out);
+    }
+    free(order);
+    free_ranges(ranges, n);
+    return 0;
+}
+
+
+/*** Log pages ***/
+
+/* The drive keeps counters that the st driver does not show: the error
+   counters, the bytes transferred and written to the medium, the
+   compression ratios and the TapeAlert flags. They are read with LOG
+   SENSE (cumulative values) and decoded for the standard pages of SSC;
+   the other parameters are printed by their codes. */
+
+#define LOG_MAXLEN 0xfffc
+#define LOG_HEADER 4
+#define LOG_SUPPORTED 0x00
+#define LOG_TAPEALERT 0x2e
+#define LOG_COMPRESSION 0x1b
+
+#define LP_COUNT 0 /* the value is a count */
+#define LP_RATIO 1 /* the value is a ratio times 100 */
+#define LP_FLAG 2  /* the value is a yes/no flag */
+
+static struct log_param {
+    int code;
+    int kind;
+    char *key;
+    char *label;
+} error_params[] = {
+    /* clang-format off */
+    { 0x0000, LP_COUNT, "corrected_without_delay", "Errors corrected without substantial delay" },
+    { 0x0001, LP_COUNT, "corrected_with_delay",    "Errors corrected with possible delays"      },
+    { 0x0002, LP_COUNT, "retries",                 "Total rewrites or rereads"                  },
+    { 0x0003, LP_COUNT, "corrected",               "Total errors corrected"                     },
+    { 0x0004, LP_COUNT, "correction_runs",         "Times the correction algorithm was run"     },
+    { 0x0005, LP_COUNT, "bytes",                   "Total bytes processed"                      },
+    { 0x0006, LP_COUNT, "uncorrected",             "Total uncorrected errors"                   },
+    { -1,     0,        NULL,                      NULL                                         }
+    /* clang-format on */
+}, seq_params[] = {
+    /* clang-format off */
+    { 0x0000, LP_COUNT, "bytes_from_host",    "Bytes received with WRITE commands"                },
+    { 0x0001, LP_COUNT, "bytes_to_medium",    "Bytes written to the medium"                       },
+    { 0x0002, LP_COUNT, "bytes_from_medium",  "Bytes read from the medium"                        },
+    { 0x0003, LP_COUNT, "bytes_to_host",      "Bytes sent with READ commands"                     },
+    { 0x0004, LP_COUNT, "capacity_to_eod_mb", "Native capacity from BOP to EOD (MB)"              },
+    { 0x0005, LP_COUNT, "capacity_to_ew_mb",  "Native capacity from BOP to early warning (MB)"    },
+    { 0x0006, LP_COUNT, "capacity_ew_eop_mb", "Native capacity from early warning to EOP (MB)"    },
+    { 0x0007, LP_COUNT, "position_mb",        "Native capacity from BOP to the position (MB)"     },
+    { 0x0008, LP_COUNT, "buffer_mb",          "Maximum native capacity in the buffer (MB)"        },
+    { 0x0100, LP_FLAG,  "cleaning_required",  "Cleaning required"                                 },
+    { -1,     0,        NULL,                 NULL                                                }
+    /* clang-format on */
+}, compression_params[] = {
+    /* clang-format off */
+    { 0x0000, LP_RATIO, "read_ratio",          "Read compression ratio"           },
+    { 0x0001, LP_RATIO, "write_ratio",         "Write compression ratio"          },
+    { 0x0002, LP_COUNT, "mb_to_host",          "Megabytes transferred to host"    },
+    { 0x0003, LP_COUNT, "bytes_to_host",       "Bytes transferred to host"        },
+    { 0x0004, LP_COUNT, "mb_from_medium",      "Megabytes read from the medium"   },
+    { 0x0005, LP_COUNT, "bytes_from_medium",   "Bytes read from the medium"       },
+    { 0x0006, LP_COUNT, "mb_from_host",        "Megabytes transferred from host"  },
+    { 0x0007, LP_COUNT, "bytes_from_host",     "Bytes transferred from host"      },
+    { 0x0008, LP_COUNT, "mb_to_medium",        "Megabytes written to the medium"  },
+    { 0x0009, LP_COUNT, "bytes_to_medium",     "Bytes written to the medium"      },
+    { 0x0100, LP_FLAG,  "compression_enabled", "Data compression enabled"         },
+    { -1,     0,        NULL,                  NULL                               }
+    /* clang-format on */
+};
+
+static struct log_page {
+    int code;
+    char *name; /* for the command line and JSON */
+    char *title;
+    struct log_param *params;
+} log_pages[] = {
+    /* clang-format off */
+    { 0x02,            "write",       "Write error counters",   error_params       },
+    { 0x03,            "read",        "Read error counters",    error_params       },
+    { 0x0c,            "sequential",  "Sequential access",      seq_params         },
+    { LOG_COMPRESSION, "compression", "Data compression",       compression_params },
+    { LOG_TAPEALERT,   "tapealert",   "TapeAlert",              NULL               },
+    { -1,              NULL,          NULL,                     NULL               }
+    /* clang-format on */
+};
+
+/* The TapeAlert flags of SSC-3, by their parameter codes */
+static char *tapealert_names[] = {
+    NULL,
+    "Read warning",
+    "Write warning",
+    "Hard error",
+    "Media",
+    "Read failure",
+    "Write failure",
+    "Media life",
+    "Not data grade",
+    "Write protect",
+    "No removal",
+    "Cleaning media",
+    "Unsupported format",
+    "Recoverable mechanical cartridge failure",
+    "Unrecoverable mechanical cartridge failure",
+    "Memory chip in cartridge failure",
+    "Forced eject",
+    "Read only format",
+    "Tape directory corrupted on load",
+    "Nearing media life",
+    "Clean now",
+    "Clean periodic",
+    "Expired cleaning media",
+    "Invalid cleaning tape",
+    "Retension requested",
+    "Dual-port interface error",
+    "Cooling fan failure",
+    "Power supply failure",
+    "Power consumption",
+    "Drive maintenance",
+    "Hardware A",
+    "Hardware B",
+    "Interface",
+    "Eject media",
+    "Microcode update fail",
+    "Drive humidity",
+    "Drive temperature",
+    "Drive voltage",
+    "Predictive failure",
+    "Diagnostics required",
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    "Lost statistics",
+    "Tape directory invalid at unload",
+    "Tape system area write failure",
+    "Tape system area read failure",
+    "No start of data",
+    "Loading failure",
+    "Unrecoverable unload failure",
+    "Automation interface failure",
+    "Firmware failure",
+    "WORM medium - integrity check failed",
+    "WORM medium - overwrite attempted",
+};
+
+#define NBR_TAPEALERTS (sizeof(tapealert_names) / sizeof(char *))
+
+/* Read the cumulative values of a log page. Returns the length of the
+   page, or -1 after printing an error message. */
+static int log_sense(int mtfd, int page, unsigned char *buf)
+{
+    unsigned char cdb[10];
+    char why[64];
+    size_t got;
+    int result, len;
+
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0x4d;        /* LOG SENSE */
+    cdb[2] = 0x40 | page; /* cumulative values */
+    put_be(cdb + 7, LOG_MAXLEN, 2);
+    result = scsi_cmd(mtfd, cdb, sizeof(cdb), SG_DXFER_FROM_DEV, buf, LOG_MAXLEN, &got,
+                      SCSI_TIMEOUT);
+    if (result == 0 && (got < LOG_HEADER || (buf[0] & 0x3f) != page)) {
+        snprintf(why, sizeof(why), "bad page header");
+        result = 2;
+    } else if (result < 0)
+        snprintf(why, sizeof(why), "%s", strerror(errno));
+    else if (result > 0)
+        scsi_sense_string(why, sizeof(why));
+    if (result != 0) {
+        fprintf(stderr, "mt: LOG SENSE of page %02xh failed (%s).\n", page, why);
+        return (-1);
+    }
+    len = LOG_HEADER + get_be(buf + 2, 2);
+    return len < (int)got ? len : (int)got;
+}
+
+static void log_print_value(struct log_param *lp, unsigned long long value)
+{
+    if (lp != NULL && lp->kind == LP_RATIO)
+        printf("%llu.%02llu", value / 100, value % 100);
+    else if (lp != NULL && lp->kind == LP_FLAG && output_json)
+        printf("%s", value ? "true" : "false");
+    else if (lp != NULL && lp->kind == LP_FLAG)
+        printf("%s", value ? "yes" : "no");
+    else
+        printf("%llu", value);
+}
+
+/* Decode a page, or print its parameters by their codes if it is not
+   known */
+static void log_print_page(struct log_page *page, int code, unsigned char *buf, int len)
+{
+    int off, pcode, plen, n = 0, alerts = page != NULL && page->code == LOG_TAPEALERT;
+    unsigned long long value;
+    struct log_param *lp;
+
+    if (output_json && page != NULL)
+        printf("\"%s\":%s", page->name, alerts ? "[" : "{");
+    else if (output_json)
+        printf("\"page_%02x\":{", code);
+    else if (page != NULL)
+        printf("%s (page %02xh):\n", page->title, code);
+    else
+        printf("Page %02xh:\n", code);
+    for (off = LOG_HEADER; off + 4 <= len; off += 4 + plen) {
+        pcode = get_be(buf + off, 2);
+        plen = buf[off + 3];
+        if (off + 4 + plen > len)
+            break;
+        value = get_be(buf + off + 4, plen > 8 ? 8 : plen);
+        if (alerts) {
+            if (!value)
+                continue;
+            if (output_json) {
+                printf("%s{\"flag\":%d,\"name\":", n++ ? "," : "", pcode);
+                json_string((size_t)pcode < NBR_TAPEALERTS && tapealert_names[pcode] != NULL
+                                ? tapealert_names[pcode]
+                                : "");
+                printf("}");
+            } else {
+                n++;
+                if ((size_t)pcode < NBR_TAPEALERTS && tapealert_names[pcode] != NULL)
+                    printf("  %02xh %s\n", pcode, tapealert_names[pcode]);
+                else
+                    printf("  %02xh\n", pcode);
+            }
+            continue;
+        }
+        for (lp = page != NULL ? page->params : NULL; lp != NULL && lp->key != NULL; lp++)
+            if (lp->code == pcode)
+                break;
+        if (lp != NULL && lp->key == NULL)
+            lp = NULL;
+        if (output_json) {
+            if (lp != NULL)
+                printf("%s\"%s\":", n++ ? "," : "", lp->key);
+            else
+                printf("%s\"%04x\":", n++ ? "," : "", pcode);
+        } else if (lp != NULL)
+            printf("  %s: ", lp->label);
+        else
+            printf("  Parameter %04xh: ", pcode);
+        log_print_value(lp, value);
+        if (!output_json)
+            printf("\n");
+    }
+    if (output_json)
+        printf("%s", alerts ? "]" : "}");
+    else if (alerts && n == 0)
+        printf("  No flags set\n");
+}
+
+/* Print a log page given by its name or number, or all the known pages
+   the drive supports */
+static int do_logsense(int mtfd, cmdef_tr *cmd __attribute__((unused)), int argc, char **argv)
+{
+    int i, j, len, code = -1, n = 0, result = 0;
+    unsigned char *buf, *supported;
+    char *end;
+    struct log_page *page = NULL;
+
+    if (argc > 0) {
+        for (page = log_pages; page->name != NULL; page++)
+            if (!strcmp(argv[0], page->name))
+                break;
+        if (page->name != NULL)
+            code = page->code;
+        else {
+            page = NULL;
+            code = strtol(argv[0], &end, 16);
+            if (*argv[0] == '\0' || *end != '\0' || code < 0 || code > 0x3f) {
+                fprintf(stderr, "mt: unknown log page '%s'.\n", argv[0]);
+                return 1;
+            }
+            for (i = 0; log_pages[i].name != NULL; i++)
+                if (log_pages[i].code == code)
+                    page = &log_pages[i];
+        }
+    }
+    if ((buf = malloc(2 * LOG_MAXLEN)) == NULL) {
+        perror("mt");
+        return 2;
+    }
+    supported = buf + LOG_MAXLEN;
+
+    if (output_json) {
+        printf("{\"device\":");
+        json_string(tape_name);
+    }
+    if (code >= 0) {
+        if ((len = log_sense(mtfd, code, buf)) < 0)
+            result = 2;
+        else {
+            if (output_json)
+                printf(",");
+            log_print_page(page, code, buf, len);
+        }
+    } else if ((len = log_sense(mtfd, LOG_SUPPORTED, supported)) < 0)
+        result = 2;
+    else {
+        /* The known pages, in the order of the table */
+        for (i = 0; log_pages[i].name != NULL; i++) {
+            for (j = LOG_HEADER; j < len && supported[j] != log_pages[i].code; j++)
+                ;
+            if (j == len)
+                continue;
+            if ((j = log_sense(mtfd, log_pages[i].code, buf)) < 0) {
+                result = 2;
+                continue;
+            }
+            if (output_json)
+                printf(",");
+            else if (n > 0)
+                printf("\n");
+            n++;
+            log_print_page(&log_pages[i], log_pages[i].code, buf, j);
+        }
+        if (n == 0 && result == 0 && !output_json)
+            printf("The drive supports none of the decoded log pages.\n");
+    }
+    if (output_json)
+        printf("}\n");
+    free(buf);
+    return result;
+}
+
+
+/*** io_uring data path ***/
+
+/* With io_uring, up to qdepth writes are submitted to the kernel at a
+   time. The slots of the ring buffer are registered as fixed buffers if
+   possible. Writes to a tape drive are linked so that they are done in
+   order, and each new chain is drained behind the previous one: the
+   drive sees one write at a time, and qdepth only batches the
+   submissions. Tape images have a known offset for each record, so up
+   to qdepth of their writes run at once. */
+
+#ifdef HAVE_IO_URING
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned sq_entries, sq_local;
+    int fixed;
+};
+
+static int uring_init(uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(uring));
+    if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return (-1);
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        u->cq_len = 0;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (u->cq_len) {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED)
+            goto fail;
+    } else
+        u->cq_ptr = u->sq_ptr;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = u->sq_ptr;
+    cq = u->cq_ptr;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_entries = p.sq_entries;
+    u->sq_local = *u->sq_tail;
+    return 0;
+
+fail:
+    if (u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_len);
+    if (u->cq_len && u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED)
+        munmap(u->cq_ptr, u->cq_len);
+    close(u->fd);
+    return (-1);
+}
+
+static void uring_exit(uring *u)
+{
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq_len)
+        munmap(u->cq_ptr, u->cq_len);
+    munmap(u->sq_ptr, u->sq_len);
+    close(u->fd);
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring *u)
+{
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+        return NULL;
+    idx = u->sq_local & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local++;
+    return sqe;
+}
+
+/* Submit the queued requests and wait for at least wait_nr completions */
+static int uring_enter(uring *u, unsigned wait_nr)
+{
+    unsigned to_submit = u->sq_local - *u->sq_tail;
+    int n;
+
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+    do
+        n = syscall(__NR_io_uring_enter, u->fd, to_submit, wait_nr,
+                    wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (n < 0 && errno == EINTR);
+    return n < 0 ? (-1) : 0;
+}
+
+static int uring_setup(stream_ring *r, int qdepth)
+{
+    int i;
+    uring *u;
+    struct iovec *iov;
+
+    if ((u = malloc(sizeof(uring))) == NULL)
+        return (-1);
+    if ((r->parts = calloc(r->nslots, sizeof(int))) == NULL ||
+        (r->imghdr = calloc(r->nslots, sizeof(*r->imghdr))) == NULL ||
+        uring_init(u, qdepth * 3) < 0) {
+        if (errno != ENOMEM)
+            fprintf(stderr, "mt: io_uring not available (%s), using write().\n", strerror(errno));
+        free(r->parts);
+        free(r->imghdr);
+        r->parts = NULL;
+        r->imghdr = NULL;
+        free(u);
+        return (-1);
+    }
+    if ((iov = calloc(r->nslots, sizeof(struct iovec))) != NULL) {
+        for (i = 0; i < r->nslots; i++) {
+            iov[i].iov_base = r->mem + i * r->blksize;
+            iov[i].iov_len = r->blksize;
+        }
+        u->fixed = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov,
+                           r->nslots) == 0;
+        free(iov);
+    }
+    r->uring = u;
+    r->qdepth = qdepth;
+    return 0;
+}
+
+static void uring_teardown(stream_ring *r)
+{
+    if (r->uring == NULL)
+        return;
+    uring_exit(r->uring);
+    free(r->uring);
+    free(r->parts);
+    free(r->imghdr);
+    r->uring = NULL;
+}
+
+static void prep_write(uring *u, struct io_uring_sqe *sqe, int fd, void *addr,
+                       size_t len, off_t off, int slot, int fixed)
+{
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = fixed ? slot : 0;
+    /* The length is kept to check the completion */
+    sqe->user_data = (unsigned long long)len << 32 | slot;
+    (void)u;
+}
+
+/* Queue the requests writing one slot. A record of a tape image is
+   written as the length, the data and the padding plus length. */
+static struct io_uring_sqe *queue_slot(stream_ring *r, int slot, off_t *off, int image)
+{
+    uring *u = r->uring;
+    size_t len = r->len[slot];
+    unsigned char *hdr = r->imghdr[slot];
+    struct io_uring_sqe *sqe;
+
+    if (!image) {
+        sqe = uring_get_sqe(u);
+        prep_write(u, sqe, r->tapefd, r->mem + slot * r->blksize, len, (off_t)-1, slot, u->fixed);
+        r->parts[slot] = 1;
+        return sqe;
+    }
+    hdr[0] = hdr[5] = len & 0xff;
+    hdr[1] = hdr[6] = (len >> 8) & 0xff;
+    hdr[2] = hdr[7] = (len >> 16) & 0xff;
+    hdr[3] = hdr[8] = 0;
+    hdr[4] = 0;
+    prep_write(u, uring_get_sqe(u), r->tapefd, hdr, 4, *off, slot, 0);
+    prep_write(u, uring_get_sqe(u), r->tapefd, r->mem + slot * r->blksize, len, *off + 4,
+               slot, u->fixed);
+    sqe = uring_get_sqe(u);
+    if (len & 1)
+        prep_write(u, sqe, r->tapefd, hdr + 4, 5, *off + 4 + len, slot, 0);
+    else
+        prep_write(u, sqe, r->tapefd, hdr + 5, 4, *off + 4 + len, slot, 0);
+    r->parts[slot] = 3;
+    *off += IMG_RECSIZE(len);
+    return sqe;
+}
+
+static void *stream_consumer_uring(void *arg)
+{
+    int slot, inflight = 0, more = 1, failed = 0, image, queued;
+    unsigned head;
+    off_t off = 0;
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe, *last;
+    stream_ring *r = arg;
+    uring *u = r->uring;
+
+    if ((image = is_tape_image(r->tapefd)) && (off = lseek(r->tapefd, 0, SEEK_CUR)) < 0) {
+        perror(tape_name);
+        ring_finish(r, 1);
+        return NULL;
+    }
+
+    while (more || inflight > 0) {
+        for (queued = 0, last = NULL; more && !failed && inflight < r->qdepth; queued++) {
+            if ((slot = ring_get_full(r, inflight, inflight == 0)) == -2)
+                break;
+            if (slot < 0) {
+                more = 0;
+                break;
+            }
+            if (image && r->len[slot] > IMG_LEN_MASK) {
+                fprintf(stderr, "mt: block too large for a tape image.\n");
+                failed = 1;
+                break;
+            }
+            sqe = queue_slot(r, slot, &off, image);
+            if (!image) {
+                /* Keep the order: link this chain and wait for the earlier ones */
+                sqe->flags |= IOSQE_IO_LINK;
+                if (queued == 0 && inflight > 0)
+                    sqe->flags |= IOSQE_IO_DRAIN;
+                last = sqe;
+            }
+            inflight++;
+        }
+        if (last != NULL)
+            last->flags &= ~IOSQE_IO_LINK;
+        if (failed)
+            more = 0;
+        if (inflight == 0)
+            break;
+
+        if (uring_enter(u, 1) < 0) {
+            perror("mt: io_uring_enter");
+            failed = 1;
+            more = 0;
+            continue;
+        }
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &u->cqes[head & *u->cq_mask];
+            slot = cqe->user_data & 0xffffffff;
+            if (cqe->res < 0) {
+                if (!failed) {
+                    errno = -cqe->res;
+                    perror(tape_name);
+                }
+                failed = 1;
+                more = 0;
+            } else if ((unsigned long long)cqe->res != cqe->user_data >> 32 && !failed) {
+                fprintf(stderr, "mt: short write to the tape (%d of %llu bytes).\n",
+                        cqe->res, (unsigned long long)(cqe->user_data >> 32));
+                failed = 1;
+                more = 0;
+            }
+            r->parts[slot]--;
+            head++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+        /* Give back the finished slots in order */
+        while (inflight > 0 && r->parts[r->tail] == 0) {
+            if (!failed) {
+                r->bytes += r->len[r->tail];
+                r->blocks++;
+            }
+            ring_release(r);
+            inflight--;
+        }
+    }
+
+    if (image && !failed && (ftruncate(r->tapefd, off) < 0 || lseek(r->tapefd, off, SEEK_SET) < 0)) {
+        perror(tape_name);
+        failed = 1;
+    }
+    if (failed)
+        ring_finish(r, 1);
+    return NULL;
+}
+
+#else /* HAVE_IO_URING */
+
+struct uring {
+    int unused;
+};
+
+static int uring_setup(stream_ring *r __attribute__((unused)), int qdepth __attribute__((unused)))
+{
+    return (-1);
+}
+
+static void uring_teardown(stream_ring *r __attribute__((unused)))
+{
+}
+
+static void *stream_consumer_uring(void *arg)
+{
+    return stream_consumer(arg);
+}
+
+#endif /* HAVE_IO_URING */
+
+
+/*** The tape control daemon (mtd) and its client ***/
+
+/* The daemon keeps the tape devices open and runs the commands sent by
+   "mt --daemon" over a Unix socket. The commands for one drive are run
+   one at a time in a child process, whose output is sent back to the
+   client. The status and tell commands are answered from the state read
+   after the previous command, so they don't have to wait for (or
+   disturb) a long running command. The requests are read as they come,
+   so that a slow client does not hold up the others.
+
+   The daemon usually runs as root, so the socket is open only to its
+   user and group (mode 0660), the peer of each connection is checked,
+   and only the commands that act on a drive of the daemon are run: none
+   that take file names, use the daemon's standard input and output or
+   write files. */
+
+#define MTD_MAXREQ 4096
+
+typedef struct mtd_request {
+    int client;
+    char *buf;
+    int len; /* the bytes read so far */
+    char **words;
+    int nwords;
+    int json;    /* the client wants JSON output */
+    int allowed; /* the client may use the daemon */
+    cmdef_tr *comp;
+    struct mtd_request *next;
+} mtd_request;
+
+typedef struct {
+    char *name;
+    int fd;
+    struct stat stat;
+    pid_t busy;
+    struct mtget status;
+    int status_errno;
+    struct mtpos pos;
+    int pos_errno;
+    mtd_request *queue, *queue_tail;
+} mtd_drive;
+
+static mtd_drive *mtd_drives;
+static int mtd_nbr_drives;
+static mtd_request *mtd_pending; /* the requests still being read */
+static int mtd_lsock = -1, mtd_sfd = -1;
+
+static const cmdfunc mtd_commands[] = {
+    do_standard, do_space,   do_tell,         do_status,  do_drvbuffer,
+    do_options,  do_partseek, do_show_options, do_catalog, do_logsense,
+};
+
+static void mtd_usage(int exitcode) __attribute__((noreturn));
+static void mtd_usage(int exitcode)
+{
+    fprintf(stderr, "usage: mtd [-v] [-s socket] device ...\n");
+    fprintf(stderr, "default socket: %s\n", MTD_SOCKET);
+    exit(exitcode);
+}
+
+static const char *mtd_socket_name(void)
+{
+    char *cp;
+
+    if ((cp = getenv("MTD_SOCKET")) != NULL && *cp != '\0')
+        return cp;
+    return MTD_SOCKET;
+}
+
+static int same_file(struct stat *a, struct stat *b)
+{
+    if (S_ISCHR(a->st_mode) && S_ISCHR(b->st_mode))
+        return a->st_rdev == b->st_rdev;
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+static int mtd_allowed(cmdef_tr *comp)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(mtd_commands) / sizeof(cmdfunc); i++)
+        if (comp->cmd_function == mtd_commands[i])
+            return comp->cmd_fdtype != NO_FD;
+    return 0;
+}
+
+/* In a child, close the descriptors that belong to the daemon and to the
+   other clients */
+static void mtd_close_others(mtd_request *req)
+{
+    mtd_request *r;
+    int i;
+
+    close(mtd_lsock);
+    close(mtd_sfd);
+    for (r = mtd_pending; r != NULL; r = r->next)
+        close(r->client);
+    for (i = 0; i < mtd_nbr_drives; i++)
+        for (r = mtd_drives[i].queue; r != NULL; r = r->next)
+            if (r != req)
+                close(r->client);
+}
+
+static void mtd_refresh(mtd_drive *drv)
+{
+    drv->status_errno = drv->pos_errno = 0;
+    if (tape_ioctl(drv->fd, MTIOCGET, &drv->status) < 0)
+        drv->status_errno = errno;
+    if (tape_ioctl(drv->fd, MTIOCPOS, &drv->pos) < 0)
+        drv->pos_errno = errno;
+}
+
+/* Send the contents of a temporary file as one frame of the reply */
+static void mtd_send_frame(int sock, char type, FILE *f)
+{
+    char buf[4096];
+    size_t n;
+    long len;
+
+    fflush(f);
+    len = ftell(f);
+    n = snprintf(buf, sizeof(buf), "%c %ld\n", type, len);
+    if (write(sock, buf, n) != (ssize_t)n)
+        return;
+    rewind(f);
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        if (write(sock, buf, n) != (ssize_t)n)
+            return;
+}
+
+/* Run a request in a child process. The child's stdout and stderr are
+   collected and sent back to the client, followed by the exit status. */
+static pid_t mtd_start(mtd_drive *drv, mtd_request *req, int cached)
+{
+    int result, err;
+    pid_t pid;
+    FILE *out, *errf;
+    char buf[32];
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) != 0) {
+        if (pid < 0)
+            perror("mtd: fork");
+        return pid;
+    }
+
+    mtd_close_others(req);
+    if ((out = tmpfile()) == NULL || (errf = tmpfile()) == NULL ||
+        dup2(fileno(out), 1) < 0 || dup2(fileno(errf), 2) < 0)
+        _exit(1);
+    tape_name = drv->name;
+    output_json = req->json;
+    if (cached) {
+        err = req->comp->cmd_function == do_status ? drv->status_errno : drv->pos_errno;
+        if (err) {
+            fprintf(stderr, "%s: %s\n", tape_name, strerror(err));
+            result = 2;
+        } else {
+            if (req->comp->cmd_function == do_status)
+                print_status(&drv->status);
+            else
+                print_tell(&drv->pos);
+            result = 0;
+        }
+    } else
+        result = run_command(drv->fd, req->comp, req->nwords - 2,
+                             req->nwords > 2 ? req->words + 2 : NULL);
+    scsi_print_stats();
+    fflush(stdout);
+    fflush(stderr);
+    mtd_send_frame(req->client, 'O', out);
+    mtd_send_frame(req->client, 'E', errf);
+    snprintf(buf, sizeof(buf), "X %d\n", result);
+    if (write(req->client, buf, strlen(buf)) < 0)
+        _exit(1);
+    _exit(result);
+}
+
+static void mtd_free_request(mtd_request *req)
+{
+    close(req->client);
+    free(req->words);
+    free(req->buf);
+    free(req);
+}
+
+static void mtd_reject(mtd_request *req, const char *fmt, const char *arg)
+{
+    char msg[MTD_MAXREQ + 128], buf[MTD_MAXREQ + 160];
+    int n;
+
+    snprintf(msg, sizeof(msg), fmt, arg);
+    n = snprintf(buf, sizeof(buf), "O 0\nE %zu\n%sX 1\n", strlen(msg), msg);
+    if (write(req->client, buf, n) < 0)
+        perror("mtd: write");
+    mtd_free_request(req);
+}
+
+static void mtd_next(mtd_drive *drv)
+{
+    mtd_request *req;
+
+    if (drv->busy || (req = drv->queue) == NULL)
+        return;
+    if ((drv->queue = req->next) == NULL)
+        drv->queue_tail = NULL;
+    if ((drv->busy = mtd_start(drv, req, 0)) < 0) {
+        drv->busy = 0;
+        mtd_reject(req, "mtd: can't start the command %s.\n", req->comp->cmd_name);
+        return;
+    }
+    mtd_free_request(req);
+}
+
+/* Accept a client, whose request is read when it arrives. Only root and
+   the user and group of the daemon are served; the others are told when
+   their request has been read. */
+static void mtd_accept(int lsock)
+{
+    mtd_request *req;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if ((req = calloc(1, sizeof(mtd_request))) == NULL)
+        return;
+    if ((req->client = accept4(lsock, NULL, NULL, SOCK_NONBLOCK)) < 0) {
+        free(req);
+        return;
+    }
+    if ((req->buf = malloc(MTD_MAXREQ + 1)) == NULL) {
+        mtd_free_request(req);
+        return;
+    }
+    req->allowed = getsockopt(req->client, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+                   (cred.uid == 0 || cred.uid == geteuid() || cred.gid == getegid());
+    req->next = mtd_pending;
+    mtd_pending = req;
+}
+
+/* Read what the client has sent. Returns 1 if the request is not complete
+   yet, 0 if it is and -1 if the client went away or sent too much. */
+static int mtd_read(mtd_request *req)
+{
+    int n;
+    char *nl;
+
+    while ((nl = memchr(req->buf, '\n', req->len)) == NULL) {
+        if (req->len >= MTD_MAXREQ)
+            return (-1);
+        if ((n = read(req->client, req->buf + req->len, MTD_MAXREQ - req->len)) < 0)
+            return errno == EAGAIN || errno == EINTR ? 1 : (-1);
+        if (n == 0)
+            return (-1);
+        req->len += n;
+    }
+    req->len = nl - req->buf + 1;
+    return 0;
+}
+
+/* Dispatch a request: the device name and the command words, separated
+   by tabs and terminated by a newline. A first word --json asks for JSON
+   output. */
+static void mtd_dispatch(mtd_request *req)
+{
+    int i, len = req->len, ambiguous;
+    char *cp;
+    struct stat stbuf;
+    mtd_drive *drv = NULL;
+    pid_t pid;
+
+    /* The reply is written with blocking writes */
+    fcntl(req->client, F_SETFL, fcntl(req->client, F_GETFL) & ~O_NONBLOCK);
+    if (!req->allowed) {
+        mtd_reject(req, "mtd: permission denied%s.\n", "");
+        return;
+    }
+    req->buf[len - 1] = '\0';
+    if ((req->words = malloc((len / 2 + 2) * sizeof(char *))) == NULL) {
+        mtd_free_request(req);
+        return;
+    }
+    for (cp = strtok(req->buf, "\t"); cp != NULL; cp = strtok(NULL, "\t"))
+        req->words[req->nwords++] = cp;
+    if (req->nwords > 0 && !strcmp(req->words[0], "--json")) {
+        req->json = 1;
+        memmove(req->words, req->words + 1, --req->nwords * sizeof(char *));
+    }
+    if (req->nwords < 2) {
+        mtd_reject(req, "mtd: malformed request%s.\n", "");
+        return;
+    }
+
+    if ((req->comp = find_command(req->words[1], &ambiguous)) == NULL) {
+        mtd_reject(req, ambiguous ? "mt: ambiguous command \"%s\"\n"
+                                  : "mt: unknown command \"%s\"\n",
+                   req->words[1]);
+        return;
+    }
+    if (!mtd_allowed(req->comp)) {
+        mtd_reject(req, "mtd: the command %s is not run by the daemon.\n",
+                   req->comp->cmd_name);
+        return;
+    }
+    if (req->comp->arg_cnt != MANY_ARGS && req->comp->arg_cnt < req->nwords - 2) {
+        mtd_reject(req, "mt: too many arguments for the command '%s'.\n",
+                   req->comp->cmd_name);
+        return;
+    }
+    if (stat(req->words[0], &stbuf) == 0)
+        for (i = 0; i < mtd_nbr_drives; i++)
+            if (same_file(&stbuf, &mtd_drives[i].stat)) {
+                drv = &mtd_drives[i];
+                break;
+            }
+    if (drv == NULL) {
+        mtd_reject(req, "mtd: the device '%s' is not handled by this daemon.\n",
+                   req->words[0]);
+        return;
+    }
+
+    if (req->comp->cmd_function == do_status || req->comp->cmd_function == do_tell) {
+        if ((pid = mtd_start(drv, req, 1)) < 0)
+            mtd_reject(req, "mtd: can't start the command %s.\n", req->comp->cmd_name);
+        else
+            mtd_free_request(req);
+        return;
+    }
+    if (drv->queue_tail != NULL)
+        drv->queue_tail->next = req;
+    else
+        drv->queue = req;
+    drv->queue_tail = req;
+    mtd_next(drv);
+}
+
+static void mtd_reap(void)
+{
+    int i, status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (i = 0; i < mtd_nbr_drives; i++)
+            if (mtd_drives[i].busy == pid) {
+                mtd_drives[i].busy = 0;
+                mtd_refresh(&mtd_drives[i]);
+                mtd_next(&mtd_drives[i]);
+                break;
+            }
+}
+
+static int mtd_main(int argc, char **argv)
+{
+    int i, n, argn, lsock, sfd, maxpfd = 0;
+    mode_t mask_old;
+    const char *sockname = mtd_socket_name();
+    struct sockaddr_un addr;
+    struct pollfd *pfd = NULL, *p;
+    struct signalfd_siginfo si;
+    sigset_t mask;
+    mtd_drive *drv;
+    mtd_request *req, **link;
+
+    for (argn = 1; argn < argc && *argv[argn] == '-'; argn++) {
+        if (*(argv[argn] + 1) == 's') {
+            if (++argn >= argc)
+                mtd_usage(1);
+            sockname = argv[argn];
+        } else if (*(argv[argn] + 1) == 'h')
+            mtd_usage(0);
+        else if (*(argv[argn] + 1) == 'v' ||
+                 (*(argv[argn] + 1) == '-' && *(argv[argn] + 2) == 'v')) {
+            printf("mtd (mt-st) v. %s\n", VERSION);
+            exit(0);
+        } else
+            mtd_usage(1);
+    }
+    if (argn >= argc)
+        mtd_usage(1);
+
+    mtd_nbr_drives = argc - argn;
+    if ((mtd_drives = calloc(mtd_nbr_drives, sizeof(mtd_drive))) == NULL) {
+        fprintf(stderr, "mtd: can't allocate the drive table.\n");
+        return 1;
+    }
+    for (i = 0; i < mtd_nbr_drives; i++) {
+        drv = &mtd_drives[i];
+        drv->name = argv[argn + i];
+        if ((drv->fd = open(drv->name, O_RDWR | O_NONBLOCK)) < 0 &&
+            (drv->fd = open(drv->name, O_RDONLY | O_NONBLOCK)) < 0) {
+            perror(drv->name);
+            return 1;
+        }
+        if (fstat(drv->fd, &drv->stat) < 0) {
+            perror(drv->name);
+            return 1;
+        }
+        mtd_refresh(drv);
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 || (sfd = signalfd(-1, &mask, 0)) < 0) {
+        perror("mtd: signalfd");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mtd: socket name '%s' too long.\n", sockname);
+        return 1;
+    }
+    strcpy(addr.sun_path, sockname);
+    unlink(sockname);
+    mask_old = umask(0117);
+    if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lsock, 16) < 0) {
+        perror(sockname);
+        return 1;
+    }
+    umask(mask_old);
+    mtd_lsock = lsock;
+    mtd_sfd = sfd;
+
+    for (;;) {
+        /* The socket, the signals and the clients whose request is not
+           complete yet */
+        for (n = 2, req = mtd_pending; req != NULL; req = req->next)
+            n++;
+        if (n > maxpfd) {
+            if ((p = realloc(pfd, 2 * n * sizeof(struct pollfd))) == NULL) {
+                perror("mtd");
+                break;
+            }
+            pfd = p;
+            maxpfd = 2 * n;
+        }
+        pfd[0].fd = lsock;
+        pfd[1].fd = sfd;
+        for (i = 2, req = mtd_pending; req != NULL; req = req->next)
+            pfd[i++].fd = req->client;
+        for (i = 0; i < n; i++)
+            pfd[i].events = POLLIN;
+        if (poll(pfd, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("mtd: poll");
+            break;
+        }
+        if (pfd[1].revents & POLLIN) {
+            if (read(sfd, &si, sizeof(si)) != sizeof(si))
+                continue;
+            if (si.ssi_signo == SIGCHLD)
+                mtd_reap();
+            else
+                break;
+        }
+        for (i = 2, link = &mtd_pending; (req = *link) != NULL; i++) {
+            if (pfd[i].revents == 0 || (n = mtd_read(req)) > 0) {
+                link = &req->next;
+                continue;
+            }
+            *link = req->next;
+            req->next = NULL;
+            if (n == 0)
+                mtd_dispatch(req);
+            else
+                mtd_free_request(req);
+        }
+        if (pfd[0].revents & POLLIN)
+            mtd_accept(lsock);
+    }
+
+    while ((req = mtd_pending) != NULL) {
+        mtd_pending = req->next;
+        mtd_free_request(req);
+    }
+    free(pfd);
+    unlink(sockname);
+    for (i = 0; i < mtd_nbr_drives; i++)
+        close(mtd_drives[i].fd);
+    free(mtd_drives);
+    return 0;
+}
+
+/* Send a command to mtd and copy its reply to our stdout and stderr */
+static int mtd_client(int argc, char **argv)
+{
+    int i, sock, result = 2;
+    const char *sockname = mtd_socket_name();
+    char *name, *line, type = 0, buf[4096];
+    size_t len, n;
+    long flen;
+    struct sockaddr_un addr;
+    FILE *f;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mt: socket name '%s' too long.\n", sockname);
+        return 1;
+    }
+    strcpy(addr.sun_path, sockname);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(sockname);
+        return 1;
+    }
+
+    if ((name = realpath(tape_name, NULL)) == NULL)
+        name = strdup(tape_name);
+    for (i = 0, len = strlen(name) + 9; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    if (name == NULL || (line = malloc(len)) == NULL) {
+        fprintf(stderr, "mt: out of memory.\n");
+        return 1;
+    }
+    strcpy(line, output_json ? "--json\t" : "");
+    strcat(line, name);
+    for (i = 0; i < argc; i++) {
+        strcat(line, "\t");
+        strcat(line, argv[i]);
+    }
+    strcat(line, "\n");
+    free(name);
+    if (len > MTD_MAXREQ) {
+        fprintf(stderr, "mt: command too long for the daemon.\n");
+        return 1;
+    }
+    if (write(sock, line, strlen(line)) < 0) {
+        perror(sockname);
+        return 1;
+    }
+    free(line);
+
+    if ((f = fdopen(sock, "r")) == NULL) {
+        perror(sockname);
+        return 1;
+    }
+    while (fgets(buf, sizeof(buf), f) != NULL && sscanf(buf, "%c %ld", &type, &flen) == 2) {
+        if (type == 'X') {
+            result = flen;
+            break;
+        }
+        for (; flen > 0; flen -= n) {
+            n = flen < (long)sizeof(buf) ? (size_t)flen : sizeof(buf);
+            if ((n = fread(buf, 1, n, f)) == 0)
+                break;
+            fwrite(buf, 1, n, type == 'E' ? stderr : stdout);
+        }
+    }
+    if (type != 'X')
+        fprintf(stderr, "mt: incomplete reply from the daemon.\n");
+    fclose(f);
+    return result;
 }
@@ -0,0 +1,327 @@
+/* The SCSI command transport shared by mt and stinit.
+
+   The commands that have no ioctl in the st driver are sent through
+   scsi_cmd(), which passes them to a backend: SG_IO to the device, or a
+   mock that answers them from a file so that the code using them can be
+   tested and timed without a drive. The time of each command is recorded
+   here for all the backends.
+
+   Maintained by Iustin Pop (iustin@k1024.org).
+   Distribution of this program is allowed according to the
+   GNU Public Licence.
+*/
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include "scsi.h"
+
+/* If MT_SCSI_MOCK is set in the environment, the commands are answered
+   from that file instead of by the drive. Each entry of the file is a
+   line
+
+       cdb-prefix : good | check key asc ascq | data hex...
+
+   where cdb-prefix is the first bytes of the matching commands, in hex,
+   and the data may continue on the following indented lines. The first
+   matching entry is used; other commands fail as an unsupported
+   operation code would (check 5 20 00). A line
+
+       latency ms
+
+   makes the commands answered by the entries after it take that many
+   milliseconds, to model a slow drive.
+
+   If MT_SCSI_STATS is set, the number of commands, the failures and the
+   mean and maximum times of each operation code are printed to stderr at
+   exit, by each process that sent commands. */
+
+#define SCSI_MAXMOCK 65536
+
+unsigned char scsi_sense[SCSI_SENSE_LEN];
+
+struct scsi_backend {
+    char *name;
+    int (*submit)(int fd, const unsigned char *cdb, int cdb_len, int dir, void *buf, size_t len,
+                  size_t *got, unsigned int timeout);
+};
+
+static const struct scsi_backend *backend;
+static const char *mock_name;
+
+static struct scsi_stat {
+    unsigned long count;
+    unsigned long failed;
+    double total; /* ms */
+    double max;
+} scsi_stats[256];
+
+
+/*** SG_IO ***/
+
+static void set_sense(int key, int asc, int ascq)
+{
+    memset(scsi_sense, 0, sizeof(scsi_sense));
+    scsi_sense[0] = 0x70;
+    scsi_sense[2] = key;
+    scsi_sense[7] = 10;
+    scsi_sense[12] = asc;
+    scsi_sense[13] = ascq;
+}
+
+/* The sense key of scsi_sense, in fixed or descriptor format */
+static int sense_key(void)
+{
+    if ((scsi_sense[0] & 0x7f) >= 0x72)
+        return scsi_sense[1] & 0x0f;
+    return scsi_sense[2] & 0x0f;
+}
+
+static int sg_submit(int fd, const unsigned char *cdb, int cdb_len, int dir, void *buf, size_t len,
+                     size_t *got, unsigned int timeout)
+{
+    struct sg_io_hdr io_hdr;
+
+    memset(&io_hdr, 0, sizeof(io_hdr));
+    io_hdr.interface_id = 'S';
+    io_hdr.cmd_len = cdb_len;
+    io_hdr.cmdp = (unsigned char *)cdb;
+    io_hdr.mx_sb_len = sizeof(scsi_sense);
+    io_hdr.sbp = scsi_sense;
+    io_hdr.dxfer_direction = len > 0 ? dir : SG_DXFER_NONE;
+    io_hdr.dxfer_len = len;
+    io_hdr.dxferp = buf;
+    io_hdr.timeout = timeout;
+    if (ioctl(fd, SG_IO, &io_hdr) < 0)
+        return (-1);
+    /* DRIVER_SENSE (0x08) only says that there is sense data, which the
+       status or the sense key tell how to take */
+    if (io_hdr.host_status != 0 || (io_hdr.driver_status & 0x07) != 0) {
+        errno = EIO;
+        return (-1);
+    }
+    if ((io_hdr.status & 0x7e) != 0 || (io_hdr.sb_len_wr > 0 && sense_key() > 1)) {
+        if (io_hdr.sb_len_wr == 0)
+            set_sense(0x0b, 0, 0); /* aborted command */
+        return 1;
+    }
+    *got = len - io_hdr.resid;
+    return 0;
+}
+
+
+/*** Mock ***/
+
+/* Parse the hex digits in s to the end of the line, skipping blanks */
+static int mock_hex(const char *s, unsigned char *out, size_t max, size_t *n)
+{
+    int digits = 0, v;
+
+    for (; *s != '\0' && *s != '\n' && *s != '#'; s++) {
+        if (*s == ' ' || *s == '\t')
+            continue;
+        if (!isxdigit((unsigned char)*s) || *n >= max)
+            return (-1);
+        v = isdigit((unsigned char)*s) ? *s - '0' : tolower((unsigned char)*s) - 'a' + 10;
+        if (digits++ % 2 == 0)
+            out[*n] = v << 4;
+        else
+            out[(*n)++] |= v;
+    }
+    return digits % 2 ? (-1) : 0;
+}
+
+static void mock_delay(double ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ms / 1000);
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+static int mock_submit(int fd __attribute__((unused)), const unsigned char *cdb, int cdb_len,
+                       int dir, void *buf, size_t len, size_t *got,
+                       unsigned int timeout __attribute__((unused)))
+{
+    FILE *f;
+    char line[1024], *p, *colon, action[16];
+    unsigned char prefix[16], *data;
+    size_t nprefix, ndata = 0;
+    unsigned int key, asc, ascq;
+    int lineno = 0, found = 0, result = 0;
+    double latency = 0, delay = 0;
+
+    if ((f = fopen(mock_name, "r")) == NULL)
+        return (-1);
+    if ((data = malloc(SCSI_MAXMOCK)) == NULL) {
+        fclose(f);
+        return (-1);
+    }
+    set_sense(5, 0x20, 0);
+    result = 1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (p != line) {
+            if (found && mock_hex(p, data, SCSI_MAXMOCK, &ndata) < 0)
+                goto bad;
+            continue;
+        }
+        if (found)
+            break;
+        if (!strncmp(line, "latency", 7)) {
+            if (sscanf(line + 7, "%lf", &latency) != 1 || latency < 0)
+                goto bad;
+            continue;
+        }
+        nprefix = 0;
+        if ((colon = strchr(line, ':')) == NULL)
+            goto bad;
+        *colon++ = '\0';
+        if (mock_hex(line, prefix, sizeof(prefix), &nprefix) < 0 ||
+            sscanf(colon, "%15s", action) != 1)
+            goto bad;
+        if ((int)nprefix > cdb_len || memcmp(prefix, cdb, nprefix) != 0)
+            continue;
+        found = 1;
+        delay = latency;
+        p = strstr(colon, action) + strlen(action);
+        if (!strcmp(action, "good"))
+            result = 0;
+        else if (!strcmp(action, "data")) {
+            result = 0;
+            if (mock_hex(p, data, SCSI_MAXMOCK, &ndata) < 0)
+                goto bad;
+        } else if (!strcmp(action, "check") &&
+                   sscanf(p, "%x %x %x", &key, &asc, &ascq) == 3) {
+            set_sense(key & 0x0f, asc & 0xff, ascq & 0xff);
+            result = 1;
+        } else
+            goto bad;
+    }
+    fclose(f);
+    if (!found)
+        delay = latency;
+    if (delay > 0)
+        mock_delay(delay);
+    if (result == 0 && dir == SG_DXFER_FROM_DEV && buf != NULL) {
+        *got = ndata < len ? ndata : len;
+        memcpy(buf, data, *got);
+    } else if (result == 0)
+        *got = len;
+    free(data);
+    return result;
+
+bad:
+    fprintf(stderr, "%s: %s:%d: illegal mock entry.\n", program_invocation_short_name, mock_name,
+            lineno);
+    fclose(f);
+    free(data);
+    errno = EINVAL;
+    return (-1);
+}
+
+
+/*** Commands ***/
+
+static const struct scsi_backend scsi_backends[] = {
+    { "sg", sg_submit },
+    { "mock", mock_submit },
+};
+
+void scsi_print_stats(void)
+{
+    int op;
+    const char *stats;
+    struct scsi_stat *st;
+
+    if (backend == NULL || (stats = getenv("MT_SCSI_STATS")) == NULL || *stats == '\0')
+        return;
+    fprintf(stderr, "%s: SCSI commands through the %s transport:\n",
+            program_invocation_short_name, backend->name);
+    for (op = 0; op < 256; op++) {
+        st = &scsi_stats[op];
+        if (st->count > 0)
+            fprintf(stderr, "  %02xh: %lu commands, %lu failed, mean %.3f ms, max %.3f ms\n", op,
+                    st->count, st->failed, st->total / st->count, st->max);
+    }
+    /* Printed once for the commands of each process */
+    memset(scsi_stats, 0, sizeof(scsi_stats));
+    backend = NULL;
+}
+
+static void select_backend(void)
+{
+    static int registered;
+
+    if ((mock_name = getenv("MT_SCSI_MOCK")) != NULL && *mock_name != '\0')
+        backend = &scsi_backends[1];
+    else
+        backend = &scsi_backends[0];
+    if (!registered) {
+        atexit(scsi_print_stats);
+        registered = 1;
+    }
+}
+
+int scsi_open(const char *name, int flags)
+{
+    const char *mock;
+
+    if ((mock = getenv("MT_SCSI_MOCK")) != NULL && *mock != '\0')
+        name = "/dev/null";
+    return open(name, flags);
+}
+
+int scsi_cmd(int fd, const unsigned char *cdb, int cdb_len, int dir, void *buf, size_t len,
+             size_t *got, unsigned int timeout)
+{
+    struct timespec start, end;
+    struct scsi_stat *st;
+    double ms;
+    int result;
+
+    if (backend == NULL)
+        select_backend();
+    *got = 0;
+    memset(scsi_sense, 0, sizeof(scsi_sense));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = backend->submit(fd, cdb, cdb_len, dir, buf, len, got, timeout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+    st = &scsi_stats[cdb[0]];
+    st->count++;
+    if (result != 0)
+        st->failed++;
+    st->total += ms;
+    if (ms > st->max)
+        st->max = ms;
+    return result;
+}
+
+void scsi_sense_string(char *str, size_t size)
+{
+    int asc, ascq;
+
+    if ((scsi_sense[0] & 0x7f) >= 0x72) {
+        asc = scsi_sense[2];
+        ascq = scsi_sense[3];
+    } else {
+        asc = scsi_sense[12];
+        ascq = scsi_sense[13];
+    }
+    snprintf(str, size, "sense key %d, asc %02xh, ascq %02xh", sense_key(), asc, ascq);
+}
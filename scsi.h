@@ -0,0 +1,39 @@
+/* The SCSI command transport shared by mt and stinit.
+
+   Maintained by Iustin Pop (iustin@k1024.org).
+   Distribution of this program is allowed according to the
+   GNU Public Licence.
+*/
+
+#ifndef SCSI_H
+#define SCSI_H
+
+#include <stddef.h>
+#include <scsi/sg.h>
+
+#define SCSI_TIMEOUT 60000
+#define SCSI_SENSE_LEN 32
+
+/* The sense data of the last command that failed with a check condition */
+extern unsigned char scsi_sense[SCSI_SENSE_LEN];
+
+/* Open a device to send commands to. With the mock, which stands in for
+   the drive, the device file is not opened. */
+int scsi_open(const char *name, int flags);
+
+/* Send a command. Returns 0 if it succeeded, 1 if the device reported an
+   error (the sense data is then in scsi_sense) and -1 if it could not be
+   sent (errno tells why). dir is SG_DXFER_TO_DEV or SG_DXFER_FROM_DEV;
+   the number of bytes transferred is stored in got. */
+int scsi_cmd(int fd, const unsigned char *cdb, int cdb_len, int dir, void *buf, size_t len,
+             size_t *got, unsigned int timeout);
+
+/* Describe the sense data of the last failed command */
+void scsi_sense_string(char *str, size_t size);
+
+/* If MT_SCSI_STATS is set, print the times of the commands sent since the
+   last call. This is done at exit; the children that leave with _exit()
+   call it themselves. */
+void scsi_print_stats(void);
+
+#endif
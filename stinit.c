@@ -14,16 +14,27 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <linux/major.h>
+#include <linux/netlink.h>
+#include <poll.h>
 #include <scsi/sg.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mtio.h"
+#include "scsi.h"
 #include "version.h"
 
 #ifndef FALSE
@@ -64,12 +75,35 @@ typedef struct _devdef_tr {
 } devdef_tr;
 
 
-#define DEFMAX 2048
-#define LINEMAX 256
-
-#define MAX_TAPES 32
 #define NBR_MODES 4
 
+/* The minor number of a tape device (see the st driver) */
+#define TAPE_NR(minor) ((((minor) & ~255) >> 3) | ((minor) & 31))
+#define TAPE_MINOR(tapeno, mode, non_rew)                                                          \
+    ((((tapeno) & ~31) << 3) | ((tapeno) & 31) | ((mode) << 5) | ((non_rew) ? 128 : 0))
+
+#define DEF_DEADLINE 300 /* seconds for one drive */
+
+/* A drive being initialized. Each drive is handled by a child process
+   whose messages are collected and printed in the order of the drives. */
+typedef struct {
+    int tapeno;
+    char *arg; /* the name on the command line, if any */
+    char *devpath, *devname; /* from udev */
+    char *fnames[NBR_MODES]; /* empty until looked up for udev */
+    pid_t pid;
+    FILE *out, *err;
+    struct timespec started;
+    double elapsed;
+    int state;
+} drive_tr;
+
+#define DRIVE_WAITING 0
+#define DRIVE_RUNNING 1
+#define DRIVE_OK 2
+#define DRIVE_FAILED 3
+#define DRIVE_TIMEOUT 4
+
 
 static int verbose = 0;
 
@@ -83,6 +117,20 @@ static devdir devdirs[] = { { "/dev/scsi", 0 }, { "/dev", 1 }, { "", 0 } };
 #define DEVFS_PATH "/dev/tapes"
 #define DEVFS_TAPEFMT DEVFS_PATH "/tape%d"
 
+/* The tape device nodes found, sorted by the device number */
+typedef struct {
+    dev_t dev;
+    int order; /* in the scan */
+    char *name;
+} devnode;
+static devnode *devnodes;
+static int ndevnodes, maxdevnodes;
+
+static char *sysfs_root = "/sys";
+
+/* The suffixes of the device names of the modes */
+static const char *mode_suffix[NBR_MODES] = { "", "l", "m", "a" };
+
 /* The partial names of the tape devices being included in the
    search in selective scan */
 static char *tape_name_bases[] = { "st", "nst", "rmt", "nrmt", "tape", NULL };
@@ -91,13 +139,15 @@ static char *tape_name_bases[] = { "st", "nst", "rmt", "nrmt", "tape", NULL };
 static char *std_databases[] = { "/etc/stinit.def", NULL };
 
 static char usage(int retval) __attribute__((noreturn));
+static int define_tape(drive_tr *d, devdef_tr *defptr, int print_non_found);
 
-static FILE *open_database(char *base)
+static FILE *find_database(char *base, char **name)
 {
     int i;
     FILE *f;
 
     if (base != NULL) {
+        *name = base;
         if ((f = fopen(base, "r")) == NULL)
             fprintf(stderr, "stinit: Can't find SCSI tape database '%s'.\n", base);
         return f;
@@ -109,6 +159,7 @@ static FILE *open_database(char *base)
         if ((f = fopen(std_databases[i], "r")) != NULL) {
             if (verbose > 1)
                 fprintf(stderr, "Open succeeded.\n");
+            *name = std_databases[i];
             return f;
         }
     }
@@ -118,73 +169,183 @@ static FILE *open_database(char *base)
 }
 
 
-static char *find_string(char *s, char *target, char *buf, int buflen)
+/* A definition is split into words in one pass. A word is name,
+   name=value or name="value"; anything else is a word of its own that
+   is kept only to be reported. The words of a block are kept in an
+   array reused for all the blocks and point into the text of the
+   block, which is not modified. */
+typedef struct {
+    char *text; /* the word as written */
+    int len;
+    char *name; /* NULL if the word is not a parameter */
+    int namelen;
+    char *value; /* NULL if no value is given */
+    int valuelen;
+    int used;
+} word_tr;
+
+static struct {
+    word_tr *words;
+    int nwords, maxwords;
+    char *end; /* of the text */
+} lex;
+
+/* The parameters, matched by the beginning of their names. A parameter
+   of a mode is a field of modepar_tr, the others of devdef_tr. */
+typedef struct {
+    char *prefix;
+    int of_mode;
+    size_t offset;
+} keyword_tr;
+
+#define KW_DRIVE(prefix, field) { prefix, FALSE, offsetof(devdef_tr, field) }
+#define KW_MODE(prefix, field) { prefix, TRUE, offsetof(modepar_tr, field) }
+
+#define KW_DISABLED 0 /* handled before the others */
+
+static keyword_tr keywords[] = {
+    KW_MODE("disab", defined),
+    KW_DRIVE("drive-", drive_buffering),
+    KW_DRIVE("timeout", timeout),
+    KW_DRIVE("long-time", long_timeout),
+    KW_DRIVE("clean", cleaning),
+    KW_DRIVE("no-w", nowait),
+    KW_DRIVE("weof-n", weof_nowait),
+    KW_DRIVE("sili", sili),
+    KW_MODE("block", blocksize),
+    KW_MODE("dens", density),
+    KW_MODE("buff", buffer_writes),
+    KW_MODE("async", async_writes),
+    KW_MODE("read", read_ahead),
+    KW_MODE("two", two_fm),
+    KW_MODE("comp", compression),
+    KW_MODE("auto", auto_lock),
+    KW_MODE("fast", fast_eod),
+    KW_MODE("can-b", can_bsr),
+    KW_MODE("noblk", no_blklimits),
+    KW_MODE("can-p", can_partitions),
+    KW_MODE("scsi2", scsi2logical),
+    KW_MODE("sysv", sysv),
+    KW_MODE("defs-for-w", defs_for_writes),
+};
+
+#define NBR_KEYWORDS (int)(sizeof(keywords) / sizeof(keywords[0]))
+
+
+static int add_word(char *text, int len, char *name, int namelen, char *value, int valuelen)
 {
-    int have_arg;
-    char *cp, *cp2, c, *argp;
+    word_tr *w;
+
+    if (lex.nwords == lex.maxwords) {
+        lex.maxwords = lex.maxwords ? lex.maxwords * 2 : 64;
+        if ((w = realloc(lex.words, lex.maxwords * sizeof(word_tr))) == NULL)
+            return FALSE;
+        lex.words = w;
+    }
+    w = &lex.words[lex.nwords++];
+    w->text = text;
+    w->len = len;
+    w->name = name;
+    w->namelen = namelen;
+    w->value = value;
+    w->valuelen = valuelen;
+    w->used = FALSE;
+    return TRUE;
+}
 
-    if (buf != NULL && buflen > 0)
-        *buf = '\0';
 
-    for (; *s != '\0';) {
+/* Split s into words. A name with = but without a complete value
+   makes the rest of s one word. In the body of a block, a name
+   starting with "mo" begins a mode and has no value. Returns FALSE if
+   out of memory. */
+static int lex_words(char *s, int body)
+{
+    char *start, *cp, *name_end, *value;
+    int valuelen;
+
+    lex.nwords = 0;
+    for (;;) {
         SKIP_WHITE(s);
-        if (isalpha(*s)) {
-            for (cp = s; isalnum(*cp) || *cp == '-'; cp++)
+        if (*s == '\0') {
+            lex.end = s;
+            return TRUE;
+        }
+        start = s;
+        if (!isalpha(*s)) {
+            for (; *s != '\0' && *s != ' ' && *s != '\t'; s++)
+                ;
+            if (!add_word(start, s - start, NULL, 0, NULL, 0))
+                return FALSE;
+            continue;
+        }
+        for (cp = s; isalnum(*cp) || *cp == '-'; cp++)
+            ;
+        name_end = cp;
+        SKIP_WHITE(cp);
+        if (*cp != '=' || (body && !strncmp(start, "mo", 2))) {
+            if (!add_word(start, name_end - start, start, name_end - start, NULL, 0))
+                return FALSE;
+            s = name_end;
+            continue;
+        }
+        cp++;
+        SKIP_WHITE(cp);
+        value = cp;
+        if (*cp == '"') {
+            for (value = ++cp; *cp != '"' && *cp != '\0'; cp++)
                 ;
-            cp2 = cp;
-            SKIP_WHITE(cp);
-            if (*cp == '=') {
+            valuelen = cp - value;
+            if (*cp != '\0')
                 cp++;
-                SKIP_WHITE(cp);
-                if (*cp == '"') {
-                    cp++;
-                    for (cp2 = cp; *cp2 != '"' && *cp2 != '\0'; cp2++)
-                        ;
-                } else {
-                    if (*cp == '\0')
-                        return NULL;
-                    else
-                        for (cp2 = cp + 1; isalnum(*cp2) || *cp2 == '-'; cp2++)
-                            ;
-                }
-                if (*cp2 == '\0')
-                    return NULL;
-                have_arg = TRUE;
-                argp = cp;
-            } else {
-                have_arg = FALSE;
-                argp = "1";
-            }
-
-            if (!strncmp(target, s, strlen(target))) {
-                c = *cp2;
-                *cp2 = '\0';
-                if (buf == NULL)
-                    buf = strdup(argp);
-                else {
-                    if (strlen(argp) < (unsigned int)buflen)
-                        strcpy(buf, argp);
-                    else {
-                        strncpy(buf, argp, buflen);
-                        buf[buflen - 1] = '\0';
-                    }
-                }
-                if (have_arg && c == '"')
-                    cp2++;
-                else
-                    *cp2 = c;
-                if (*cp2 != '\0')
-                    memmove(s, cp2, strlen(cp2) + 1);
-                else
-                    *s = '\0';
-                return buf;
-            }
-            s = cp2;
+            else
+                value = NULL;
+        } else if (*cp != '\0') {
+            for (cp++; isalnum(*cp) || *cp == '-'; cp++)
+                ;
+            valuelen = cp - value;
         } else
-            for (; *s != '\0' && *s != ' ' && *s != '\t'; s++)
+            value = NULL;
+        if (value == NULL) {
+            for (cp = start + strlen(start); cp[-1] == ' ' || cp[-1] == '\t'; cp--)
                 ;
+            lex.end = start + strlen(start);
+            return add_word(start, cp - start, NULL, 0, NULL, 0);
+        }
+        if (!add_word(start, cp - start, start, name_end - start, value, valuelen))
+            return FALSE;
+        s = cp;
     }
-    return NULL;
+}
+
+
+/* The keyword a word is a value of, or -1 */
+static int find_keyword(word_tr *w)
+{
+    int k, len;
+
+    if (w->name == NULL)
+        return -1;
+    for (k = 0; k < NBR_KEYWORDS; k++) {
+        len = strlen(keywords[k].prefix);
+        if (w->namelen >= len && !strncmp(w->name, keywords[k].prefix, len))
+            return k;
+    }
+    return -1;
+}
+
+
+/* A copy of the value of the first word whose name begins with prefix */
+static char *word_value(char *prefix)
+{
+    int i, len = strlen(prefix);
+    word_tr *w;
+
+    for (i = 0; i < lex.nwords; i++) {
+        w = &lex.words[i];
+        if (w->name != NULL && w->namelen >= len && !strncmp(w->name, prefix, len))
+            return w->value != NULL ? strndup(w->value, w->valuelen) : strdup("1");
+    }
+    return strdup("");
 }
 
 
@@ -204,57 +365,45 @@ static int num_arg(char *t)
 }
 
 
-static int next_block(FILE *dbf, char *buf, size_t buflen, int limiter)
+/* Read the definitions with the comments removed and the lines joined */
+static char *read_definitions(FILE *dbf)
 {
-    size_t len;
-    char *cp, *bp;
-    static char lbuf[LINEMAX];
-
-    if (limiter == 0) { /* Restart */
-        rewind(dbf);
-        lbuf[0] = '\0';
-        return TRUE;
-    }
-
-    for (len = 0;;) {
-        bp = buf + len;
-        if ((cp = strchr(lbuf, limiter)) != NULL) {
+    char *line = NULL, *text, *cp, *p;
+    size_t linesize = 0, len = 0, n;
+    ssize_t got;
+
+    if ((text = malloc(1)) == NULL)
+        return NULL;
+    while ((got = getline(&line, &linesize, dbf)) >= 0) {
+        if ((cp = strchr(line, '#')) != NULL)
             *cp = '\0';
-            strcpy(bp, lbuf);
-            cp++;
-            SKIP_WHITE(cp);
-            memmove(lbuf, cp, strlen(cp) + 1);
-            return TRUE;
-        }
-        if (len + strlen(lbuf) >= buflen) {
-            fprintf(stderr, "Too long definition: '%s'\n", buf);
-            return FALSE;
-        }
-        cp = lbuf;
+        else if (got > 0 && line[got - 1] == '\n')
+            line[got - 1] = '\0';
+        cp = line;
         SKIP_WHITE(cp);
-        strcpy(bp, cp);
-        strcat(bp, " ");
-        len += strlen(cp) + 1;
-        if (fgets(lbuf, LINEMAX, dbf) == NULL)
-            return FALSE;
-        if ((cp = strchr(lbuf, '#')) != NULL)
-            *cp = '\0';
-        else
-            lbuf[strlen(lbuf) - 1] = '\0';
+        n = strlen(cp);
+        if ((p = realloc(text, len + n + 2)) == NULL) {
+            free(text);
+            text = NULL;
+            break;
+        }
+        text = p;
+        memcpy(text + len, cp, n);
+        text[len + n] = ' ';
+        len += n + 1;
     }
+    free(line);
+    if (text != NULL)
+        text[len] = '\0';
+    return text;
 }
 
 
-static int
-find_pars(FILE *dbf, char *company, char *product, char *rev, devdef_tr *defs, int parse_only)
+/* Set all the parameters to "not given" */
+static void clear_defs(devdef_tr *defs, int defined)
 {
-    int i, mode, modes_defined, errors;
-    char line[LINEMAX], defstr[DEFMAX], comdef[DEFMAX], modebuf[DEFMAX];
-    char tmpcomp[LINEMAX], tmpprod[LINEMAX], tmprev[LINEMAX], *cp, c, *t;
-    char *nextdef, *curdef, *comptr;
-    static int call_nbr = 0;
+    int i;
 
-    call_nbr++;
     defs->drive_buffering = (-1);
     defs->timeout = (-1);
     defs->long_timeout = (-1);
@@ -263,7 +412,7 @@ find_pars(FILE *dbf, char *company, char *product, char *rev, devdef_tr *defs, i
     defs->weof_nowait = (-1);
     defs->sili = (-1);
     for (i = 0; i < NBR_MODES; i++) {
-        defs->modedefs[i].defined = FALSE;
+        defs->modedefs[i].defined = defined;
         defs->modedefs[i].blocksize = (-1);
         defs->modedefs[i].density = (-1);
         defs->modedefs[i].buffer_writes = (-1);
@@ -280,606 +429,2275 @@ find_pars(FILE *dbf, char *company, char *product, char *rev, devdef_tr *defs, i
         defs->modedefs[i].sysv = (-1);
         defs->modedefs[i].defs_for_writes = (-1);
     }
-    next_block(dbf, NULL, 0, 0);
+}
 
-    /* Find matching inquiry block */
-    for (errors = 0;;) {
 
-        if (!next_block(dbf, defstr, DEFMAX, '{'))
-            break;
+/* The text from word i on */
+#define WORD_START(i) ((i) < lex.nwords ? lex.words[i].text : lex.end)
 
-        find_string(defstr, "manuf", tmpcomp, LINEMAX);
-        find_string(defstr, "model", tmpprod, LINEMAX);
-        find_string(defstr, "rev", tmprev, LINEMAX);
+/* Print the unused words in the ranges from[r]..to[r] */
+static void print_unused(int *from, int *to, int nranges)
+{
+    int r, i, n = 0;
 
-        if (!next_block(dbf, defstr, DEFMAX, '}')) {
-            fprintf(stderr,
-                    "End of definition block not found for ('%s', "
-                    "'%s', '%s').\n",
-                    tmpcomp, tmpprod, tmprev);
-            return FALSE;
-        }
+    for (r = 0; r < nranges; r++)
+        for (i = from[r]; i < to[r]; i++)
+            if (!lex.words[i].used)
+                fprintf(stderr, "%s%.*s", n++ ? " " : "", lex.words[i].len, lex.words[i].text);
+    fprintf(stderr, "\n");
+}
 
-        if (!parse_only) {
-            if (tmpcomp[0] != '\0' && strncmp(company, tmpcomp, strlen(tmpcomp)))
-                continue;
-            if (tmpprod[0] != '\0' && strncmp(product, tmpprod, strlen(tmpprod)))
-                continue;
-            if (tmprev[0] != '\0' && strncmp(rev, tmprev, strlen(tmprev)))
-                continue;
-        } else if (verbose > 0)
-            printf("\nParsing modes for ('%s', '%s', '%s').\n", tmpcomp, tmpprod, tmprev);
 
-        /* Block found, get the characteristics */
-        for (nextdef = defstr;
-             *nextdef != '\0' && (*nextdef != 'm' || strncmp(nextdef, "mode", 2)); nextdef++)
+#define IS_MODE(w) ((w)->name != NULL && (w)->namelen >= 2 && !strncmp((w)->name, "mo", 2))
+#define WORD_VALUE(w) ((w)->value != NULL ? (w)->value : "1")
+
+/* The number of the mode starting at word start, or -1 if it is not
+   valid. Sets *next to the first word of the parameters. */
+static int mode_number(int start, int end, int *next)
+{
+    word_tr *w = &lex.words[start];
+    char *cp;
+    int mode;
+
+    *next = start + 1;
+    if (w->namelen < 4 || strncmp(w->name, "mode", 4))
+        return -1;
+    if (w->namelen == 4 && start + 1 < end) { /* mode 2 */
+        w = &lex.words[start + 1];
+        mode = strtol(w->text, &cp, 10);
+        (*next)++;
+        return cp == w->text || cp != w->text + w->len ? -1 : mode - 1;
+    }
+    mode = strtol(w->name + 4, &cp, 10);
+    return cp == w->name + 4 || cp != w->name + w->namelen ? -1 : mode - 1;
+}
+
+
+/* Parse the parameters of a definition block into defs, where a mode
+   that is not mentioned is left as defined = -1. The parameters before
+   the first mode belong to all the modes and take precedence over the
+   ones in the mode. The errors are printed if show is set or verbose.
+   Returns the number of errors. */
+static int parse_block(char *defstr, char *tmpcomp, char *tmpprod, char *tmprev, devdef_tr *defs,
+                       int show)
+{
+    int mode, errors = 0, ncommon, start, end, i, k, r, unused;
+    int found[NBR_KEYWORDS], from[2], to[2];
+    char *base, *cp;
+    word_tr *w;
+
+    clear_defs(defs, -1);
+    defs->do_rewind = FALSE; /* not used, but saved in the cache */
+    if (!lex_words(defstr, TRUE)) {
+        fprintf(stderr, "Can't allocate memory for the database.\n");
+        return 1;
+    }
+    for (ncommon = 0; ncommon < lex.nwords && !IS_MODE(&lex.words[ncommon]); ncommon++)
+        ;
+
+    for (start = ncommon; start < lex.nwords; start = end) {
+        for (end = start + 1; end < lex.nwords && !IS_MODE(&lex.words[end]); end++)
             ;
-        c = *nextdef;
-        *nextdef = '\0';
-        strcpy(comdef, defstr);
-        *nextdef = c;
-        comptr = comdef;
-        SKIP_WHITE(comptr);
-
-        for (; *nextdef != '\0';) {
-            int tmpsize;
-            curdef = nextdef;
-            SKIP_WHITE(curdef);
-            for (nextdef++;
-                 *nextdef != '\0' && (*nextdef != 'm' || strncmp(nextdef, "mode", 2));
-                 nextdef++)
-                ;
-            c = *nextdef;
-            *nextdef = '\0';
-
-            mode = strtol(curdef + 4, &cp, 0) - 1;
-            if (mode < 0 || mode >= NBR_MODES) {
-                fprintf(stderr, "Illegal mode for ('%s', '%s', '%s'):\n'%s'\n",
-                        tmpcomp, tmpprod, tmprev, curdef);
-                *nextdef = c;
-                errors++;
-                continue;
-            }
+        from[0] = 0;
+        to[0] = ncommon;
+        mode = mode_number(start, end, &from[1]);
+        to[1] = end;
+        if (mode < 0 || mode >= NBR_MODES) {
+            if (show || verbose > 0)
+                fprintf(stderr, "Illegal mode for ('%s', '%s', '%s'):\n'%.*s'\n", tmpcomp,
+                        tmpprod, tmprev, (int)(WORD_START(end) - WORD_START(start)),
+                        WORD_START(start));
+            errors++;
+            continue;
+        }
 
-            if ((tmpsize = snprintf(modebuf, DEFMAX, "%s%s", comptr, cp)) >= DEFMAX) {
-                fprintf(stderr, "Definition too large for ('%s', '%s', '%s'): size %d, maximum is %d\n",
-                        tmpcomp, tmpprod, tmprev, tmpsize, DEFMAX);
-                *nextdef = c;
-                errors++;
-                continue;
-            }
+        if (verbose > 1 && show) {
+            cp = lex.words[from[1] - 1].text + lex.words[from[1] - 1].len;
+            fprintf(stderr, "Mode %d definition: %.*s%.*s\n", mode + 1,
+                    (int)(WORD_START(ncommon) - WORD_START(0)), WORD_START(0),
+                    (int)(WORD_START(end) - cp), cp);
+        }
 
-            *nextdef = c;
+        /* The first word of each parameter is used */
+        for (k = 0; k < NBR_KEYWORDS; k++)
+            found[k] = -1;
+        for (r = 0, unused = 0; r < 2; r++)
+            for (i = from[r]; i < to[r]; i++) {
+                w = &lex.words[i];
+                w->used = (k = find_keyword(w)) >= 0 && found[k] < 0;
+                if (w->used)
+                    found[k] = i;
+                else
+                    unused++;
+            }
 
-            if (verbose > 1)
-                fprintf(stderr, "Mode %d definition: %s\n", mode + 1, modebuf);
+        if (found[KW_DISABLED] >= 0 &&
+            strtol(WORD_VALUE(&lex.words[found[KW_DISABLED]]), NULL, 0) != 0) {
+            defs->modedefs[mode].defined = FALSE;
+            continue;
+        }
 
-            if ((t = find_string(modebuf, "disab", line, LINEMAX)) != NULL &&
-                strtol(t, NULL, 0) != 0) {
-                defs->modedefs[mode].defined = FALSE;
+        defs->modedefs[mode].defined = TRUE;
+        for (k = KW_DISABLED + 1; k < NBR_KEYWORDS; k++) {
+            if (found[k] < 0)
                 continue;
-            }
+            base = keywords[k].of_mode ? (char *)&defs->modedefs[mode] : (char *)defs;
+            *(int *)(base + keywords[k].offset) = num_arg(WORD_VALUE(&lex.words[found[k]]));
+        }
 
-            if ((t = find_string(modebuf, "drive-", line, LINEMAX)) != NULL)
-                defs->drive_buffering = num_arg(t);
-            if ((t = find_string(modebuf, "timeout", line, LINEMAX)) != NULL)
-                defs->timeout = num_arg(t);
-            if ((t = find_string(modebuf, "long-time", line, LINEMAX)) != NULL)
-                defs->long_timeout = num_arg(t);
-            if ((t = find_string(modebuf, "clean", line, LINEMAX)) != NULL)
-                defs->cleaning = num_arg(t);
-            if ((t = find_string(modebuf, "no-w", line, LINEMAX)) != NULL)
-                defs->nowait = num_arg(t);
-            if ((t = find_string(modebuf, "weof-n", line, LINEMAX)) != NULL)
-                defs->weof_nowait = num_arg(t);
-            if ((t = find_string(modebuf, "sili", line, LINEMAX)) != NULL)
-                defs->sili = num_arg(t);
-
-            defs->modedefs[mode].defined = TRUE;
-            if ((t = find_string(modebuf, "block", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].blocksize = num_arg(t);
-            if ((t = find_string(modebuf, "dens", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].density = num_arg(t);
-            if ((t = find_string(modebuf, "buff", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].buffer_writes = num_arg(t);
-            if ((t = find_string(modebuf, "async", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].async_writes = num_arg(t);
-            if ((t = find_string(modebuf, "read", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].read_ahead = num_arg(t);
-            if ((t = find_string(modebuf, "two", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].two_fm = num_arg(t);
-            if ((t = find_string(modebuf, "comp", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].compression = num_arg(t);
-            if ((t = find_string(modebuf, "auto", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].auto_lock = num_arg(t);
-            if ((t = find_string(modebuf, "fast", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].fast_eod = num_arg(t);
-            if ((t = find_string(modebuf, "can-b", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].can_bsr = num_arg(t);
-            if ((t = find_string(modebuf, "noblk", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].no_blklimits = num_arg(t);
-            if ((t = find_string(modebuf, "can-p", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].can_partitions = num_arg(t);
-            if ((t = find_string(modebuf, "scsi2", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].scsi2logical = num_arg(t);
-            if ((t = find_string(modebuf, "sysv", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].sysv = num_arg(t);
-            if ((t = find_string(modebuf, "defs-for-w", line, LINEMAX)) != NULL)
-                defs->modedefs[mode].defs_for_writes = num_arg(t);
-
-            for (t = modebuf; *t == ' ' || *t == '\t'; t++)
-                ;
-            if (*t != '\0' && call_nbr <= 1) {
+        if (unused > 0) {
+            if (show || verbose > 0) {
                 fprintf(stderr,
                         "Warning: errors in definition for ('%s', "
-                        "'%s', '%s'):\n%s\n",
-                        tmpcomp, tmpprod, tmprev, modebuf);
-                errors++;
+                        "'%s', '%s'):\n",
+                        tmpcomp, tmpprod, tmprev);
+                print_unused(from, to, 2);
             }
-        }
-    }
-
-    if (parse_only) {
-        if (verbose > 0)
-            printf("\n");
-        printf("Definition parse completed. ");
-        if (errors) {
-            printf("Errors found!\n");
-            return FALSE;
-        } else {
-            printf("No errors found.\n");
-            return TRUE;
-        }
-    } else {
-        for (i = modes_defined = 0; i < NBR_MODES; i++)
-            if (defs->modedefs[i].defined)
-                modes_defined++;
-        if (modes_defined == 0) {
-            fprintf(stderr, "Warning: No modes in definition for ('%s', '%s', '%s').\n",
-                    tmpcomp, tmpprod, tmprev);
             errors++;
         }
     }
-
-    if (modes_defined)
-        return TRUE;
-    return FALSE;
+    return errors;
 }
 
 
-static int sg_io_errcheck(struct sg_io_hdr *hdp)
+#define SET_PAR(field)                                                                             \
+    if (add->field >= 0)                                                                           \
+    defs->field = add->field
+
+/* Add the parameters of a block to the ones collected so far */
+static void apply_defs(devdef_tr *defs, devdef_tr *add)
 {
-    if ((hdp->status & 0x7e) == 0 || hdp->host_status == 0 || hdp->driver_status == 0)
-        return 0;
-    return EIO;
+    int i;
+
+    SET_PAR(drive_buffering);
+    SET_PAR(timeout);
+    SET_PAR(long_timeout);
+    SET_PAR(cleaning);
+    SET_PAR(nowait);
+    SET_PAR(weof_nowait);
+    SET_PAR(sili);
+    for (i = 0; i < NBR_MODES; i++) {
+        if (add->modedefs[i].defined < 0)
+            continue;
+        defs->modedefs[i].defined = add->modedefs[i].defined;
+        if (!add->modedefs[i].defined)
+            continue;
+        SET_PAR(modedefs[i].blocksize);
+        SET_PAR(modedefs[i].density);
+        SET_PAR(modedefs[i].buffer_writes);
+        SET_PAR(modedefs[i].async_writes);
+        SET_PAR(modedefs[i].read_ahead);
+        SET_PAR(modedefs[i].two_fm);
+        SET_PAR(modedefs[i].compression);
+        SET_PAR(modedefs[i].auto_lock);
+        SET_PAR(modedefs[i].fast_eod);
+        SET_PAR(modedefs[i].can_bsr);
+        SET_PAR(modedefs[i].no_blklimits);
+        SET_PAR(modedefs[i].can_partitions);
+        SET_PAR(modedefs[i].scsi2logical);
+        SET_PAR(modedefs[i].sysv);
+        SET_PAR(modedefs[i].defs_for_writes);
+    }
 }
 
 
-#define INQUIRY 0x12
-#define INQUIRY_CMDLEN 6
-#define SENSE_BUFF_LEN 32
-#define DEF_TIMEOUT 60000
+/* The database is parsed once into a list of blocks, indexed by a trie
+   on the manufacturer. Each node where a manufacturer string of a block
+   ends points to a trie on the model, and those to a trie on the
+   revision, whose nodes list the blocks. A lookup walks the inquiry
+   strings down the tries, collecting the blocks at the nodes passed;
+   these are the blocks whose strings are prefixes of the inquiry data.
 
-#ifndef SCSI_IOCTL_SEND_COMMAND
-#define SCSI_IOCTL_SEND_COMMAND 1
-#endif
-#define IOCTL_HEADER_LENGTH 8
+   The trie is built with pointers and then flattened into arrays where
+   the nodes are linked by their index and the strings are offsets into
+   a string table. The arrays are saved as an image in CACHE_DIR (or the
+   directory in STINIT_CACHE) and the next run maps the image instead of
+   parsing the file. The image records the size, modification time and
+   hash of the file, and is used only while they all match. */
 
-static int do_inquiry(char *tname, char *company, char *product, char *rev, int print_non_found)
-{
-    int fn;
-    int result, *ip, i;
-#define BUFLEN 256
-    unsigned char buffer[BUFLEN], *cmd, *inqptr;
-    struct sg_io_hdr io_hdr;
-    unsigned char inqCmdBlk[INQUIRY_CMDLEN] = { INQUIRY, 0, 0, 0, 200, 0 };
-    unsigned char sense_b[SENSE_BUFF_LEN];
+#define CACHE_DIR "/var/cache/stinit"
+#define CACHE_MAGIC "STINITDB"
+#define CACHE_VERSION 1
 
-    if ((fn = open(tname, O_RDONLY | O_NONBLOCK)) < 0) {
-        if (print_non_found || verbose > 0) {
-            if (errno == ENXIO)
-                fprintf(stderr, "Device '%s' not found by kernel.\n", tname);
-            else
-                fprintf(stderr, "Can't open tape device '%s' (errno %d).\n", tname, errno);
-        }
-        return FALSE;
-    }
+typedef struct _build_node {
+    struct _build_node *child, *next; /* first child, next sibling */
+    struct _build_node *sub;          /* the trie of the next string */
+    uint32_t *blocks, nblocks;
+    char c;
+} build_node;
 
-    /* Try SG_IO first, if it is not supported, use SCSI_IOCTL_SEND_COMMAND */
-    memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
-    io_hdr.interface_id = 'S';
-    io_hdr.cmd_len = sizeof(inqCmdBlk);
-    io_hdr.mx_sb_len = sizeof(sense_b);
-    io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-    io_hdr.dxfer_len = 200;
-    io_hdr.dxferp = buffer;
-    io_hdr.cmdp = inqCmdBlk;
-    io_hdr.sbp = sense_b;
-    io_hdr.timeout = DEF_TIMEOUT;
-    inqptr = buffer;
+typedef struct {
+    char *key[3]; /* manufacturer, model and revision */
+    devdef_tr defs;
+} build_block;
 
-    result = ioctl(fn, SG_IO, &io_hdr);
-    if (!result)
-        result = sg_io_errcheck(&io_hdr);
-    if (result) {
-        if (errno == ENOTTY || errno == EINVAL) {
-            memset(buffer, 0, BUFLEN);
-            ip = (int *)&(buffer[0]);
-            *ip = 0;
-            *(ip + 1) = BUFLEN - 13;
+static struct {
+    build_block *blocks;
+    uint32_t nblocks, maxblocks;
+    build_node *root;
+} dbbuild;
 
-            cmd = &(buffer[8]);
-            cmd[0] = INQUIRY;
-            cmd[4] = 200;
+typedef struct {
+    uint32_t child, next; /* first child, next sibling; 0 is none */
+    uint32_t sub;         /* the trie of the next string */
+    uint32_t blocks, nblocks;
+    char c;
+    char pad[3];
+} trie_node;
 
-            result = ioctl(fn, SCSI_IOCTL_SEND_COMMAND, buffer);
-            inqptr = buffer + IOCTL_HEADER_LENGTH;
-        }
-        if (result) {
-            close(fn);
-            sprintf((char *)buffer,
-                    "The SCSI INQUIRY for device '%s' failed (power off?)", tname);
-            perror((char *)buffer);
-            return FALSE;
-        }
-    }
+typedef struct {
+    uint32_t key[3]; /* offsets in the string table */
+    int32_t specificity;
+    devdef_tr defs;
+} dbblock;
 
-    memcpy(company, inqptr + 8, 8);
-    for (i = 8; i > 0 && company[i - 1] == ' '; i--)
-        ;
-    company[i] = '\0';
-    memcpy(product, inqptr + 16, 16);
-    for (i = 16; i > 0 && product[i - 1] == ' '; i--)
-        ;
-    product[i] = '\0';
-    memcpy(rev, inqptr + 32, 4);
-    for (i = 4; i > 0 && rev[i - 1] == ' '; i--)
-        ;
-    rev[i] = '\0';
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t defsize; /* changes with the parameter structures */
+    uint64_t src_size;
+    int64_t src_mtime, src_mtime_ns;
+    uint64_t src_hash;
+    uint64_t checksum; /* of the data after the header */
+    uint32_t nblocks, nnodes, nlist, strsize;
+} dbheader;
+
+/* The database in use; the manufacturer trie is rooted at node 1 */
+static struct {
+    dbblock *blocks;
+    trie_node *nodes;
+    uint32_t *list;
+    char *strings;
+    uint32_t nblocks, nnodes, nlist, strsize;
+    void *image; /* the cache when mapped */
+    size_t imagesize;
+} stdb;
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
 
-    close(fn);
-    return TRUE;
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
 }
 
 
-static int tapenum(char *name)
+static double seconds_since(struct timespec *t)
 {
-    int dev;
-    struct dirent *dent;
-    DIR *dirp;
-    char tmpname[PATH_MAX];
-    const char *dn;
-    const devdir *dvd;
-    struct stat statbuf;
-
-    if (strchr(name, '/') != NULL) { /* Complete name */
-        if (stat(name, &statbuf) != 0) {
-            fprintf(stderr, "Can't stat '%s'.\n", name);
-            return (-1);
-        }
-        if (!S_ISCHR(statbuf.st_mode) || major(statbuf.st_rdev) != SCSI_TAPE_MAJOR)
-            return (-1);
-        dev = minor(statbuf.st_rdev) & 31;
-        return dev;
-    } else { /* Search from the device directories */
-        for (dvd = devdirs; dvd->dir[0] != 0; dvd++) {
-            dn = dvd->dir;
-            if ((dirp = opendir(dn)) == NULL)
-                continue;
+    struct timespec now;
 
-            for (; (dent = readdir(dirp)) != NULL;)
-                if (!strcmp(dent->d_name, name)) {
-                    strcpy(tmpname, dn);
-                    strcat(tmpname, "/");
-                    strcat(tmpname, dent->d_name);
-                    if (stat(tmpname, &statbuf) != 0) {
-                        fprintf(stderr, "Can't stat '%s'.\n", tmpname);
-                        continue;
-                    }
-                    if (!S_ISCHR(statbuf.st_mode) || major(statbuf.st_rdev) != SCSI_TAPE_MAJOR)
-                        continue;
-                    dev = minor(statbuf.st_rdev) & 31;
-                    closedir(dirp);
-                    return dev;
-                }
-            closedir(dirp);
-        }
-    }
-
-    return (-1);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
 }
 
 
-static int accept_tape_name(char *name)
+/* Find or add the node of a key, the root being the empty key */
+static build_node *trie_insert(build_node **root, const char *key)
 {
-    char **npp;
+    build_node *node, **pp;
 
-    for (npp = tape_name_bases; *npp; npp++)
-        if (!strncmp(name, *npp, strlen(*npp)))
-            return TRUE;
-    return FALSE;
+    if (*root == NULL && (*root = calloc(1, sizeof(build_node))) == NULL)
+        return NULL;
+    for (node = *root; *key != '\0'; key++) {
+        for (pp = &node->child; *pp != NULL && (*pp)->c != *key; pp = &(*pp)->next)
+            ;
+        if (*pp == NULL) {
+            if ((*pp = calloc(1, sizeof(build_node))) == NULL)
+                return NULL;
+            (*pp)->c = *key;
+        }
+        node = *pp;
+    }
+    return node;
 }
 
 
-static int find_devfiles(int tapeno, char **names)
+static int add_block(char *comp, char *prod, char *rev, devdef_tr *defs)
 {
-    int dev, mode, found;
-    int non_rew[NBR_MODES];
-    struct dirent *dent;
-    DIR *dirp;
-    char tmpname[PATH_MAX];
+    build_block *b;
+    build_node *node;
+    uint32_t *p;
+
+    if (dbbuild.nblocks == dbbuild.maxblocks) {
+        dbbuild.maxblocks = dbbuild.maxblocks ? dbbuild.maxblocks * 2 : 64;
+        if ((b = realloc(dbbuild.blocks, dbbuild.maxblocks * sizeof(build_block))) == NULL)
+            return FALSE;
+        dbbuild.blocks = b;
+    }
+    b = &dbbuild.blocks[dbbuild.nblocks];
+    if ((b->key[0] = strdup(comp)) == NULL || (b->key[1] = strdup(prod)) == NULL ||
+        (b->key[2] = strdup(rev)) == NULL)
+        return FALSE;
+    b->defs = *defs;
+
+    if ((node = trie_insert(&dbbuild.root, comp)) == NULL ||
+        (node = trie_insert(&node->sub, prod)) == NULL ||
+        (node = trie_insert(&node->sub, rev)) == NULL)
+        return FALSE;
+    if ((p = realloc(node->blocks, (node->nblocks + 1) * sizeof(uint32_t))) == NULL)
+        return FALSE;
+    node->blocks = p;
+    node->blocks[node->nblocks++] = dbbuild.nblocks++;
+    return TRUE;
+}
+
+
+static void count_nodes(build_node *node, uint32_t *nnodes, uint32_t *nlist)
+{
+    for (; node != NULL; node = node->next) {
+        (*nnodes)++;
+        *nlist += node->nblocks;
+        count_nodes(node->sub, nnodes, nlist);
+        count_nodes(node->child, nnodes, nlist);
+    }
+}
+
+
+/* Copy a node and its siblings to the node array, freeing them.
+   Returns the index of the first one. */
+static uint32_t flatten_nodes(build_node *node)
+{
+    uint32_t first = 0, prev = 0, idx, sub, child;
+    build_node *next;
+
+    for (; node != NULL; node = next) {
+        idx = stdb.nnodes++;
+        stdb.nodes[idx].c = node->c;
+        stdb.nodes[idx].blocks = stdb.nlist;
+        stdb.nodes[idx].nblocks = node->nblocks;
+        if (node->nblocks > 0)
+            memcpy(stdb.list + stdb.nlist, node->blocks, node->nblocks * sizeof(uint32_t));
+        stdb.nlist += node->nblocks;
+        sub = flatten_nodes(node->sub);
+        child = flatten_nodes(node->child);
+        stdb.nodes[idx].sub = sub;
+        stdb.nodes[idx].child = child;
+        if (prev != 0)
+            stdb.nodes[prev].next = idx;
+        else
+            first = idx;
+        prev = idx;
+        next = node->next;
+        free(node->blocks);
+        free(node);
+    }
+    return first;
+}
+
+
+/* Turn the parsed blocks into the arrays used for the lookups */
+static int flatten_database(void)
+{
+    uint32_t nnodes = 1, nlist = 0, strsize = 0, i, k, len;
+    build_block *bb;
+    dbblock *b;
+
+    count_nodes(dbbuild.root, &nnodes, &nlist);
+    for (i = 0; i < dbbuild.nblocks; i++)
+        for (k = 0; k < 3; k++)
+            strsize += strlen(dbbuild.blocks[i].key[k]) + 1;
+    stdb.blocks = calloc(dbbuild.nblocks + 1, sizeof(dbblock));
+    stdb.nodes = calloc(nnodes, sizeof(trie_node));
+    stdb.list = calloc(nlist + 1, sizeof(uint32_t));
+    stdb.strings = calloc(strsize + 1, 1);
+    if (stdb.blocks == NULL || stdb.nodes == NULL || stdb.list == NULL || stdb.strings == NULL)
+        return FALSE;
+
+    stdb.nnodes = 1;
+    stdb.nlist = 0;
+    flatten_nodes(dbbuild.root);
+    dbbuild.root = NULL;
+
+    for (i = 0; i < dbbuild.nblocks; i++) {
+        bb = &dbbuild.blocks[i];
+        b = &stdb.blocks[i];
+        /* More strings given is more specific, then longer strings */
+        b->specificity = 0;
+        for (k = 0; k < 3; k++) {
+            len = strlen(bb->key[k]);
+            b->key[k] = stdb.strsize;
+            memcpy(stdb.strings + stdb.strsize, bb->key[k], len + 1);
+            stdb.strsize += len + 1;
+            b->specificity += (len > 0) * 1024 + len;
+            free(bb->key[k]);
+        }
+        b->defs = bb->defs;
+    }
+    stdb.nblocks = dbbuild.nblocks;
+    free(dbbuild.blocks);
+    memset(&dbbuild, 0, sizeof(dbbuild));
+    return TRUE;
+}
+
+
+/* Parse the whole database. Returns FALSE if it can't be used, or, when
+   only parsing, if it has errors. */
+static int load_database(FILE *dbf, int parse_only)
+{
+    int errors = 0;
+    char *text, *header, *defstr, *cp;
+    char *tmpcomp, *tmpprod, *tmprev;
+    devdef_tr defs;
+
+    if ((text = read_definitions(dbf)) == NULL) {
+        fprintf(stderr, "Can't allocate memory for the database.\n");
+        return FALSE;
+    }
+    for (header = text; (cp = strchr(header, '{')) != NULL; header = cp + 1) {
+        *cp = '\0';
+        defstr = cp + 1;
+        if (!lex_words(header, FALSE) || (tmpcomp = word_value("manuf")) == NULL ||
+            (tmpprod = word_value("model")) == NULL || (tmprev = word_value("rev")) == NULL) {
+            fprintf(stderr, "Can't allocate memory for the database.\n");
+            free(text);
+            return FALSE;
+        }
+
+        if ((cp = strchr(defstr, '}')) == NULL) {
+            fprintf(stderr,
+                    "End of definition block not found for ('%s', "
+                    "'%s', '%s').\n",
+                    tmpcomp, tmpprod, tmprev);
+            free(tmpcomp);
+            free(tmpprod);
+            free(tmprev);
+            free(text);
+            return FALSE;
+        }
+        *cp = '\0';
+        if (parse_only && verbose > 0)
+            printf("\nParsing modes for ('%s', '%s', '%s').\n", tmpcomp, tmpprod, tmprev);
+
+        errors += parse_block(defstr, tmpcomp, tmpprod, tmprev, &defs, parse_only);
+        if (!add_block(tmpcomp, tmpprod, tmprev, &defs)) {
+            fprintf(stderr, "Can't allocate memory for the database.\n");
+            free(text);
+            return FALSE;
+        }
+        free(tmpcomp);
+        free(tmpprod);
+        free(tmprev);
+    }
+    free(text);
+    if (!flatten_database()) {
+        fprintf(stderr, "Can't allocate memory for the database.\n");
+        return FALSE;
+    }
+
+    if (parse_only) {
+        if (verbose > 0)
+            printf("\n");
+        printf("Definition parse completed. ");
+        if (errors) {
+            printf("Errors found!\n");
+            return FALSE;
+        } else {
+            printf("No errors found.\n");
+            return TRUE;
+        }
+    }
+    /* The bad parameters are ignored; the details are printed with -p */
+    if (errors && verbose == 0)
+        fprintf(stderr, "Warning: %d errors in the definitions, use 'stinit -p' to list them.\n",
+                errors);
+    return TRUE;
+}
+
+
+/* The name of the cache of a database, or NULL if there is no cache */
+static char *cache_name(char *dbname)
+{
+    char *dir, *path, *name, *p;
+
+    if ((dir = getenv("STINIT_CACHE")) == NULL)
+        dir = CACHE_DIR;
+    if (*dir == '\0' || (path = realpath(dbname, NULL)) == NULL)
+        return NULL;
+    if ((name = malloc(strlen(dir) + strlen(path) + 8)) != NULL) {
+        for (p = path; *p != '\0'; p++)
+            if (*p == '/')
+                *p = '_';
+        sprintf(name, "%s/%s.db", dir, path + 1);
+    }
+    free(path);
+    return name;
+}
+
+
+/* Serialize the database in use for the source described by hdr */
+static void *make_image(dbheader *hdr, size_t *len)
+{
+    char *image, *p;
+
+    hdr->nblocks = stdb.nblocks;
+    hdr->nnodes = stdb.nnodes;
+    hdr->nlist = stdb.nlist;
+    hdr->strsize = stdb.strsize;
+    *len = sizeof(dbheader) + stdb.nblocks * sizeof(dbblock) + stdb.nnodes * sizeof(trie_node) +
+           stdb.nlist * sizeof(uint32_t) + stdb.strsize;
+    if ((image = malloc(*len)) == NULL)
+        return NULL;
+    p = image + sizeof(dbheader);
+    memcpy(p, stdb.blocks, stdb.nblocks * sizeof(dbblock));
+    p += stdb.nblocks * sizeof(dbblock);
+    memcpy(p, stdb.nodes, stdb.nnodes * sizeof(trie_node));
+    p += stdb.nnodes * sizeof(trie_node);
+    memcpy(p, stdb.list, stdb.nlist * sizeof(uint32_t));
+    p += stdb.nlist * sizeof(uint32_t);
+    memcpy(p, stdb.strings, stdb.strsize);
+    hdr->checksum = hash_bytes(HASH_INIT, image + sizeof(dbheader), *len - sizeof(dbheader));
+    memcpy(image, hdr, sizeof(dbheader));
+    return image;
+}
+
+
+/* Check that the links of the image stay inside its tables. The nodes
+   are numbered in preorder, so a link always goes to a later node and
+   the lookup can't loop. Returns FALSE if a link is out of bounds. */
+static int check_links(dbheader *hdr)
+{
+    char *p = (char *)hdr + sizeof(dbheader);
+    dbblock *blocks = (dbblock *)p;
+    trie_node *nodes = (trie_node *)(p + hdr->nblocks * sizeof(dbblock));
+    uint32_t *list = (uint32_t *)(nodes + hdr->nnodes);
+    char *strings = (char *)(list + hdr->nlist);
+    uint32_t i, k;
+    trie_node *t;
+
+    for (i = 1; i < hdr->nnodes; i++) {
+        t = &nodes[i];
+        if ((t->child != 0 && (t->child <= i || t->child >= hdr->nnodes)) ||
+            (t->next != 0 && (t->next <= i || t->next >= hdr->nnodes)) ||
+            (t->sub != 0 && (t->sub <= i || t->sub >= hdr->nnodes)) ||
+            (uint64_t)t->blocks + t->nblocks > hdr->nlist)
+            return FALSE;
+    }
+    for (i = 0; i < hdr->nlist; i++)
+        if (list[i] >= hdr->nblocks)
+            return FALSE;
+    if (hdr->strsize > 0 && strings[hdr->strsize - 1] != '\0')
+        return FALSE;
+    for (i = 0; i < hdr->nblocks; i++)
+        for (k = 0; k < 3; k++)
+            if (blocks[i].key[k] >= hdr->strsize)
+                return FALSE;
+    return TRUE;
+}
+
+
+/* Check the header of an image. Returns 1 if the image is usable, 0 if
+   it is for another version of the source and -1 if it is corrupt. */
+static int check_image(void *image, size_t len, dbheader *src)
+{
+    dbheader *hdr = image;
+
+    if (len < sizeof(dbheader) || memcmp(hdr->magic, CACHE_MAGIC, 8))
+        return -1;
+    if (hdr->version != CACHE_VERSION || hdr->defsize != sizeof(devdef_tr))
+        return 0;
+    if (len != sizeof(dbheader) + hdr->nblocks * sizeof(dbblock) +
+                   (uint64_t)hdr->nnodes * sizeof(trie_node) + hdr->nlist * sizeof(uint32_t) +
+                   hdr->strsize ||
+        hdr->nnodes == 0 ||
+        hash_bytes(HASH_INIT, (char *)image + sizeof(dbheader), len - sizeof(dbheader)) !=
+            hdr->checksum ||
+        !check_links(hdr))
+        return -1;
+    if (hdr->src_size != src->src_size || hdr->src_mtime != src->src_mtime ||
+        hdr->src_mtime_ns != src->src_mtime_ns || hdr->src_hash != src->src_hash)
+        return 0;
+    return 1;
+}
+
+
+/* Map the cache. Returns TRUE if it is used as the database. */
+static int map_cache(char *cname, dbheader *src)
+{
+    int fd;
+    struct stat st;
+    void *image;
+    char *p;
+    dbheader *hdr;
+
+    if ((fd = open(cname, O_RDONLY)) < 0)
+        return FALSE;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(dbheader) ||
+        (image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return FALSE;
+    }
+    close(fd);
+    if (check_image(image, st.st_size, src) != 1) {
+        if (verbose > 1)
+            fprintf(stderr, "Cache '%s' is not usable.\n", cname);
+        munmap(image, st.st_size);
+        return FALSE;
+    }
+
+    hdr = image;
+    stdb.image = image;
+    stdb.imagesize = st.st_size;
+    stdb.nblocks = hdr->nblocks;
+    stdb.nnodes = hdr->nnodes;
+    stdb.nlist = hdr->nlist;
+    stdb.strsize = hdr->strsize;
+    p = (char *)image + sizeof(dbheader);
+    stdb.blocks = (dbblock *)p;
+    p += stdb.nblocks * sizeof(dbblock);
+    stdb.nodes = (trie_node *)p;
+    p += stdb.nnodes * sizeof(trie_node);
+    stdb.list = (uint32_t *)p;
+    p += stdb.nlist * sizeof(uint32_t);
+    stdb.strings = p;
+    return TRUE;
+}
+
+
+/* Save the database in use as the cache, replacing it atomically */
+static void save_cache(char *cname, dbheader *src)
+{
+    int fd;
+    char *tmpname, *image, *p;
+    size_t len;
+
+    if ((tmpname = malloc(strlen(cname) + 8)) == NULL)
+        return;
+    sprintf(tmpname, "%s", cname);
+    if ((p = strrchr(tmpname, '/')) != NULL) {
+        *p = '\0';
+        mkdir(tmpname, 0755);
+    }
+    sprintf(tmpname, "%s.XXXXXX", cname);
+    if ((image = make_image(src, &len)) == NULL || (fd = mkstemp(tmpname)) < 0) {
+        if (verbose > 1)
+            fprintf(stderr, "Can't create the cache '%s'.\n", cname);
+        free(image);
+        free(tmpname);
+        return;
+    }
+    if (write(fd, image, len) != (ssize_t)len || fchmod(fd, 0644) < 0 || close(fd) < 0 ||
+        rename(tmpname, cname) < 0) {
+        if (verbose > 1)
+            fprintf(stderr, "Can't write the cache '%s': %s\n", cname, strerror(errno));
+        unlink(tmpname);
+    } else if (verbose > 1)
+        fprintf(stderr, "Saved the cache '%s'.\n", cname);
+    free(image);
+    free(tmpname);
+}
+
+
+/* Compare the cache with the database just parsed. Returns FALSE if the
+   cache is corrupt or claims to be for this source but does not match. */
+static int verify_cache(char *cname, dbheader *src)
+{
+    FILE *f;
+    char *image = NULL, *mine;
+    size_t len = 0, mylen;
+    long size;
+    int i, retval = TRUE;
+
+    if ((f = fopen(cname, "r")) == NULL)
+        return TRUE;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0 &&
+        (image = malloc(size + 1)) != NULL)
+        len = fread(image, 1, size, f);
+    fclose(f);
+    if (image == NULL || (mine = make_image(src, &mylen)) == NULL) {
+        free(image);
+        return TRUE;
+    }
+
+    i = check_image(image, len, src);
+    if (i < 0) {
+        printf("Cache '%s' is corrupt.\n", cname);
+        retval = FALSE;
+    } else if (i == 0)
+        printf("Cache '%s' is out of date.\n", cname);
+    else if (len != mylen || memcmp(image, mine, len)) {
+        printf("Cache '%s' does not match the definitions.\n", cname);
+        retval = FALSE;
+    } else
+        printf("Cache '%s' matches the definitions.\n", cname);
+    free(image);
+    free(mine);
+    return retval;
+}
+
+
+/* Load the database, from the cache if it is up to date. Returns FALSE
+   if it can't be used, or, when only parsing, if it or its cache has
+   errors. */
+static int open_database(char *base, int parse_only)
+{
+    FILE *dbf;
+    char *dbname, *cname, buf[4096];
+    size_t n;
+    int retval;
+    struct stat st;
+    struct timespec t0;
+    dbheader src;
+
+    if ((dbf = find_database(base, &dbname)) == NULL)
+        return FALSE;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(&src, 0, sizeof(src));
+    memcpy(src.magic, CACHE_MAGIC, 8);
+    src.version = CACHE_VERSION;
+    src.defsize = sizeof(devdef_tr);
+    src.src_hash = HASH_INIT;
+    if (fstat(fileno(dbf), &st) == 0) {
+        src.src_size = st.st_size;
+        src.src_mtime = st.st_mtim.tv_sec;
+        src.src_mtime_ns = st.st_mtim.tv_nsec;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), dbf)) > 0)
+        src.src_hash = hash_bytes(src.src_hash, buf, n);
+    rewind(dbf);
+
+    cname = cache_name(dbname);
+    if (!parse_only && cname != NULL && map_cache(cname, &src)) {
+        fclose(dbf);
+        if (verbose > 0)
+            printf("Loaded %d definition blocks from '%s' in %.3f ms.\n", stdb.nblocks, cname,
+                   seconds_since(&t0) * 1000);
+        free(cname);
+        return TRUE;
+    }
+
+    retval = load_database(dbf, parse_only);
+    fclose(dbf);
+    if (verbose > 0)
+        printf("Parsed %d definition blocks in %.3f ms.\n", stdb.nblocks,
+               seconds_since(&t0) * 1000);
+    if (cname != NULL && retval) {
+        if (parse_only)
+            retval = verify_cache(cname, &src);
+        else
+            save_cache(cname, &src);
+    }
+    free(cname);
+    return retval;
+}
+
+
+/* Collect the blocks matching the inquiry strings from level on */
+static void trie_lookup(uint32_t node, char **keys, int level, uint32_t **found, int *nfound)
+{
+    const char *k;
+    trie_node *t;
+    uint32_t *p;
+
+    for (k = keys[level]; node != 0; k++) {
+        t = &stdb.nodes[node];
+        if (level < 2)
+            trie_lookup(t->sub, keys, level + 1, found, nfound);
+        else if (t->nblocks > 0 &&
+                 (p = realloc(*found, (*nfound + t->nblocks) * sizeof(uint32_t))) != NULL) {
+            memcpy(p + *nfound, stdb.list + t->blocks, t->nblocks * sizeof(uint32_t));
+            *found = p;
+            *nfound += t->nblocks;
+        }
+        if (*k == '\0')
+            break;
+        for (node = t->child; node != 0 && stdb.nodes[node].c != *k; node = stdb.nodes[node].next)
+            ;
+    }
+}
+
+
+static int cmp_blocks(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    if (stdb.blocks[x].specificity != stdb.blocks[y].specificity)
+        return stdb.blocks[x].specificity - stdb.blocks[y].specificity;
+    return x < y ? -1 : x > y;
+}
+
+
+/* Find the parameters for a device. All the matching blocks are
+   applied, from the least specific to the most specific one. */
+static int find_pars(char *company, char *product, char *rev, devdef_tr *defs)
+{
+    int i, modes_defined, nfound = 0;
+    uint32_t *found = NULL;
+    char *keys[3];
+    dbblock *b;
+
+    clear_defs(defs, FALSE);
+    keys[0] = company;
+    keys[1] = product;
+    keys[2] = rev;
+    if (stdb.nnodes > 1)
+        trie_lookup(1, keys, 0, &found, &nfound);
+    qsort(found, nfound, sizeof(uint32_t), cmp_blocks);
+    for (i = 0; i < nfound; i++) {
+        b = &stdb.blocks[found[i]];
+        if (verbose > 1)
+            printf("Using the definitions for ('%s', '%s', '%s').\n", stdb.strings + b->key[0],
+                   stdb.strings + b->key[1], stdb.strings + b->key[2]);
+        apply_defs(defs, &b->defs);
+    }
+    free(found);
+
+    for (i = modes_defined = 0; i < NBR_MODES; i++)
+        if (defs->modedefs[i].defined)
+            modes_defined++;
+    if (nfound > 0 && modes_defined == 0)
+        fprintf(stderr, "Warning: No modes in definition for ('%s', '%s', '%s').\n", company,
+                product, rev);
+    return modes_defined > 0;
+}
+
+
+#define INQUIRY 0x12
+#define INQUIRY_CMDLEN 6
+#define DEF_TIMEOUT SCSI_TIMEOUT
+
+static int inquiry_timeout = DEF_TIMEOUT; /* ms, limited by the drive deadline */
+
+#ifndef SCSI_IOCTL_SEND_COMMAND
+#define SCSI_IOCTL_SEND_COMMAND 1
+#endif
+#define IOCTL_HEADER_LENGTH 8
+
+static int do_inquiry(char *tname, char *company, char *product, char *rev, int print_non_found)
+{
+    int fn;
+    int result, *ip, i;
+#define BUFLEN 256
+    unsigned char buffer[BUFLEN], *cmd, *inqptr;
+    unsigned char inqCmdBlk[INQUIRY_CMDLEN] = { INQUIRY, 0, 0, 0, 200, 0 };
+    size_t got;
+
+    if ((fn = scsi_open(tname, O_RDONLY | O_NONBLOCK)) < 0) {
+        if (print_non_found || verbose > 0) {
+            if (errno == ENXIO)
+                fprintf(stderr, "Device '%s' not found by kernel.\n", tname);
+            else
+                fprintf(stderr, "Can't open tape device '%s' (errno %d).\n", tname, errno);
+        }
+        return FALSE;
+    }
+
+    /* Try SG_IO first, if it is not supported, use SCSI_IOCTL_SEND_COMMAND */
+    memset(buffer, 0, BUFLEN);
+    inqptr = buffer;
+    result = scsi_cmd(fn, inqCmdBlk, sizeof(inqCmdBlk), SG_DXFER_FROM_DEV, buffer, 200, &got,
+                      inquiry_timeout);
+    if (result > 0)
+        errno = EIO;
+    if (result) {
+        if (result < 0 && (errno == ENOTTY || errno == EINVAL)) {
+            memset(buffer, 0, BUFLEN);
+            ip = (int *)&(buffer[0]);
+            *ip = 0;
+            *(ip + 1) = BUFLEN - 13;
+
+            cmd = &(buffer[8]);
+            cmd[0] = INQUIRY;
+            cmd[4] = 200;
+
+            result = ioctl(fn, SCSI_IOCTL_SEND_COMMAND, buffer);
+            inqptr = buffer + IOCTL_HEADER_LENGTH;
+        }
+        if (result) {
+            close(fn);
+            sprintf((char *)buffer,
+                    "The SCSI INQUIRY for device '%s' failed (power off?)", tname);
+            perror((char *)buffer);
+            return FALSE;
+        }
+    }
+
+    memcpy(company, inqptr + 8, 8);
+    for (i = 8; i > 0 && company[i - 1] == ' '; i--)
+        ;
+    company[i] = '\0';
+    memcpy(product, inqptr + 16, 16);
+    for (i = 16; i > 0 && product[i - 1] == ' '; i--)
+        ;
+    product[i] = '\0';
+    memcpy(rev, inqptr + 32, 4);
+    for (i = 4; i > 0 && rev[i - 1] == ' '; i--)
+        ;
+    rev[i] = '\0';
+
+    close(fn);
+    return TRUE;
+}
+
+
+static int tapenum(char *name)
+{
+    int dev;
+    struct dirent *dent;
+    DIR *dirp;
+    char tmpname[PATH_MAX];
     const char *dn;
-    static const devdir *dvd;
-    const devdir *dvp;
-    int tmpdevdirsindex = 0;
-    static devdir tmpdevdirs[MAX_TAPES + 1];
+    const devdir *dvd;
     struct stat statbuf;
 
-    for (found = 0; found < NBR_MODES; found++) {
-        *names[found] = '\0';
-        non_rew[found] = FALSE;
+    if (strchr(name, '/') != NULL) { /* Complete name */
+        if (stat(name, &statbuf) != 0) {
+            fprintf(stderr, "Can't stat '%s'.\n", name);
+            return (-1);
+        }
+        if (!S_ISCHR(statbuf.st_mode) || major(statbuf.st_rdev) != SCSI_TAPE_MAJOR)
+            return (-1);
+        dev = TAPE_NR(minor(statbuf.st_rdev));
+        return dev;
+    } else { /* Search from the device directories */
+        for (dvd = devdirs; dvd->dir[0] != 0; dvd++) {
+            dn = dvd->dir;
+            if ((dirp = opendir(dn)) == NULL)
+                continue;
+
+            for (; (dent = readdir(dirp)) != NULL;)
+                if (!strcmp(dent->d_name, name)) {
+                    strcpy(tmpname, dn);
+                    strcat(tmpname, "/");
+                    strcat(tmpname, dent->d_name);
+                    if (stat(tmpname, &statbuf) != 0) {
+                        fprintf(stderr, "Can't stat '%s'.\n", tmpname);
+                        continue;
+                    }
+                    if (!S_ISCHR(statbuf.st_mode) || major(statbuf.st_rdev) != SCSI_TAPE_MAJOR)
+                        continue;
+                    dev = TAPE_NR(minor(statbuf.st_rdev));
+                    closedir(dirp);
+                    return dev;
+                }
+            closedir(dirp);
+        }
+    }
+
+    return (-1);
+}
+
+
+static int accept_tape_name(char *name)
+{
+    char **npp;
+
+    for (npp = tape_name_bases; *npp; npp++)
+        if (!strncmp(name, *npp, strlen(*npp)))
+            return TRUE;
+    return FALSE;
+}
+
+
+static int cmp_devnodes(const void *a, const void *b)
+{
+    const devnode *x = a, *y = b;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->order < 0 || y->order < 0)
+        return 0;
+    return x->order - y->order;
+}
+
+
+/* Scan the device directories once for the tape device nodes */
+static int scan_devnodes(void)
+{
+    struct dirent *dent;
+    DIR *dirp;
+    char tmpname[PATH_MAX];
+    devdir *dvd = devdirs, *tmpdevdirs = NULL, *p;
+    int i, ntmp = 0;
+    devnode *np;
+    struct stat statbuf;
+
+    if (devnodes != NULL)
+        return TRUE;
+    if (!stat(DEVFS_PATH, &statbuf) && S_ISDIR(statbuf.st_mode) &&
+        (dirp = opendir(DEVFS_PATH)) != NULL) {
+        /* Assume devfs, one directory for each tape */
+        for (; (dent = readdir(dirp)) != NULL;) {
+            if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+                continue;
+            if ((p = realloc(tmpdevdirs, (ntmp + 2) * sizeof(devdir))) == NULL)
+                break;
+            tmpdevdirs = p;
+            snprintf(tmpdevdirs[ntmp].dir, sizeof(tmpdevdirs[ntmp].dir), "%s/%s", DEVFS_PATH,
+                     dent->d_name);
+            tmpdevdirs[ntmp++].selective_scan = FALSE;
+            tmpdevdirs[ntmp].dir[0] = 0;
+        }
+        closedir(dirp);
+        if (tmpdevdirs != NULL)
+            dvd = tmpdevdirs;
+    }
+
+    for (; dvd->dir[0] != 0; dvd++) {
+        if ((dirp = opendir(dvd->dir)) == NULL)
+            continue;
+        for (; (dent = readdir(dirp)) != NULL;) {
+            if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+                continue;
+            /* Ignore non-tape devices to avoid loading all the modules */
+            if (dvd->selective_scan && !accept_tape_name(dent->d_name))
+                continue;
+            if (snprintf(tmpname, sizeof(tmpname), "%s/%s", dvd->dir, dent->d_name) >=
+                (int)sizeof(tmpname))
+                continue;
+            if (stat(tmpname, &statbuf) != 0) {
+                fprintf(stderr, "Can't stat '%s'.\n", tmpname);
+                continue;
+            }
+            if (!S_ISCHR(statbuf.st_mode) || major(statbuf.st_rdev) != SCSI_TAPE_MAJOR)
+                continue;
+            if (ndevnodes == maxdevnodes) {
+                maxdevnodes = maxdevnodes ? maxdevnodes * 2 : 64;
+                if ((np = realloc(devnodes, maxdevnodes * sizeof(devnode))) == NULL)
+                    break;
+                devnodes = np;
+            }
+            if ((devnodes[ndevnodes].name = strdup(tmpname)) == NULL)
+                break;
+            devnodes[ndevnodes].dev = statbuf.st_rdev;
+            devnodes[ndevnodes].order = ndevnodes;
+            ndevnodes++;
+        }
+        closedir(dirp);
+    }
+    free(tmpdevdirs);
+
+    if (devnodes == NULL && (devnodes = malloc(sizeof(devnode))) == NULL) {
+        fprintf(stderr, "Can't allocate the device list.\n");
+        return FALSE;
+    }
+    qsort(devnodes, ndevnodes, sizeof(devnode), cmp_devnodes);
+    if (verbose > 1)
+        for (i = 0; i < ndevnodes; i++)
+            printf("Device node '%s' (%d:%d)\n", devnodes[i].name, major(devnodes[i].dev),
+                   minor(devnodes[i].dev));
+    return TRUE;
+}
+
+
+/* The device number of a mode of a tape, from sysfs if it is there */
+static dev_t tape_devno(int tapeno, int mode, int non_rew)
+{
+    char path[PATH_MAX];
+    unsigned int maj, min;
+    FILE *f;
+    int n = 0;
+
+    snprintf(path, sizeof(path), "%s/class/scsi_tape/%sst%d%s/dev", sysfs_root,
+             non_rew ? "n" : "", tapeno, mode_suffix[mode]);
+    if ((f = fopen(path, "r")) != NULL) {
+        n = fscanf(f, "%u:%u", &maj, &min);
+        fclose(f);
+    }
+    if (n == 2)
+        return makedev(maj, min);
+    return makedev(SCSI_TAPE_MAJOR, TAPE_MINOR(tapeno, mode, non_rew));
+}
+
+
+/* Find the device files of each mode, preferring the non-rewind ones */
+static int find_devfiles(int tapeno, char **names)
+{
+    int mode, non_rew, found = 0;
+    devnode key, *np;
+
+    if (!scan_devnodes())
+        return FALSE;
+    for (mode = 0; mode < NBR_MODES; mode++) {
+        *names[mode] = '\0';
+        for (non_rew = 1; non_rew >= 0; non_rew--) {
+            key.dev = tape_devno(tapeno, mode, non_rew);
+            key.order = -1;
+            np = bsearch(&key, devnodes, ndevnodes, sizeof(devnode), cmp_devnodes);
+            /* The first one found in the scan */
+            for (; np != NULL && np > devnodes && (np - 1)->dev == key.dev; np--)
+                ;
+            if (np != NULL) {
+                snprintf(names[mode], PATH_MAX, "%s", np->name);
+                found++;
+                break;
+            }
+        }
+    }
+
+    return (found > 0);
+}
+
+
+static int cmp_tapenos(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+
+/* List the numbers of the tapes known to the kernel, from sysfs or, if
+   that is not available, from the device nodes. Returns the count, or -1
+   on error. */
+static int find_tapes(int **tapenos)
+{
+    char path[PATH_MAX], *cp;
+    struct dirent *dent;
+    DIR *dirp;
+    int i, n = 0, max = 0, tapeno, *p;
+
+    *tapenos = NULL;
+    snprintf(path, sizeof(path), "%s/class/scsi_tape", sysfs_root);
+    if ((dirp = opendir(path)) != NULL) {
+        for (; (dent = readdir(dirp)) != NULL;) {
+            /* One st<n> entry for each tape, the others are the modes */
+            if (strncmp(dent->d_name, "st", 2) || !isdigit(dent->d_name[2]))
+                continue;
+            tapeno = strtol(dent->d_name + 2, &cp, 10);
+            if (*cp != '\0')
+                continue;
+            if (n == max) {
+                max = max ? max * 2 : 32;
+                if ((p = realloc(*tapenos, max * sizeof(int))) == NULL) {
+                    closedir(dirp);
+                    return (-1);
+                }
+                *tapenos = p;
+            }
+            (*tapenos)[n++] = tapeno;
+        }
+        closedir(dirp);
+        if (verbose > 1)
+            printf("Found %d tape%s in '%s'.\n", n, n != 1 ? "s" : "", path);
+    } else {
+        if (!scan_devnodes())
+            return (-1);
+        for (i = 0; i < ndevnodes; i++) {
+            tapeno = TAPE_NR(minor(devnodes[i].dev));
+            if (n > 0 && (*tapenos)[n - 1] == tapeno)
+                continue;
+            if (n == max) {
+                max = max ? max * 2 : 32;
+                if ((p = realloc(*tapenos, max * sizeof(int))) == NULL)
+                    return (-1);
+                *tapenos = p;
+            }
+            (*tapenos)[n++] = tapeno;
+        }
+    }
+    qsort(*tapenos, n, sizeof(int), cmp_tapenos);
+    /* Remove the duplicates (several modes of a tape in the nodes) */
+    for (i = tapeno = 0; i < n; i++)
+        if (i == 0 || (*tapenos)[i] != (*tapenos)[tapeno - 1])
+            (*tapenos)[tapeno++] = (*tapenos)[i];
+    return tapeno;
+}
+
+
+/*** udev ***/
+
+/* The tape number of a scsi_tape class device, [n]st<N>[l|m|a] */
+static int class_tapeno(char *name)
+{
+    int tapeno;
+    char *cp;
+
+    if (*name == 'n')
+        name++;
+    if (strncmp(name, "st", 2) || !isdigit(name[2]))
+        return (-1);
+    tapeno = strtol(name + 2, &cp, 10);
+    if (*cp != '\0' && (strchr("lma", *cp) == NULL || cp[1] != '\0'))
+        return (-1);
+    return tapeno;
+}
+
+
+/* Read an attribute of the SCSI device of a tape from sysfs, without the
+   padding */
+static int read_attr(char *devpath, char *attr, char *buf, int buflen)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    int i;
+
+    snprintf(path, sizeof(path), "%s%s/device/%s", sysfs_root, devpath, attr);
+    if ((f = fopen(path, "r")) == NULL)
+        return FALSE;
+    if (fgets(buf, buflen, f) == NULL) {
+        fclose(f);
+        return FALSE;
+    }
+    fclose(f);
+    for (i = strlen(buf); i > 0 && isspace(buf[i - 1]); i--)
+        ;
+    buf[i] = '\0';
+    return TRUE;
+}
+
+
+/* Find the device files of a drive if they are not known yet, first
+   next to the one of the udev event, then by scanning the device
+   directories */
+static int drive_devfiles(drive_tr *d)
+{
+    char *cp;
+    int mode, non_rew, found = 0;
+    struct stat st;
+
+    if (*d->fnames[0] != '\0')
+        return TRUE;
+    if (d->devname != NULL && (cp = strrchr(d->devname, '/')) != NULL) {
+        for (mode = 0; mode < NBR_MODES; mode++)
+            for (non_rew = 1; non_rew >= 0; non_rew--) {
+                snprintf(d->fnames[mode], PATH_MAX, "%.*s/%sst%d%s", (int)(cp - d->devname),
+                         d->devname, non_rew ? "n" : "", d->tapeno, mode_suffix[mode]);
+                if (stat(d->fnames[mode], &st) == 0 && S_ISCHR(st.st_mode) &&
+                    st.st_rdev == tape_devno(d->tapeno, mode, non_rew)) {
+                    found++;
+                    break;
+                }
+                *d->fnames[mode] = '\0';
+            }
+    }
+    if ((found == 0 || *d->fnames[0] == '\0') && !find_devfiles(d->tapeno, d->fnames))
+        *d->fnames[0] = '\0';
+    if (*d->fnames[0] == '\0') {
+        fprintf(stderr, "Can't find any device files for tape %d.\n", d->tapeno);
+        return FALSE;
+    }
+    if (verbose > 1)
+        for (mode = 0; mode < NBR_MODES; mode++)
+            printf("Mode %d, name '%s'\n", mode + 1, d->fnames[mode]);
+    return TRUE;
+}
+
+
+/* Set up a drive named by the DEVPATH and DEVNAME of a uevent, with the
+   device files to be looked up when needed */
+static int setup_drive(drive_tr *d, char *devpath, char *devname)
+{
+    char *cp;
+    int i;
+
+    memset(d, 0, sizeof(drive_tr));
+    d->tapeno = -1;
+    if (devpath != NULL && *devpath != '\0' && (cp = strrchr(devpath, '/')) != NULL)
+        d->tapeno = class_tapeno(cp + 1);
+    if (d->tapeno < 0 && devname != NULL && *devname != '\0')
+        d->tapeno = tapenum(devname);
+    if (d->tapeno < 0) {
+        fprintf(stderr, "No tape device in DEVPATH or DEVNAME.\n");
+        return FALSE;
+    }
+    d->pid = -1;
+    if ((devpath != NULL && (d->devpath = strdup(devpath)) == NULL) ||
+        (devname != NULL && (d->devname = strdup(devname)) == NULL) ||
+        (d->fnames[0] = calloc(NBR_MODES, PATH_MAX)) == NULL) {
+        fprintf(stderr, "Can't allocate name buffers.\n");
+        free(d->devpath);
+        free(d->devname);
+        return FALSE;
+    }
+    for (i = 1; i < NBR_MODES; i++)
+        d->fnames[i] = d->fnames[i - 1] + PATH_MAX;
+    return TRUE;
+}
+
+
+/* Initialize the drive of a udev event, named by DEVPATH and DEVNAME in
+   the environment. The inquiry data is read from sysfs, so that the drive
+   is not opened before its definition is known. */
+static int udev_tape(devdef_tr *defptr)
+{
+    drive_tr d;
+    int ok;
+
+    if (!setup_drive(&d, getenv("DEVPATH"), getenv("DEVNAME")))
+        return FALSE;
+    ok = define_tape(&d, defptr, TRUE);
+    free(d.fnames[0]);
+    free(d.devpath);
+    free(d.devname);
+    return ok;
+}
+
+
+/* The settings of a mode shown in sysfs. The driver does not show the
+   drive buffering, the long timeout, the cleaning request and the
+   auto-lock option, so these are always set. */
+typedef struct {
+    int known; /* FALSE if the state could not be read */
+    int options, blocksize, density, compression;
+    int timeout; /* of the drive, -1 if not known */
+} modestate_tr;
+
+#define SHOWN_OPTIONS                                                                              \
+    (MT_ST_BUFFER_WRITES | MT_ST_ASYNC_WRITES | MT_ST_READ_AHEAD | MT_ST_TWO_FM |                  \
+     MT_ST_FAST_MTEOM | MT_ST_DEF_WRITES | MT_ST_CAN_BSR | MT_ST_NO_BLKLIMS |                      \
+     MT_ST_CAN_PARTITIONS | MT_ST_SCSI2LOGICAL | MT_ST_SYSV | MT_ST_NOWAIT | MT_ST_NOWAIT_EOF |    \
+     MT_ST_SILI)
+
+/* The options that st keeps for the drive rather than for each mode */
+#define DRIVE_OPTIONS                                                                              \
+    (MT_ST_TWO_FM | MT_ST_FAST_MTEOM | MT_ST_AUTO_LOCK | MT_ST_CAN_BSR | MT_ST_NO_BLKLIMS |        \
+     MT_ST_CAN_PARTITIONS | MT_ST_SCSI2LOGICAL | MT_ST_SYSV | MT_ST_NOWAIT | MT_ST_NOWAIT_EOF |    \
+     MT_ST_SILI)
+
+/* An ioctl to issue and the message if it fails */
+typedef struct {
+    struct mtop op;
+    char msg[80];
+} pending_tr;
+
+#define MAX_PENDING 10
+
+
+static int read_sysfs_int(char *dir, char *attr, int *value)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    if ((f = fopen(path, "r")) == NULL)
+        return FALSE;
+    n = fscanf(f, "%i", value);
+    fclose(f);
+    return n == 1;
+}
+
+
+static void read_mode_state(int tapeno, int mode, modestate_tr *st)
+{
+    char dir[PATH_MAX];
+    int defined;
+
+    snprintf(dir, sizeof(dir), "%s/class/scsi_tape/st%d%s", sysfs_root, tapeno,
+             mode_suffix[mode]);
+    /* The settings of a mode not yet defined are copied from mode 1 */
+    st->known = read_sysfs_int(dir, "defined", &defined) && defined &&
+                read_sysfs_int(dir, "options", &st->options) &&
+                read_sysfs_int(dir, "default_blksize", &st->blocksize) &&
+                read_sysfs_int(dir, "default_density", &st->density) &&
+                read_sysfs_int(dir, "default_compression", &st->compression);
+    if (!st->known || mode != 0 || !read_sysfs_int(dir, "device/timeout", &st->timeout))
+        st->timeout = -1;
+}
+
+
+static void add_op(pending_tr *ops, int *n, int mt_op, int count)
+{
+    ops[*n].op.mt_op = mt_op;
+    ops[*n].op.mt_count = count;
+    ops[*n].msg[0] = '\0';
+    (*n)++;
+}
+
+
+/* The value shown in sysfs after a default is set to value */
+static int shown_default(int value, int mask)
+{
+    return value == MT_ST_CLEAR_DEFAULT ? (-1) : (value & mask);
+}
+
+
+/* Find the ioctls needed to bring a mode from the state st to the
+   definition. Returns the number of ioctls, adding the ones not needed
+   to *skipped. drive[0] and drive[1] are the drive options cleared and
+   set by the ioctls of the earlier modes, which sysfs does not show
+   yet; the ones of this mode are added. */
+static int plan_mode(devdef_tr *defs, int i, modestate_tr *st, pending_tr *ops, int *skipped,
+                     int *drive)
+{
+    int n = 0, clear_set[2], unknown;
+    modepar_tr *m = &defs->modedefs[i];
+
+    if (i == 0) {
+        if (defs->do_rewind)
+            add_op(ops, &n, MTREW, 1);
+        if (defs->drive_buffering >= 0) {
+            add_op(ops, &n, MTSETDRVBUFFER, MT_ST_DEF_DRVBUFFER | defs->drive_buffering);
+            snprintf(ops[n - 1].msg, 80, "Can't set drive buffering to %d.",
+                     defs->drive_buffering);
+        }
+        if (defs->timeout >= 0) {
+            if (st->timeout != defs->timeout) {
+                add_op(ops, &n, MTSETDRVBUFFER, MT_ST_SET_TIMEOUT | defs->timeout);
+                snprintf(ops[n - 1].msg, 80, "Can't set device timeout %d s.", defs->timeout);
+            } else
+                (*skipped)++;
+        }
+        if (defs->long_timeout >= 0) {
+            add_op(ops, &n, MTSETDRVBUFFER, MT_ST_SET_LONG_TIMEOUT | defs->long_timeout);
+            snprintf(ops[n - 1].msg, 80, "Can't set device long timeout %d s.",
+                     defs->long_timeout);
+        }
+        if (defs->cleaning >= 0) {
+            add_op(ops, &n, MTSETDRVBUFFER, MT_ST_SET_CLN | defs->cleaning);
+            snprintf(ops[n - 1].msg, 80, "Can't set cleaning request parameter to %x",
+                     defs->cleaning);
+        }
+    }
+
+    clear_set[0] = clear_set[1] = 0;
+    if (defs->nowait >= 0)
+        clear_set[defs->nowait != 0] |= MT_ST_NOWAIT;
+    if (defs->weof_nowait >= 0)
+        clear_set[defs->weof_nowait != 0] |= MT_ST_NOWAIT_EOF;
+    if (defs->sili >= 0)
+        clear_set[defs->sili != 0] |= MT_ST_SILI;
+    if (m->buffer_writes >= 0)
+        clear_set[m->buffer_writes != 0] |= MT_ST_BUFFER_WRITES;
+    if (m->async_writes >= 0)
+        clear_set[m->async_writes != 0] |= MT_ST_ASYNC_WRITES;
+    if (m->read_ahead >= 0)
+        clear_set[m->read_ahead != 0] |= MT_ST_READ_AHEAD;
+    if (m->two_fm >= 0)
+        clear_set[m->two_fm != 0] |= MT_ST_TWO_FM;
+    if (m->fast_eod >= 0)
+        clear_set[m->fast_eod != 0] |= MT_ST_FAST_MTEOM;
+    if (m->auto_lock >= 0)
+        clear_set[m->auto_lock != 0] |= MT_ST_AUTO_LOCK;
+    if (m->can_bsr >= 0)
+        clear_set[m->can_bsr != 0] |= MT_ST_CAN_BSR;
+    if (m->no_blklimits >= 0)
+        clear_set[m->no_blklimits != 0] |= MT_ST_NO_BLKLIMS;
+    if (m->can_partitions >= 0)
+        clear_set[m->can_partitions != 0] |= MT_ST_CAN_PARTITIONS;
+    if (m->scsi2logical >= 0)
+        clear_set[m->scsi2logical != 0] |= MT_ST_SCSI2LOGICAL;
+    if (m->sysv >= 0)
+        clear_set[m->sysv != 0] |= MT_ST_SYSV;
+    if (m->defs_for_writes >= 0)
+        clear_set[m->defs_for_writes != 0] |= MT_ST_DEF_WRITES;
+
+    if (st->known)
+        st->options = (st->options & ~drive[0]) | drive[1];
+    drive[0] = (drive[0] & ~clear_set[1]) | (clear_set[0] & DRIVE_OPTIONS);
+    drive[1] = (drive[1] & ~clear_set[0]) | (clear_set[1] & DRIVE_OPTIONS);
+
+    /* Only the options that are not already as wanted */
+    if (st->known) {
+        unknown = ~SHOWN_OPTIONS;
+        if (clear_set[0] != 0 && (clear_set[0] &= st->options | unknown) == 0)
+            (*skipped)++;
+        if (clear_set[1] != 0 && (clear_set[1] &= ~st->options | unknown) == 0)
+            (*skipped)++;
+    }
+    if (clear_set[0] != 0) {
+        add_op(ops, &n, MTSETDRVBUFFER, MT_ST_CLEARBOOLEANS | clear_set[0]);
+        snprintf(ops[n - 1].msg, 80, "Can't clear the tape options (bits 0x%x, mode %d).",
+                 clear_set[0], i);
+    }
+    if (clear_set[1] != 0) {
+        add_op(ops, &n, MTSETDRVBUFFER, MT_ST_SETBOOLEANS | clear_set[1]);
+        snprintf(ops[n - 1].msg, 80, "Can't set the tape options (bits 0x%x, mode %d).",
+                 clear_set[1], i);
     }
 
-    if (dvd == NULL && !stat(DEVFS_PATH, &statbuf)) {
-        if (S_ISDIR(statbuf.st_mode) && (dirp = opendir(DEVFS_PATH)) != NULL) {
-            /* Assume devfs, one directory for each tape */
-            for (; (dent = readdir(dirp)) != NULL;) {
-                if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
-                    continue;
-                snprintf(tmpdevdirs[tmpdevdirsindex].dir,
-                         sizeof(tmpdevdirs[tmpdevdirsindex].dir), "%s/%s",
-                         DEVFS_PATH, dent->d_name);
-                tmpdevdirs[tmpdevdirsindex].selective_scan = FALSE;
-                if (++tmpdevdirsindex == MAX_TAPES)
-                    break;
-            }
-            tmpdevdirs[tmpdevdirsindex].dir[0] = 0;
-            closedir(dirp);
-            dvd = &tmpdevdirs[0];
-        }
+    if (m->blocksize >= 0) {
+        if (!st->known || st->blocksize != shown_default(m->blocksize, ~MT_ST_OPTIONS)) {
+            add_op(ops, &n, MTSETDRVBUFFER, MT_ST_DEF_BLKSIZE | m->blocksize);
+            snprintf(ops[n - 1].msg, 80, "Can't set blocksize %d for mode %d.", m->blocksize,
+                     i);
+        } else
+            (*skipped)++;
+    }
+    if (m->density >= 0) {
+        if (!st->known || st->density != shown_default(m->density, 0xff)) {
+            add_op(ops, &n, MTSETDRVBUFFER, MT_ST_DEF_DENSITY | m->density);
+            snprintf(ops[n - 1].msg, 80, "Can't set density %x for mode %d.", m->density, i);
+        } else
+            (*skipped)++;
+    }
+    if (m->compression >= 0) {
+        if (!st->known || st->compression != shown_default(m->compression, 1)) {
+            add_op(ops, &n, MTSETDRVBUFFER, MT_ST_DEF_COMPRESSION | m->compression);
+            snprintf(ops[n - 1].msg, 80, "Can't set compression %d for mode %d.",
+                     m->compression, i);
+        } else
+            (*skipped)++;
     }
-    if (dvd == NULL)
-        dvd = devdirs;
+    return n;
+}
+
+
+/* Set the definitions of the modes of a drive. The current settings
+   are read from sysfs first, and only the ioctls that change something
+   are issued; a mode that is already as defined is not opened. */
+static int set_defs(devdef_tr *defs, drive_tr *d)
+{
+    int i, j, tape, fails = 0, issued = 0, skipped = 0;
+    int nops[NBR_MODES], drive[2] = { 0, 0 };
+    pending_tr ops[NBR_MODES][MAX_PENDING];
+    modestate_tr st;
 
-    for (found = 0, dvp = dvd; found < NBR_MODES && dvp->dir[0] != 0; dvp++) {
-        dn = dvp->dir;
-        if ((dirp = opendir(dn)) == NULL)
+    for (i = 0; i < NBR_MODES; i++) {
+        nops[i] = 0;
+        if (!defs->modedefs[i].defined)
             continue;
+        read_mode_state(d->tapeno, i, &st);
+        nops[i] = plan_mode(defs, i, &st, ops[i], &skipped, drive);
+        issued += nops[i];
+    }
+    if (issued > 0 && !drive_devfiles(d))
+        return FALSE;
 
-        for (; (dent = readdir(dirp)) != NULL;) {
-            if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
-                continue;
-            /* Ignore non-tape devices to avoid loading all the modules */
-            if (dvp->selective_scan && !accept_tape_name(dent->d_name))
-                continue;
-            strcpy(tmpname, dn);
-            strcat(tmpname, "/");
-            strcat(tmpname, dent->d_name);
-            if (stat(tmpname, &statbuf) != 0) {
-                fprintf(stderr, "Can't stat '%s'.\n", tmpname);
-                continue;
+    for (i = 0, issued = 0; i < NBR_MODES; i++) {
+        if (nops[i] == 0 || *d->fnames[i] == '\0')
+            continue;
+
+        if ((tape = open(d->fnames[i], O_RDONLY | O_NONBLOCK)) < 0) {
+            fprintf(stderr, "Can't open the tape device '%s' for mode %d.\n", d->fnames[i], i);
+            return FALSE;
+        }
+        for (j = 0; j < nops[i]; j++, issued++)
+            if (ioctl(tape, MTIOCTOP, &ops[i][j].op) != 0) {
+                fails++;
+                if (ops[i][j].op.mt_op == MTREW)
+                    fprintf(stderr, "Rewind of %s fails.\n", d->fnames[i]);
+                else
+                    fprintf(stderr, "%s\n", ops[i][j].msg);
             }
-            if (!S_ISCHR(statbuf.st_mode) || major(statbuf.st_rdev) != SCSI_TAPE_MAJOR)
-                continue;
-            dev = minor(statbuf.st_rdev);
-            if ((dev & 31) != tapeno)
-                continue;
-            mode = (dev & 127) >> 5;
-            if (non_rew[mode])
-                continue;
-            if (*names[mode] == '\0')
-                found++;
-            strcpy(names[mode], tmpname);
-            non_rew[mode] = (dev & 128) != 0;
+        close(tape);
+    }
+    if (verbose > 0)
+        printf("Issued %d ioctl%s, skipped %d already in effect.\n", issued,
+               issued != 1 ? "s" : "", skipped);
+    return (fails == 0);
+}
+
+
+/* Find the device files of a tape and add it to the list of drives */
+static int add_drive(drive_tr **drives, int *ndrives, int *maxdrives, int tapeno, char *arg,
+                     int print_non_found)
+{
+    int i;
+    drive_tr *d;
+
+    for (i = 0; i < *ndrives; i++)
+        if ((*drives)[i].tapeno == tapeno)
+            return TRUE;
+    if (*ndrives == *maxdrives) {
+        *maxdrives = *maxdrives ? *maxdrives * 2 : 16;
+        if ((d = realloc(*drives, *maxdrives * sizeof(drive_tr))) == NULL) {
+            fprintf(stderr, "Can't allocate the drive list.\n");
+            return FALSE;
         }
-        closedir(dirp);
+        *drives = d;
     }
+    d = &(*drives)[*ndrives];
+    memset(d, 0, sizeof(drive_tr));
+    d->tapeno = tapeno;
+    d->arg = arg;
+    d->pid = -1;
 
-    return (found > 0);
+    if ((d->fnames[0] = calloc(NBR_MODES, PATH_MAX)) == NULL) {
+        fprintf(stderr, "Can't allocate name buffers.\n");
+        return FALSE;
+    }
+    for (i = 1; i < NBR_MODES; i++)
+        d->fnames[i] = d->fnames[i - 1] + PATH_MAX;
+
+    if (!find_devfiles(tapeno, d->fnames) || *d->fnames[0] == '\0') {
+        if (print_non_found)
+            fprintf(stderr, "Can't find any device files for tape %d.\n", tapeno);
+        free(d->fnames[0]);
+        return FALSE;
+    }
+    (*ndrives)++;
+    return TRUE;
 }
 
 
-static int set_defs(devdef_tr *defs, char **fnames)
+static int define_tape(drive_tr *d, devdef_tr *defptr, int print_non_found)
 {
-    int i, tape, fails;
-    int clear_set[2];
-    struct mtop op;
+    int i;
+    char company[10], product[20], rev[5], *tname;
 
-    for (i = fails = 0; i < NBR_MODES; i++) {
-        if (*fnames[i] == '\0' || !defs->modedefs[i].defined)
-            continue;
+    if (verbose > 0)
+        printf("\nstinit, processing tape %d\n", d->tapeno);
+    if (verbose > 1 && *d->fnames[0] != '\0')
+        for (i = 0; i < NBR_MODES; i++)
+            printf("Mode %d, name '%s'\n", i + 1, d->fnames[i]);
 
-        if ((tape = open(fnames[i], O_RDONLY | O_NONBLOCK)) < 0) {
-            fprintf(stderr, "Can't open the tape device '%s' for mode %d.\n",
-                    fnames[i], i);
+    if (d->devpath != NULL && read_attr(d->devpath, "vendor", company, sizeof(company)) &&
+        read_attr(d->devpath, "model", product, sizeof(product)) &&
+        read_attr(d->devpath, "rev", rev, sizeof(rev))) {
+        if (verbose > 1)
+            printf("Inquiry data from '%s%s/device'.\n", sysfs_root, d->devpath);
+    } else {
+        if (!drive_devfiles(d))
             return FALSE;
-        }
+        tname = d->fnames[0];
+        if (!do_inquiry(tname, company, product, rev, print_non_found))
+            return FALSE;
+    }
+    if (verbose > 0)
+        printf("The manufacturer is '%s', product is '%s', and revision "
+               "'%s'.\n",
+               company, product, rev);
 
-        if (i == 0) {
-            if (defs->do_rewind) {
-                op.mt_op = MTREW;
-                op.mt_count = 1;
-                if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                    fails++;
-                    fprintf(stderr, "Rewind of %s fails.\n", fnames[i]);
-                }
-            }
+    if (!find_pars(company, product, rev, defptr)) {
+        fprintf(stderr, "Can't find defaults for tape number %d.\n", d->tapeno);
+        return FALSE;
+    }
 
-            if (defs->drive_buffering >= 0) {
-                op.mt_op = MTSETDRVBUFFER;
-                op.mt_count = MT_ST_DEF_DRVBUFFER | defs->drive_buffering;
-                if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                    fails++;
-                    fprintf(stderr, "Can't set drive buffering to %d.\n", defs->drive_buffering);
-                }
-            }
+    return set_defs(defptr, d);
+}
 
-            if (defs->timeout >= 0) {
-                op.mt_op = MTSETDRVBUFFER;
-                op.mt_count = MT_ST_SET_TIMEOUT | defs->timeout;
-                if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                    fails++;
-                    fprintf(stderr, "Can't set device timeout %d s.\n", defs->timeout);
-                }
-            }
 
-            if (defs->long_timeout >= 0) {
-                op.mt_op = MTSETDRVBUFFER;
-                op.mt_count = MT_ST_SET_LONG_TIMEOUT | defs->long_timeout;
-                if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                    fails++;
-                    fprintf(stderr, "Can't set device long timeout %d s.\n",
-                            defs->long_timeout);
-                }
-            }
+/* Start the child process for a drive, its output going to temporary files */
+static void start_drive(drive_tr *d, devdef_tr *defptr, int print_non_found)
+{
+    int ok;
 
-            if (defs->cleaning >= 0) {
-                op.mt_op = MTSETDRVBUFFER;
-                op.mt_count = MT_ST_SET_CLN | defs->cleaning;
-                if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                    fails++;
-                    fprintf(stderr, "Can't set cleaning request parameter to %x\n",
-                            defs->cleaning);
-                }
+    clock_gettime(CLOCK_MONOTONIC, &d->started);
+    d->state = DRIVE_FAILED;
+    if ((d->out = tmpfile()) == NULL || (d->err = tmpfile()) == NULL) {
+        perror("stinit: tmpfile");
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if ((d->pid = fork()) < 0) {
+        perror("stinit: fork");
+        return;
+    }
+    if (d->pid == 0) {
+        if (dup2(fileno(d->out), 1) < 0 || dup2(fileno(d->err), 2) < 0)
+            _exit(1);
+        /* Keep the messages written before a timeout */
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        ok = define_tape(d, defptr, print_non_found);
+        scsi_print_stats();
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ok ? 0 : 1);
+    }
+    d->state = DRIVE_RUNNING;
+}
+
+
+static void copy_output(FILE *from, FILE *to)
+{
+    char buf[4096];
+    size_t n;
+
+    if (from == NULL)
+        return;
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+        if (fwrite(buf, 1, n, to) != n)
+            break;
+    fclose(from);
+    fflush(to);
+}
+
+
+/* Print the messages of a drive that has finished */
+static void print_drive(drive_tr *d, int deadline)
+{
+    copy_output(d->out, stdout);
+    copy_output(d->err, stderr);
+    d->out = d->err = NULL;
+    if (d->state == DRIVE_TIMEOUT)
+        fprintf(stderr, "Tape %d did not finish in %d s.\n", d->tapeno, deadline);
+    if (d->state != DRIVE_OK && d->arg != NULL)
+        fprintf(stderr, "Definition for '%s' failed.\n", d->arg);
+}
+
+
+/* Note the drives among the first n that have finished. Returns the
+   number of them. */
+static int reap_drives(drive_tr *drives, int n)
+{
+    int i, status, done = 0;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (i = 0; i < n; i++)
+            if (drives[i].pid == pid && drives[i].state == DRIVE_RUNNING) {
+                drives[i].state = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? DRIVE_OK
+                                                                                : DRIVE_FAILED;
+                drives[i].elapsed = seconds_since(&drives[i].started);
+                done++;
+                break;
             }
+    return done;
+}
+
+
+/* Abandon the drives among the first n that have not finished within
+   deadline seconds (0 for none). Returns the number of them; wait is set
+   to the seconds until the next deadline, or -1 if there is none. */
+static int expire_drives(drive_tr *drives, int n, int deadline, double *wait)
+{
+    int i, expired = 0;
+    double left;
+
+    *wait = -1.0;
+    for (i = 0; i < n; i++) {
+        if (drives[i].state != DRIVE_RUNNING || deadline <= 0)
+            continue;
+        if ((left = deadline - seconds_since(&drives[i].started)) <= 0) {
+            kill(drives[i].pid, SIGKILL);
+            drives[i].state = DRIVE_TIMEOUT;
+            drives[i].elapsed = deadline;
+            expired++;
+        } else if (*wait < 0 || left < *wait)
+            *wait = left;
+    }
+    return expired;
+}
+
+
+static void print_result(drive_tr *d)
+{
+    fprintf(stderr, "Tape %d (%s): %s (%.1f s).\n", d->tapeno,
+            *d->fnames[0] != '\0' ? d->fnames[0]
+            : d->devname != NULL  ? d->devname
+                                  : d->devpath,
+            d->state == DRIVE_OK        ? "initialized"
+            : d->state == DRIVE_TIMEOUT ? "timed out"
+                                        : "failed",
+            d->elapsed);
+}
+
+
+/* Initialize the drives in child processes, at most jobs (0 for no
+   limit) at a time. A drive that has not finished within deadline
+   seconds (0 for none) is abandoned. The messages are printed in the
+   order of the drives, as soon as the earlier drives have finished.
+   Returns the number of drives initialized. */
+static int run_drives(drive_tr *drives, int n, int jobs, int deadline, devdef_tr *defptr,
+                      int print_non_found)
+{
+    int i, next, running, printed, nok = 0;
+    double wait;
+    sigset_t chld;
+    struct timespec ts;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+
+    for (next = running = printed = 0; printed < n;) {
+        for (; next < n && (jobs <= 0 || running < jobs); next++) {
+            start_drive(&drives[next], defptr, print_non_found);
+            if (drives[next].state == DRIVE_RUNNING)
+                running++;
         }
 
-        op.mt_op = MTSETDRVBUFFER;
-
-        clear_set[0] = clear_set[1] = 0;
-        if (defs->nowait >= 0)
-            clear_set[defs->nowait != 0] |= MT_ST_NOWAIT;
-        if (defs->weof_nowait >= 0)
-            clear_set[defs->weof_nowait != 0] |= MT_ST_NOWAIT_EOF;
-        if (defs->sili >= 0)
-            clear_set[defs->sili != 0] |= MT_ST_SILI;
-        if (defs->modedefs[i].buffer_writes >= 0)
-            clear_set[defs->modedefs[i].buffer_writes != 0] |= MT_ST_BUFFER_WRITES;
-        if (defs->modedefs[i].async_writes >= 0)
-            clear_set[defs->modedefs[i].async_writes != 0] |= MT_ST_ASYNC_WRITES;
-        if (defs->modedefs[i].read_ahead >= 0)
-            clear_set[defs->modedefs[i].read_ahead != 0] |= MT_ST_READ_AHEAD;
-        if (defs->modedefs[i].two_fm >= 0)
-            clear_set[defs->modedefs[i].two_fm != 0] |= MT_ST_TWO_FM;
-        if (defs->modedefs[i].fast_eod >= 0)
-            clear_set[defs->modedefs[i].fast_eod != 0] |= MT_ST_FAST_MTEOM;
-        if (defs->modedefs[i].auto_lock >= 0)
-            clear_set[defs->modedefs[i].auto_lock != 0] |= MT_ST_AUTO_LOCK;
-        if (defs->modedefs[i].can_bsr >= 0)
-            clear_set[defs->modedefs[i].can_bsr != 0] |= MT_ST_CAN_BSR;
-        if (defs->modedefs[i].no_blklimits >= 0)
-            clear_set[defs->modedefs[i].no_blklimits != 0] |= MT_ST_NO_BLKLIMS;
-        if (defs->modedefs[i].can_partitions >= 0)
-            clear_set[defs->modedefs[i].can_partitions != 0] |= MT_ST_CAN_PARTITIONS;
-        if (defs->modedefs[i].scsi2logical >= 0)
-            clear_set[defs->modedefs[i].scsi2logical != 0] |= MT_ST_SCSI2LOGICAL;
-        if (defs->modedefs[i].sysv >= 0)
-            clear_set[defs->modedefs[i].sysv != 0] |= MT_ST_SYSV;
-        if (defs->modedefs[i].defs_for_writes >= 0)
-            clear_set[defs->modedefs[i].defs_for_writes != 0] |= MT_ST_DEF_WRITES;
-
-        if (clear_set[0] != 0) {
-            op.mt_count = MT_ST_CLEARBOOLEANS | clear_set[0];
-            if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                fails++;
-                fprintf(stderr, "Can't clear the tape options (bits 0x%x, mode %d).\n",
-                        clear_set[0], i);
-            }
+        running -= reap_drives(drives, next);
+        running -= expire_drives(drives, next, deadline, &wait);
+
+        for (; printed < n && drives[printed].state >= DRIVE_OK; printed++) {
+            print_drive(&drives[printed], deadline);
+            if (drives[printed].state == DRIVE_OK)
+                nok++;
         }
-        if (clear_set[1] != 0) {
-            op.mt_count = MT_ST_SETBOOLEANS | clear_set[1];
-            if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                fails++;
-                fprintf(stderr, "Can't set the tape options (bits 0x%x, mode %d).\n",
-                        clear_set[1], i);
-            }
+        if (printed == n || (next < n && (jobs <= 0 || running < jobs)))
+            continue;
+
+        /* Wait for a drive to finish or a deadline to pass */
+        if (wait < 0)
+            sigwaitinfo(&chld, NULL);
+        else {
+            ts.tv_sec = (time_t)wait;
+            ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+            sigtimedwait(&chld, NULL, &ts);
         }
+    }
+    sigprocmask(SIG_UNBLOCK, &chld, NULL);
 
-        if (defs->modedefs[i].blocksize >= 0) {
-            op.mt_count = MT_ST_DEF_BLKSIZE | defs->modedefs[i].blocksize;
-            if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                fails++;
-                fprintf(stderr, "Can't set blocksize %d for mode %d.\n",
-                        defs->modedefs[i].blocksize, i);
+    if (verbose > 0 || n > 1)
+        for (i = 0; i < n; i++)
+            print_result(&drives[i]);
+    return nok;
+}
+
+
+/*** Watching for new drives ***/
+
+#define COALESCE_MS 50 /* events for a drive closer than this are one */
+#define UEVENT_BUFSIZE 8192
+#define UEVENT_RCVBUF (1024 * 1024)
+
+typedef struct {
+    char action[16], subsystem[32];
+    char devpath[PATH_MAX], devname[PATH_MAX];
+} uevent_tr;
+
+/* A drive whose events have not ended yet */
+typedef struct {
+    uevent_tr ev; /* the first event */
+    int tapeno;
+    struct timespec due;
+} hotplug_tr;
+
+static struct {
+    hotplug_tr *drives;
+    int n, max;
+} hotplugs;
+
+/* The drives being initialized, in the order they were started */
+static struct {
+    drive_tr *drives;
+    int n, max;
+    int next; /* the first one not started yet */
+    int running;
+} watched;
+
+
+static void uevent_field(uevent_tr *ev, char *field)
+{
+    if (!strncmp(field, "ACTION=", 7))
+        snprintf(ev->action, sizeof(ev->action), "%s", field + 7);
+    else if (!strncmp(field, "SUBSYSTEM=", 10))
+        snprintf(ev->subsystem, sizeof(ev->subsystem), "%s", field + 10);
+    else if (!strncmp(field, "DEVPATH=", 8))
+        snprintf(ev->devpath, sizeof(ev->devpath), "%s", field + 8);
+    else if (!strncmp(field, "DEVNAME=", 8))
+        snprintf(ev->devname, sizeof(ev->devname), "%s%s", *(field + 8) == '/' ? "" : "/dev/",
+                 field + 8);
+}
+
+
+/* Remember the drive of an event, or move its initialization later if
+   it has already had events */
+static void queue_event(uevent_tr *ev)
+{
+    char *cp;
+    int i, tapeno;
+    hotplug_tr *h;
+
+    if (strcmp(ev->subsystem, "scsi_tape") ||
+        (strcmp(ev->action, "add") && strcmp(ev->action, "change")) ||
+        (cp = strrchr(ev->devpath, '/')) == NULL || (tapeno = class_tapeno(cp + 1)) < 0)
+        return;
+    if (verbose > 1)
+        printf("Event '%s' for tape %d (%s).\n", ev->action, tapeno, cp + 1);
+
+    for (i = 0; i < hotplugs.n && hotplugs.drives[i].tapeno != tapeno; i++)
+        ;
+    if (i == hotplugs.n) {
+        if (hotplugs.n == hotplugs.max) {
+            hotplugs.max = hotplugs.max ? hotplugs.max * 2 : 16;
+            if ((h = realloc(hotplugs.drives, hotplugs.max * sizeof(hotplug_tr))) == NULL) {
+                fprintf(stderr, "Can't allocate the drive list.\n");
+                return;
             }
+            hotplugs.drives = h;
         }
-        if (defs->modedefs[i].density >= 0) {
-            op.mt_count = MT_ST_DEF_DENSITY | defs->modedefs[i].density;
-            if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                fails++;
-                fprintf(stderr, "Can't set density %x for mode %d.\n",
-                        defs->modedefs[i].density, i);
-            }
+        hotplugs.drives[i].ev = *ev;
+        hotplugs.drives[i].tapeno = tapeno;
+        hotplugs.n++;
+    }
+    h = &hotplugs.drives[i];
+    clock_gettime(CLOCK_MONOTONIC, &h->due);
+    h->due.tv_nsec += COALESCE_MS * 1000000L;
+    if (h->due.tv_nsec >= 1000000000L) {
+        h->due.tv_sec++;
+        h->due.tv_nsec -= 1000000000L;
+    }
+}
+
+
+/* The tape of a drive being initialized */
+static int tape_busy(int tapeno)
+{
+    int i;
+
+    for (i = 0; i < watched.n; i++)
+        if (watched.drives[i].tapeno == tapeno && watched.drives[i].state < DRIVE_OK)
+            return TRUE;
+    return FALSE;
+}
+
+
+/* Start the drives whose events have ended, or all of them, unless the
+   same tape is still being initialized. Returns the number of drives
+   that could not be set up. */
+static int start_hotplugs(devdef_tr *defptr, int jobs, int all)
+{
+    int i, j, max, failed = 0;
+    drive_tr *d;
+    hotplug_tr *h;
+
+    for (i = j = 0; i < hotplugs.n; i++) {
+        h = &hotplugs.drives[i];
+        if ((!all && seconds_since(&h->due) < 0) || tape_busy(h->tapeno)) {
+            hotplugs.drives[j++] = *h;
+            continue;
         }
-        if (defs->modedefs[i].compression >= 0) {
-            op.mt_count = MT_ST_DEF_COMPRESSION | defs->modedefs[i].compression;
-            if (ioctl(tape, MTIOCTOP, &op) != 0) {
-                fails++;
-                fprintf(stderr, "Can't set compression %d for mode %d.\n",
-                        defs->modedefs[i].compression, i);
+        if (watched.n == watched.max) {
+            max = watched.max ? watched.max * 2 : 16;
+            if ((d = realloc(watched.drives, max * sizeof(drive_tr))) == NULL) {
+                fprintf(stderr, "Can't allocate the drive list.\n");
+                failed++;
+                continue;
             }
+            watched.drives = d;
+            watched.max = max;
         }
+        if (setup_drive(&watched.drives[watched.n], h->ev.devpath,
+                        *h->ev.devname ? h->ev.devname : NULL))
+            watched.n++;
+        else
+            failed++;
+    }
+    hotplugs.n = j;
 
-        close(tape);
+    for (; watched.next < watched.n && (jobs <= 0 || watched.running < jobs); watched.next++) {
+        d = &watched.drives[watched.next];
+        start_drive(d, defptr, TRUE);
+        if (d->state == DRIVE_RUNNING)
+            watched.running++;
     }
-    return (fails == 0);
+    fflush(stdout);
+    return failed;
+}
+
+
+/* Print the drives that have finished or passed the deadline, as soon
+   as they do. Returns the number of drives that failed; wait is set to
+   the seconds until the next deadline, or -1. */
+static int finish_hotplugs(int deadline, double *wait)
+{
+    int i, j, failed = 0;
+    drive_tr *d;
+
+    watched.running -= reap_drives(watched.drives, watched.next);
+    watched.running -= expire_drives(watched.drives, watched.next, deadline, wait);
+    for (i = j = 0; i < watched.n; i++) {
+        d = &watched.drives[i];
+        if (d->state < DRIVE_OK) {
+            watched.drives[j++] = *d;
+            continue;
+        }
+        print_drive(d, deadline);
+        if (verbose > 0 || d->state != DRIVE_OK)
+            print_result(d);
+        if (d->state != DRIVE_OK)
+            failed++;
+        free(d->fnames[0]);
+        free(d->devpath);
+        free(d->devname);
+        if (i < watched.next)
+            watched.next--;
+    }
+    watched.n = j;
+    fflush(stdout);
+    return failed;
 }
 
 
-static int define_tape(int tapeno, FILE *dbf, devdef_tr *defptr, int print_non_found)
+/* The time until the next drive is due, in ms, or -1 if none. The tapes
+   still being initialized wait for their child to end. */
+static int next_hotplug(void)
 {
     int i;
-    char company[10], product[20], rev[5], *tname, *fnames[NBR_MODES];
+    double left, wait = -1.0;
 
-    if (verbose > 0)
-        printf("\nstinit, processing tape %d\n", tapeno);
+    for (i = 0; i < hotplugs.n; i++) {
+        if (tape_busy(hotplugs.drives[i].tapeno))
+            continue;
+        left = -seconds_since(&hotplugs.drives[i].due) * 1000;
+        if (left < 0)
+            left = 0;
+        if (wait < 0 || left < wait)
+            wait = left;
+    }
+    return wait < 0 ? (-1) : (int)wait + 1;
+}
 
-    if ((fnames[0] = calloc(NBR_MODES, PATH_MAX)) == NULL) {
-        fprintf(stderr, "Can't allocate name buffers.\n");
-        return FALSE;
+
+/* Initialize all the tapes the kernel knows, after its events were lost */
+static void resync_tapes(void)
+{
+    int i, n, *tapenos;
+    uevent_tr ev;
+
+    fprintf(stderr, "stinit: kernel events were lost, initializing all the tapes.\n");
+    if ((n = find_tapes(&tapenos)) < 0)
+        return;
+    for (i = 0; i < n; i++) {
+        memset(&ev, 0, sizeof(ev));
+        strcpy(ev.action, "add");
+        strcpy(ev.subsystem, "scsi_tape");
+        snprintf(ev.devpath, sizeof(ev.devpath), "/class/scsi_tape/st%d", tapenos[i]);
+        queue_event(&ev);
     }
-    for (i = 1; i < NBR_MODES; i++)
-        fnames[i] = fnames[i - 1] + PATH_MAX;
+    free(tapenos);
+}
 
-    if (!find_devfiles(tapeno, fnames) || *fnames[0] == '\0') {
-        if (print_non_found)
-            fprintf(stderr, "Can't find any device files for tape %d.\n", tapeno);
-        free(fnames[0]);
-        return FALSE;
+
+static int open_uevents(char *events)
+{
+    int fd, size = UEVENT_RCVBUF;
+    struct sockaddr_nl addr;
+
+    if (events != NULL) {
+        if (!strcmp(events, "-"))
+            return 0;
+        if ((fd = open(events, O_RDONLY)) < 0)
+            fprintf(stderr, "Can't open the event file '%s'.\n", events);
+        return fd;
     }
-    if (verbose > 1)
-        for (i = 0; i < NBR_MODES; i++)
-            printf("Mode %d, name '%s'\n", i + 1, fnames[i]);
+    if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) < 0) {
+        perror("stinit: uevent socket");
+        return (-1);
+    }
+    /* Room for the burst of events of a library coming online */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* the kernel events */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("stinit: uevent socket");
+        close(fd);
+        return (-1);
+    }
+    return fd;
+}
+
 
-    tname = fnames[0];
-    if (!do_inquiry(tname, company, product, rev, print_non_found)) {
-        free(fnames[0]);
+/* Initialize the tapes appearing, as told by the kernel uevents or, for
+   testing, by the events in a file with one KEY=value per line and an
+   empty or action@devpath line between the events. The events for a
+   drive are collected until there have been none for COALESCE_MS, and
+   then the drive is initialized like with --udev in a child process.
+   The events are read while the children run, so that a slow drive does
+   not hold up the others. The events of a file are all read before the
+   drives are initialized. Returns FALSE if something failed. */
+static int watch_tapes(char *events, devdef_tr *defptr, int jobs, int deadline)
+{
+    int fd, sfd, n, timeout, failed = 0;
+    char buf[UEVENT_BUFSIZE + 1], *cp, *nl;
+    size_t len = 0;
+    ssize_t got;
+    double wait;
+    uevent_tr ev;
+    struct pollfd pfd[2];
+    struct sockaddr_nl addr;
+    struct signalfd_siginfo si;
+    socklen_t addrlen;
+    sigset_t chld;
+    struct timespec ts;
+
+    if ((fd = open_uevents(events)) < 0)
+        return FALSE;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld, NULL) < 0 ||
+        (sfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("stinit: signalfd");
+        if (fd > 0)
+            close(fd);
         return FALSE;
     }
     if (verbose > 0)
-        printf("The manufacturer is '%s', product is '%s', and revision "
-               "'%s'.\n",
-               company, product, rev);
+        printf("Watching %s for new tapes.\n", events != NULL ? events : "the kernel uevents");
+    fflush(stdout);
+    memset(&ev, 0, sizeof(ev));
+    for (;;) {
+        failed += start_hotplugs(defptr, jobs, fd < 0);
+        failed += finish_hotplugs(deadline, &wait);
+        if (fd < 0 && hotplugs.n == 0 && watched.n == 0)
+            break;
+        if (watched.next < watched.n && (jobs <= 0 || watched.running < jobs))
+            continue; /* a drive has finished and another one can start */
+
+        timeout = next_hotplug();
+        if (wait >= 0 && (timeout < 0 || wait * 1000 + 1 < timeout))
+            timeout = (int)(wait * 1000) + 1;
+        pfd[0].fd = sfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = fd; /* ignored when the event file has ended */
+        pfd[1].events = POLLIN;
+        if ((n = poll(pfd, 2, timeout)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("stinit: poll");
+            break;
+        }
+        if (pfd[0].revents & POLLIN)
+            while (read(sfd, &si, sizeof(si)) == sizeof(si))
+                ;
+        if (fd < 0 || !(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
 
-    if (!find_pars(dbf, company, product, rev, defptr, FALSE)) {
-        fprintf(stderr, "Can't find defaults for tape number %d.\n", tapeno);
-        free(fnames[0]);
-        return FALSE;
+        if (events == NULL) {
+            addrlen = sizeof(addr);
+            got = recvfrom(fd, buf, UEVENT_BUFSIZE, 0, (struct sockaddr *)&addr, &addrlen);
+            if (got < 0 && errno == ENOBUFS)
+                resync_tapes();
+            else if (got < 0 && errno != EINTR && errno != EAGAIN) {
+                perror("stinit: reading the uevents");
+                break;
+            } else if (got > 0 && addr.nl_pid == 0) { /* only the kernel */
+                buf[got] = '\0';
+                memset(&ev, 0, sizeof(ev));
+                for (cp = buf; cp < buf + got; cp += strlen(cp) + 1)
+                    uevent_field(&ev, cp);
+                queue_event(&ev);
+            }
+            continue;
+        }
+        if ((got = read(fd, buf + len, UEVENT_BUFSIZE - len)) <= 0) {
+            if (got < 0)
+                perror("stinit: reading the events");
+            buf[len] = '\0';
+            uevent_field(&ev, buf);
+            queue_event(&ev);
+            if (fd > 0)
+                close(fd);
+            fd = -1;
+            continue;
+        }
+        len += got;
+        buf[len] = '\0';
+        for (cp = buf; (nl = strchr(cp, '\n')) != NULL; cp = nl + 1) {
+            *nl = '\0';
+            if (*cp == '\0' || (strchr(cp, '@') != NULL && strchr(cp, '=') == NULL)) {
+                queue_event(&ev);
+                memset(&ev, 0, sizeof(ev));
+            } else
+                uevent_field(&ev, cp);
+        }
+        len = buf + len - cp;
+        memmove(buf, cp, len);
+        if (len == UEVENT_BUFSIZE) /* a line can't be this long */
+            len = 0;
+    }
+    /* Stopped by an error: wait for the drives already started */
+    for (n = watched.next; n < watched.n; n++) {
+        free(watched.drives[n].fnames[0]);
+        free(watched.drives[n].devpath);
+        free(watched.drives[n].devname);
+    }
+    watched.n = watched.next;
+    while ((failed += finish_hotplugs(deadline, &wait), watched.n > 0)) {
+        if (wait < 0)
+            sigwaitinfo(&chld, NULL);
+        else {
+            ts.tv_sec = (time_t)wait;
+            ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+            sigtimedwait(&chld, NULL, &ts);
+        }
     }
+    free(watched.drives);
+    memset(&watched, 0, sizeof(watched));
+    close(sfd);
+    if (fd > 0)
+        close(fd);
+    sigprocmask(SIG_UNBLOCK, &chld, NULL);
+    return failed == 0;
+}
 
-    if (!set_defs(defptr, fnames)) {
-        free(fnames[0]);
-        return FALSE;
+
+/* Print the parameters as they would be given in the database */
+static void print_defs(devdef_tr *defs)
+{
+    int i, n = 0;
+    modepar_tr *m;
+
+    if (defs->drive_buffering >= 0)
+        n += printf("%sdrive-buffering=%d", n ? " " : "", defs->drive_buffering);
+    if (defs->timeout >= 0)
+        n += printf("%stimeout=%d", n ? " " : "", defs->timeout);
+    if (defs->long_timeout >= 0)
+        n += printf("%slong-timeout=%d", n ? " " : "", defs->long_timeout);
+    if (defs->cleaning >= 0)
+        n += printf("%scleaning=0x%x", n ? " " : "", defs->cleaning);
+    if (defs->nowait >= 0)
+        n += printf("%sno-wait=%d", n ? " " : "", defs->nowait);
+    if (defs->weof_nowait >= 0)
+        n += printf("%sweof-no-wait=%d", n ? " " : "", defs->weof_nowait);
+    if (defs->sili >= 0)
+        n += printf("%ssili=%d", n ? " " : "", defs->sili);
+    if (n > 0)
+        printf("\n");
+    for (i = 0; i < NBR_MODES; i++) {
+        m = &defs->modedefs[i];
+        if (!m->defined)
+            continue;
+        printf("mode%d", i + 1);
+        if (m->blocksize >= 0)
+            printf(" blocksize=%d", m->blocksize);
+        if (m->density >= 0)
+            printf(" density=0x%02x", m->density);
+        if (m->buffer_writes >= 0)
+            printf(" buffer-writes=%d", m->buffer_writes);
+        if (m->async_writes >= 0)
+            printf(" async-writes=%d", m->async_writes);
+        if (m->read_ahead >= 0)
+            printf(" read-ahead=%d", m->read_ahead);
+        if (m->two_fm >= 0)
+            printf(" two-fms=%d", m->two_fm);
+        if (m->compression >= 0)
+            printf(" compression=%d", m->compression);
+        if (m->auto_lock >= 0)
+            printf(" auto-lock=%d", m->auto_lock);
+        if (m->fast_eod >= 0)
+            printf(" fast-eom=%d", m->fast_eod);
+        if (m->can_bsr >= 0)
+            printf(" can-bsr=%d", m->can_bsr);
+        if (m->no_blklimits >= 0)
+            printf(" noblklimits=%d", m->no_blklimits);
+        if (m->can_partitions >= 0)
+            printf(" can-partitions=%d", m->can_partitions);
+        if (m->scsi2logical >= 0)
+            printf(" scsi2logical=%d", m->scsi2logical);
+        if (m->sysv >= 0)
+            printf(" sysv=%d", m->sysv);
+        if (m->defs_for_writes >= 0)
+            printf(" defs-for-writes=%d", m->defs_for_writes);
+        printf("\n");
     }
+}
 
-    free(fnames[0]);
-    return TRUE;
+
+/* Print the parameters found for the inquiry data "manuf/model/rev" */
+static int show_match(char *match)
+{
+    char *keys[3], *cp;
+    int i, found;
+    devdef_tr defs;
+    struct timespec t0;
+
+    for (i = 0, cp = match; i < 3; i++) {
+        keys[i] = cp;
+        if (cp != NULL && (cp = strchr(cp, '/')) != NULL)
+            *cp++ = '\0';
+        if (keys[i] == NULL)
+            keys[i] = "";
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    found = find_pars(keys[0], keys[1], keys[2], &defs);
+    if (verbose > 0)
+        printf("Lookup took %.1f us.\n", seconds_since(&t0) * 1e6);
+    if (!found) {
+        fprintf(stderr, "No definitions for ('%s', '%s', '%s').\n", keys[0], keys[1], keys[2]);
+        return 1;
+    }
+    print_defs(&defs);
+    return 0;
 }
 
 
 static char usage(int retval)
 {
-    fprintf(stderr, "Usage: stinit [-h] [-v] [--version] [-f dbname] [-p] [-r] "
+    fprintf(stderr, "Usage: stinit [-h] [-v] [--version] [-f dbname] [-p] [-r] [-j jobs] "
+                    "[-t seconds] [--sysfs dir] [--match manuf/model/rev] [--udev] [--watch] "
+                    "[--events file] "
                     "[drivename_or_number ...]\n");
     exit(retval);
 }
@@ -887,12 +2705,14 @@ static char usage(int retval)
 
 int main(int argc, char **argv)
 {
-    FILE *dbf = NULL;
     int argn, retval = 0;
-    int tapeno, parse_only = FALSE;
-    char *dbname = NULL;
+    int tapeno, parse_only = FALSE, udev = FALSE, watch = FALSE;
+    int i, ndrives = 0, maxdrives = 0, jobs = 0, deadline = DEF_DEADLINE, nok;
+    int ntapes, *tapenos;
+    char *dbname = NULL, *match = NULL, *events = NULL;
     char *convp;
     devdef_tr defs;
+    drive_tr *drives = NULL;
 
     defs.do_rewind = FALSE;
     for (argn = 1; argn < argc && *argv[argn] == '-'; argn++) {
@@ -909,6 +2729,34 @@ int main(int argc, char **argv)
             if (argn >= argc)
                 usage(1);
             dbname = argv[argn];
+        } else if (*(argv[argn] + 1) == 'j' || *(argv[argn] + 1) == 't') {
+            argn += 1;
+            if (argn >= argc || !isdigit(*argv[argn]))
+                usage(1);
+            if (*(argv[argn - 1] + 1) == 'j')
+                jobs = strtol(argv[argn], &convp, 10);
+            else
+                deadline = strtol(argv[argn], &convp, 10);
+            if (*convp != '\0')
+                usage(1);
+        } else if (!strcmp(argv[argn], "--sysfs") || !strcmp(argv[argn], "--match")) {
+            argn += 1;
+            if (argn >= argc)
+                usage(1);
+            if (argv[argn - 1][2] == 's')
+                sysfs_root = argv[argn];
+            else
+                match = argv[argn];
+        } else if (!strcmp(argv[argn], "--udev")) {
+            udev = TRUE;
+        } else if (!strcmp(argv[argn], "--watch")) {
+            watch = TRUE;
+        } else if (!strcmp(argv[argn], "--events")) {
+            argn += 1;
+            if (argn >= argc)
+                usage(1);
+            events = argv[argn];
+            watch = TRUE;
         } else if (*(argv[argn] + 1) == '-' && *(argv[argn] + 2) == 'v') {
             printf("stinit v. %s\n", VERSION);
             exit(0);
@@ -917,15 +2765,22 @@ int main(int argc, char **argv)
             usage(1);
     }
 
-    if ((dbf = open_database(dbname)) == NULL)
-        return 1;
-
-    if (parse_only) {
+    if (parse_only && argc > argn)
+        fprintf(stderr, "Extra arguments on command line ignored.\n");
+    i = open_database(dbname, parse_only);
+    if (parse_only || !i)
+        return !i;
+
+    if (match != NULL)
+        return show_match(match);
+    if (deadline > 0 && deadline * 1000 < inquiry_timeout)
+        inquiry_timeout = deadline * 1000;
+    if (udev || watch) {
         if (argc > argn)
             fprintf(stderr, "Extra arguments on command line ignored.\n");
-        if (!find_pars(dbf, "xyz", "xyz", "xyz", &defs, TRUE))
-            return 1;
-        return 0;
+        if (watch)
+            return !watch_tapes(events, &defs, jobs, deadline);
+        return !udev_tape(&defs);
     }
 
     if (argc > argn) { /* Initialize specific drives */
@@ -945,19 +2800,30 @@ int main(int argc, char **argv)
                 fprintf(stderr, "Can't find tape number for name '%s'.\n", argv[argn]);
                 continue;
             }
-            if (!define_tape(tapeno, dbf, &defs, TRUE)) {
+            if (!add_drive(&drives, &ndrives, &maxdrives, tapeno, argv[argn], TRUE)) {
                 fprintf(stderr, "Definition for '%s' failed.\n", argv[argn]);
                 retval = 1;
             }
         }
+        if (run_drives(drives, ndrives, jobs, deadline, &defs, TRUE) < ndrives)
+            retval = 1;
     } else { /* Initialize all SCSI tapes */
-        for (tapeno = 0; tapeno < MAX_TAPES; tapeno++)
-            if (!define_tape(tapeno, dbf, &defs, FALSE)) {
-                fprintf(stderr, "Initialized %d tape device%s.\n", tapeno,
-                        (tapeno != 1 ? "s" : ""));
-                return 0; /* Process tapes until failure */
-            }
+        if ((ntapes = find_tapes(&tapenos)) < 0) {
+            fprintf(stderr, "Can't list the tape devices.\n");
+            return 1;
+        }
+        for (i = 0; i < ntapes; i++)
+            if (!add_drive(&drives, &ndrives, &maxdrives, tapenos[i], NULL, TRUE))
+                retval = 1;
+        free(tapenos);
+        nok = run_drives(drives, ndrives, jobs, deadline, &defs, FALSE);
+        fprintf(stderr, "Initialized %d tape device%s.\n", nok, (nok != 1 ? "s" : ""));
+        if (nok < ndrives)
+            retval = 1;
     }
 
+    for (i = 0; i < ndrives; i++)
+        free(drives[i].fnames[0]);
+    free(drives);
     return retval;
 }